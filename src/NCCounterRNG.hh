@@ -0,0 +1,79 @@
+#ifndef NCPlugin_CounterRNG_hh
+#define NCPlugin_CounterRNG_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+#include <array>
+
+namespace NCPluginNamespace {
+
+  //Counter-based random number stream (Philox4x32-10, as in Salmon et al.,
+  //"Parallel random numbers: as easy as 1, 2, 3", SC11). Each block of four
+  //32bit random words is a pure function of a 64bit seed (the key), a 64bit
+  //stream ID and the index of the block within the stream. So streams need
+  //no shared state and no seeding step: e.g. using the ID of an event as the
+  //stream ID makes its random numbers independent of which thread handles it,
+  //and of the order of the events. Numbers are uniformly distributed in the
+  //open interval (0,1), with 53 random bits each (two per block).
+
+  class PhiloxRNG final : public NC::RNG {
+  public:
+    using Block = std::array<std::uint32_t,4>;
+    using Key = std::array<std::uint32_t,2>;
+
+    PhiloxRNG( std::uint64_t seed, std::uint64_t stream_id )
+      : m_key{ { static_cast<std::uint32_t>( seed ), static_cast<std::uint32_t>( seed >> 32 ) } },
+        m_stream(stream_id)
+    {
+    }
+
+    //The bijection from counter and key to random words:
+    static Block philox4x32( Block ctr, Key key )
+    {
+      constexpr std::uint32_t mul0 = 0xD2511F53;
+      constexpr std::uint32_t mul1 = 0xCD9E8D57;
+      constexpr std::uint32_t weyl0 = 0x9E3779B9;
+      constexpr std::uint32_t weyl1 = 0xBB67AE85;
+      for ( unsigned round = 0; round < 10; ++round ) {
+        if ( round ) {
+          key[0] += weyl0;
+          key[1] += weyl1;
+        }
+        const std::uint64_t p0 = std::uint64_t( mul0 ) * ctr[0];
+        const std::uint64_t p1 = std::uint64_t( mul1 ) * ctr[2];
+        ctr = { { static_cast<std::uint32_t>( p1 >> 32 ) ^ ctr[1] ^ key[0],
+                  static_cast<std::uint32_t>( p1 ),
+                  static_cast<std::uint32_t>( p0 >> 32 ) ^ ctr[3] ^ key[1],
+                  static_cast<std::uint32_t>( p0 ) } };
+      }
+      return ctr;
+    }
+
+  protected:
+    double actualGenerate() override
+    {
+      if ( m_next == 4 ) {
+        m_block = philox4x32( { { static_cast<std::uint32_t>( m_counter ),
+                                  static_cast<std::uint32_t>( m_counter >> 32 ),
+                                  static_cast<std::uint32_t>( m_stream ),
+                                  static_cast<std::uint32_t>( m_stream >> 32 ) } }, m_key );
+        ++m_counter;
+        m_next = 0;
+      }
+      const std::uint64_t bits = ( std::uint64_t( m_block[m_next] ) << 32 ) | m_block[m_next+1];
+      m_next += 2;
+      return ( double( bits >> 11 ) + 0.5 ) * ( 1.0 / 9007199254740992.0 );//2^-53
+    }
+
+  private:
+    Key m_key;
+    std::uint64_t m_stream;
+    std::uint64_t m_counter = 0;
+    Block m_block = {};
+    unsigned m_next = 4;
+  };
+
+}
+
+#endif
@@ -0,0 +1,399 @@
+#include "NCFastSampler.hh"
+#include "NCInstrumentation.hh"
+#include "NCParallel.hh"
+#include <algorithm>
+#include <cmath>
+
+namespace NCPluginNamespace {
+  namespace {
+
+    constexpr double minGuideDensity = 0.25;
+    constexpr double maxGuideDensity = 4.0;
+
+    //Give up on the tables (and use the KernelScatter instead) after this many
+    //rejected attempts:
+    constexpr unsigned maxFastAttempts = 8;
+
+    //Guide table for the non-decreasing cdf[0..n-1], with entry k pointing to
+    //the first point where cdf exceeds the fraction k/nguide of the total:
+    template<class TValue>
+    void fillGuide( const TValue * cdf, std::size_t n, std::uint32_t * guide, std::size_t nguide )
+    {
+      const double total = cdf[n-1];
+      std::size_t i = 0;
+      for ( std::size_t k = 0; k < nguide; ++k ) {
+        const double threshold = total * k / nguide;
+        while ( i + 1 < n && cdf[i] <= threshold )
+          ++i;
+        guide[k] = static_cast<std::uint32_t>( i );
+      }
+    }
+
+    //Index i of the bin [cdf[i],cdf[i+1]) containing x (which must be in
+    //[0,total) for a positive total). Starting from the guide table entry, the
+    //linear search typically takes a single step:
+    template<class TValue>
+    inline std::size_t guidedSearch( const TValue * cdf, std::size_t n,
+                                     const std::uint32_t * guide, std::size_t nguide, double x )
+    {
+      const std::size_t k = static_cast<std::size_t>( x / cdf[n-1] * nguide );
+      std::size_t i = guide[ NC::ncmin( k, nguide - 1 ) ];
+      while ( i + 1 < n && cdf[i] <= x )
+        ++i;
+      return NC::ncmax<std::size_t>( i, 1 ) - 1;
+    }
+
+    //Largest number of alpha grid points falling within one of the nguide
+    //equal intervals of the coordinate u(alpha) spanning the grid:
+    template<class TFct>
+    std::size_t maxPointsPerInterval( const NC::VectD& agrid, std::size_t nguide, TFct u )
+    {
+      const double u0 = u( agrid.front() );
+      const double factor = nguide / ( u( agrid.back() ) - u0 );
+      std::vector<std::size_t> counts( nguide, 0 );
+      for ( double a : agrid )
+        ++counts[ NC::ncmin( static_cast<std::size_t>( ( u( a ) - u0 ) * factor ), nguide - 1 ) ];
+      return *std::max_element( counts.begin(), counts.end() );
+    }
+
+  }
+}
+
+NCP::FastSampler::AlphaScale NCP::FastSampler::chooseAlphaScale( const NC::VectD& agrid,
+                                                                  std::size_t nguide )
+{
+  //The grids written by BzScope are uniform in momentum transfer (i.e. in
+  //sqrt(alpha)), but other grids might be uniform or logarithmic:
+  AlphaScale best = AlphaScale::Linear;
+  std::size_t bestCount = maxPointsPerInterval( agrid, nguide, []( double a ) { return a; } );
+  const std::size_t sqrtCount = maxPointsPerInterval( agrid, nguide, []( double a ) { return std::sqrt( a ); } );
+  if ( sqrtCount < bestCount ) {
+    best = AlphaScale::Sqrt;
+    bestCount = sqrtCount;
+  }
+  if ( agrid.front() > 0.0
+       && maxPointsPerInterval( agrid, nguide, []( double a ) { return std::log( a ); } ) < bestCount )
+    best = AlphaScale::Log;
+  return best;
+}
+
+NCP::FastSampler::FastSampler( std::shared_ptr<const KernelScatter> scatter,
+                               std::size_t memory_budget, unsigned nthreads,
+                               bool lazy_tables )
+  : m_scatter( std::move(scatter) ),
+    m_nbeta( m_scatter->kernel().betaGrid().size() ),
+    m_nalpha( m_scatter->kernel().alphaGrid().size() ),
+    m_kT( m_scatter->kT() ),
+    m_massAMU( m_scatter->kernel().elementMassAMU() )
+{
+  const SparseKernel& knl = m_scatter->kernel();
+  const NC::VectD& egrid = m_scatter->energyGrid();
+  const NC::VectD& agrid = knl.alphaGrid();
+  const std::size_t ne = egrid.size();
+
+  //Densest guide tables fitting in the budget:
+  auto nguide = []( std::size_t n, double density )
+  {
+    return NC::ncmax<std::size_t>( 1, static_cast<std::size_t>( n * density ) );
+  };
+  const std::size_t valueSize = ( knl.singlePrecision() ? sizeof(float) : sizeof(double) );
+  auto tableSize = [&]( double density )
+  {
+    return ne * nguide( m_nbeta, density ) * sizeof(std::uint32_t)
+      + m_nbeta * m_nalpha * 2 * valueSize
+      + ( m_nbeta + 1 ) * nguide( m_nalpha, density ) * sizeof(std::uint32_t);
+  };
+  if ( tableSize( minGuideDensity ) > memory_budget )
+    NCRYSTAL_THROW2(BadInput,"Memory budget of "<<memory_budget*1e-6<<" MB is too small for"
+                    " the fast sampling tables (at least "<<tableSize( minGuideDensity )*1e-6
+                    <<" MB needed)");
+  m_guideDensity = minGuideDensity;
+  while ( m_guideDensity < maxGuideDensity && tableSize( 2 * m_guideDensity ) <= memory_budget )
+    m_guideDensity *= 2;
+  m_nBetaGuide = nguide( m_nbeta, m_guideDensity );
+  m_nAlphaGuide = nguide( m_nalpha, m_guideDensity );
+
+  //Guide table for locating the alpha grid cell of a given alpha value, with
+  //entry k giving the cell containing the lower edge of the k'th of
+  //m_nAlphaGuide equal intervals spanning the alpha grid in the coordinate
+  //alphaCoordinate(alpha). That coordinate is chosen so the grid points are
+  //spread as evenly as possible over the intervals:
+  m_alphaScale = chooseAlphaScale( agrid, m_nAlphaGuide );
+  m_alphaGuideOffset = alphaCoordinate( agrid.front() );
+  m_alphaGuideFactor = m_nAlphaGuide / ( alphaCoordinate( agrid.back() ) - m_alphaGuideOffset );
+  m_alphaCellGuide.resize( m_nAlphaGuide );
+  for ( std::size_t k = 0, i = 0; k < m_nAlphaGuide; ++k ) {
+    const double u = m_alphaGuideOffset + k / m_alphaGuideFactor;
+    while ( i + 2 < m_nalpha && alphaCoordinate( agrid[i+1] ) <= u )
+      ++i;
+    m_alphaCellGuide[k] = static_cast<std::uint32_t>( i );
+  }
+
+  if ( lazy_tables ) {
+    m_lazyColumns = LazyRows<Column>( m_nbeta );
+    m_lazyBetaGuide = LazyRows<std::vector<std::uint32_t>>( ne );
+    return;
+  }
+
+  //Dense kernel columns with their cumulative integrals:
+  m_columnValues = ValueTable( m_nbeta * m_nalpha, knl.singlePrecision() );
+  m_columnCDF = ValueTable( m_nbeta * m_nalpha, knl.singlePrecision() );
+  std::vector<std::uint32_t> alphaGuide( m_nbeta * m_nAlphaGuide );
+  parallelFor( nthreads, m_nbeta, [&]( std::size_t j )
+  {
+    NC::VectD v, cdf;
+    calcColumn( j, v, cdf );
+    for ( std::size_t i = 0; i < m_nalpha; ++i ) {
+      m_columnValues.set( j * m_nalpha + i, v[i] );
+      m_columnCDF.set( j * m_nalpha + i, cdf[i] );
+    }
+    m_columnCDF.visit( [&]( auto cdfs )
+    {
+      fillGuide( cdfs + j * m_nalpha, m_nalpha, &alphaGuide[j*m_nAlphaGuide], m_nAlphaGuide );
+    } );
+  } );
+  m_alphaGuide = TableArray<std::uint32_t>( std::move(alphaGuide) );
+
+  //Guide tables for the beta bins at each energy grid point:
+  std::vector<std::uint32_t> betaGuide( ne * m_nBetaGuide );
+  parallelFor( nthreads, ne, [&]( std::size_t ie )
+  {
+    m_scatter->visitBetaCDF( ie, [&]( auto cdf )
+    {
+      fillGuide( cdf, m_nbeta, &betaGuide[ie*m_nBetaGuide], m_nBetaGuide );
+    } );
+  } );
+  m_betaGuide = TableArray<std::uint32_t>( std::move(betaGuide) );
+}
+
+void NCP::FastSampler::calcColumn( std::size_t ibeta, NC::VectD& v, NC::VectD& cdf ) const
+{
+  const SparseKernel& knl = m_scatter->kernel();
+  const NC::VectD& agrid = knl.alphaGrid();
+  v.resize( m_nalpha );
+  cdf.resize( m_nalpha );
+  for ( std::size_t i = 0; i < m_nalpha; ++i ) {
+    v[i] = knl.evaluate( ibeta, agrid[i] );
+    cdf[i] = ( i ? cdf[i-1] + 0.5 * ( v[i-1] + v[i] ) * ( agrid[i] - agrid[i-1] ) : 0.0 );
+  }
+}
+
+template<class TValue>
+NCP::FastSampler::ColumnTables<TValue> NCP::FastSampler::column( std::size_t ibeta ) const
+{
+  if ( !m_lazyColumns.enabled() )
+    return { m_columnValues.data<TValue>() + ibeta * m_nalpha,
+             m_columnCDF.data<TValue>() + ibeta * m_nalpha,
+             &m_alphaGuide[ibeta*m_nAlphaGuide] };
+  const Column& col = m_lazyColumns.get( ibeta, [this,ibeta]()
+  {
+    const bool sp = m_scatter->kernel().singlePrecision();
+    NC::VectD v, cdf;
+    calcColumn( ibeta, v, cdf );
+    Column c{ ValueTable( std::move(v), sp ), ValueTable( std::move(cdf), sp ),
+              std::vector<std::uint32_t>( m_nAlphaGuide ) };
+    //(guide from the stored values, exactly as for the tables built eagerly):
+    c.cdf.visit( [&]( auto cdfs ) { fillGuide( cdfs, m_nalpha, c.guide.data(), m_nAlphaGuide ); } );
+    return c;
+  } );
+  return { col.values.data<TValue>(), col.cdf.data<TValue>(), col.guide.data() };
+}
+
+const std::uint32_t * NCP::FastSampler::betaGuide( std::size_t ie ) const
+{
+  if ( !m_lazyBetaGuide.enabled() )
+    return &m_betaGuide[ie*m_nBetaGuide];
+  return m_lazyBetaGuide.get( ie, [this,ie]()
+  {
+    std::vector<std::uint32_t> guide( m_nBetaGuide );
+    m_scatter->visitBetaCDF( ie, [&]( auto cdf )
+    {
+      fillGuide( cdf, m_nbeta, guide.data(), m_nBetaGuide );
+    } );
+    return guide;
+  } ).data();
+}
+
+NCP::FastSampler::FastSampler( std::shared_ptr<const KernelScatter> scatter, TableReader& r )
+  : m_scatter( std::move(scatter) ),
+    m_nbeta( m_scatter->kernel().betaGrid().size() ),
+    m_nalpha( m_scatter->kernel().alphaGrid().size() ),
+    m_nBetaGuide( r.get<std::uint64_t>() ),
+    m_nAlphaGuide( r.get<std::uint64_t>() ),
+    m_guideDensity( r.get<double>() ),
+    m_kT( m_scatter->kT() ),
+    m_massAMU( m_scatter->kernel().elementMassAMU() ),
+    m_betaGuide( r.getArray<std::uint32_t>() ),
+    m_columnValues( r.getTable() ),
+    m_columnCDF( r.getTable() ),
+    m_alphaGuide( r.getArray<std::uint32_t>() ),
+    m_alphaCellGuide( r.getVector<std::uint32_t>() ),
+    m_alphaGuideOffset( r.get<double>() ),
+    m_alphaGuideFactor( r.get<double>() )
+{
+  const auto scale = r.get<std::uint32_t>();
+  if ( scale > static_cast<std::uint32_t>( AlphaScale::Log ) )
+    NCRYSTAL_THROW(DataLoadError,"FastSampler: inconsistent tables");
+  m_alphaScale = static_cast<AlphaScale>( scale );
+  const bool sp = m_scatter->kernel().singlePrecision();
+  if ( m_betaGuide.size() != m_scatter->energyGrid().size() * m_nBetaGuide
+       || m_columnValues.size() != m_nbeta * m_nalpha || m_columnCDF.size() != m_nbeta * m_nalpha
+       || m_columnValues.singlePrecision() != sp || m_columnCDF.singlePrecision() != sp
+       || m_alphaGuide.size() != m_nbeta * m_nAlphaGuide || m_alphaCellGuide.size() != m_nAlphaGuide )
+    NCRYSTAL_THROW(DataLoadError,"FastSampler: inconsistent tables");
+}
+
+void NCP::FastSampler::writeTables( TableWriter& w ) const
+{
+  nc_assert_always( !lazyTables() );
+  w.put<std::uint64_t>( m_nBetaGuide );
+  w.put<std::uint64_t>( m_nAlphaGuide );
+  w.put( m_guideDensity );
+  w.putArray( m_betaGuide );
+  w.putTable( m_columnValues );
+  w.putTable( m_columnCDF );
+  w.putArray( m_alphaGuide );
+  w.putArray( m_alphaCellGuide );
+  w.put( m_alphaGuideOffset );
+  w.put( m_alphaGuideFactor );
+  w.put( static_cast<std::uint32_t>( m_alphaScale ) );
+}
+
+template<class TValue>
+double NCP::FastSampler::columnCDF( std::size_t ibeta, double alpha ) const
+{
+  const NC::VectD& agrid = m_scatter->kernel().alphaGrid();
+  if ( !( alpha > agrid.front() ) )
+    return 0.0;
+  const ColumnTables<TValue> col = column<TValue>( ibeta );
+  const TValue * v = col.values;
+  const TValue * cdf = col.cdf;
+  if ( !( alpha < agrid.back() ) )
+    return cdf[m_nalpha-1];
+  const double u = ( alphaCoordinate( alpha ) - m_alphaGuideOffset ) * m_alphaGuideFactor;
+  const std::size_t k = static_cast<std::size_t>( NC::ncmax( 0.0, u ) );
+  std::size_t i = m_alphaCellGuide[ NC::ncmin( k, m_nAlphaGuide - 1 ) ];
+  while ( i + 2 < m_nalpha && agrid[i+1] <= alpha )
+    ++i;
+  const double d = alpha - agrid[i];
+  const double v0 = v[i];
+  const double slope = ( v[i+1] - v0 ) / ( agrid[i+1] - agrid[i] );
+  return cdf[i] + d * ( v0 + 0.5 * slope * d );
+}
+
+template<class TValue>
+double NCP::FastSampler::integrateAlpha( std::size_t ibeta, double ekin_div_kT, double beta,
+                                         double& cdflow ) const
+{
+  double alow, ahigh;
+  alphaLimits( ekin_div_kT, beta, m_massAMU, alow, ahigh );
+  cdflow = columnCDF<TValue>( ibeta, alow );
+  return NC::ncmax( 0.0, columnCDF<TValue>( ibeta, ahigh ) - cdflow );
+}
+
+template<class TValue>
+double NCP::FastSampler::sampleAlpha( std::size_t ibeta, double target ) const
+{
+  const NC::VectD& agrid = m_scatter->kernel().alphaGrid();
+  const ColumnTables<TValue> col = column<TValue>( ibeta );
+  const TValue * v = col.values;
+  const TValue * cdf = col.cdf;
+  const std::size_t i = guidedSearch( cdf, m_nalpha, col.guide, m_nAlphaGuide, target );
+  //Invert the linear density within the cell:
+  const double t = NC::ncmax( 0.0, target - cdf[i] );
+  const double v0 = v[i];
+  const double slope = ( v[i+1] - v0 ) / ( agrid[i+1] - agrid[i] );
+  const double disc = NC::ncmax( 0.0, v0 * v0 + 2.0 * slope * t );
+  const double denom = v0 + std::sqrt( disc );
+  const double d = ( denom > 0.0 ? 2.0 * t / denom : 0.0 );
+  return NC::ncclamp( agrid[i] + d, agrid[i], agrid[i+1] );
+}
+
+template<class TValue>
+bool NCP::FastSampler::trySample( const TValue * cdf, std::size_t ie, double ekin,
+                                  NC::RNG& rng, Outcome& outcome ) const
+{
+  if ( !( cdf[m_nbeta-1] > 0.0 ) )
+    return false;
+
+  //Beta bin from the table, and beta within the bin from the kernel at the
+  //actual neutron energy:
+  const std::size_t j = guidedSearch( cdf, m_nbeta, betaGuide( ie ), m_nBetaGuide,
+                                      rng.generate() * cdf[m_nbeta-1] );
+  const NC::VectD& bgrid = m_scatter->kernel().betaGrid();
+  const double bA = bgrid[j];
+  const double bB = bgrid[j+1];
+  const double ekin_div_kT = ekin / m_kT;
+  if ( !( bB > -ekin_div_kT ) )
+    return false;
+  double cdflow;
+  const double IA = ( bA > -ekin_div_kT ? integrateAlpha<TValue>( j, ekin_div_kT, bA, cdflow ) : 0.0 );
+  const double IB = integrateAlpha<TValue>( j + 1, ekin_div_kT, bB, cdflow );
+  if ( !( IA + IB > 0.0 ) )
+    return false;
+  const double beta = sampleLinear( NC::ncmax( bA, -ekin_div_kT ), bB, IA, IB, rng.generate() );
+
+  //Alpha from one of the two bracketing columns, in proportion to their
+  //interpolation weights:
+  const double u = ( beta - bA ) / ( bB - bA );
+  const double wA = ( 1.0 - u ) * IA;
+  const double wB = u * IB;
+  const std::size_t jcol = ( rng.generate() * ( wA + wB ) < wA ? j : j + 1 );
+  const double W = integrateAlpha<TValue>( jcol, ekin_div_kT, beta, cdflow );
+  if ( !( W > 0.0 ) )
+    return false;
+  const double alpha = sampleAlpha<TValue>( jcol, cdflow + rng.generate() * W );
+
+  const double ekin_final = ekin + beta * m_kT;
+  if ( !( ekin_final > 0.0 ) )
+    return false;
+  const double mu = ( ekin + ekin_final - alpha * m_massAMU * m_kT )
+    / ( 2.0 * std::sqrt( ekin * ekin_final ) );
+  outcome.ekin_final = ekin_final;
+  outcome.mu = NC::ncclamp( mu, -1.0, 1.0 );
+  return true;
+}
+
+NCP::FastSampler::Outcome NCP::FastSampler::sampleScatteringEvent( NC::RNG& rng, double ekin ) const
+{
+  return sampleScatteringEvent( rng, m_scatter->lookup( ekin ) );
+}
+
+NCP::FastSampler::Outcome NCP::FastSampler::sampleScatteringEvent( NC::RNG& rng,
+                                                                   const KernelScatter::GridLookup& gl ) const
+{
+  const double ekin = gl.ekin;
+  Outcome outcome{ ekin, 1.0 };
+  if ( gl.wlow + gl.whigh > 0.0 ) {
+    for ( unsigned attempt = 0; attempt < maxFastAttempts; ++attempt ) {
+      const std::size_t ie = ( rng.generate() * ( gl.wlow + gl.whigh ) < gl.wlow ? gl.ilow : gl.ihigh );
+      const bool ok = m_scatter->visitBetaCDF( ie, [&]( auto cdf )
+      {
+        return trySample( cdf, ie, ekin, rng, outcome );
+      } );
+      if ( ok ) {
+        if ( attempt && instrumentationEnabled() )
+          addCount( Counter::RejectedSamples, attempt );
+        return outcome;
+      }
+    }
+    if ( instrumentationEnabled() )
+      addCount( Counter::RejectedSamples, maxFastAttempts );
+  }
+  return m_scatter->sampleScatteringEvent( rng, gl );
+}
+
+std::size_t NCP::FastSampler::memoryUsage() const
+{
+  //(lazy tables are counted as far as they are built):
+  const std::size_t valueSize = ( m_scatter->kernel().singlePrecision() ? sizeof(float) : sizeof(double) );
+  const std::size_t lazyBytes
+    = m_lazyColumns.nBuilt() * ( sizeof(Column) + 2 * m_nalpha * valueSize
+                                 + m_nAlphaGuide * sizeof(std::uint32_t) )
+    + m_lazyBetaGuide.nBuilt() * ( sizeof(std::vector<std::uint32_t>)
+                                   + m_nBetaGuide * sizeof(std::uint32_t) );
+  return sizeof(*this)
+    + m_columnValues.memoryUsage() + m_columnCDF.memoryUsage()
+    + m_betaGuide.memoryUsage() + m_alphaGuide.memoryUsage()
+    + sizeof(std::uint32_t) * m_alphaCellGuide.capacity() + lazyBytes;
+}
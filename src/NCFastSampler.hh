@@ -0,0 +1,135 @@
+#ifndef NCPlugin_FastSampler_hh
+#define NCPlugin_FastSampler_hh
+
+#include "NCKernelScatter.hh"
+#include "NCLazyRows.hh"
+
+namespace NCPluginNamespace {
+
+  //Table-based sampling of scattering events, with O(1) expected work per
+  //event, as an alternative to the sampling in KernelScatter (which searches
+  //the beta tables and integrates the kernel columns for every event).
+  //
+  //The sampling follows the same steps as in KernelScatter, but every search
+  //is replaced by a guide table lookup (Chen & Asau), so the bin is typically
+  //found with a single comparison: for each point of the energy grid, a guide
+  //table into the cumulative beta distribution is kept, while each kernel
+  //column is kept in a dense cumulative form with guide tables into both the
+  //alpha grid and the cumulative values. The alpha integrals over the
+  //kinematically allowed range at the actual neutron energy are then found
+  //without any search, and alpha is sampled from the piecewise-linear kernel
+  //by exact inversion. The sampled distributions are therefore the same as
+  //those of KernelScatter. If an energy grid point gives no allowed outcome at
+  //the actual neutron energy, the attempt is repeated, and after a few such
+  //attempts the event is sampled by the KernelScatter instead.
+  //
+  //All tables are stored in single precision if the kernel is.
+  //
+  //With lazy tables, the guide table of each energy grid point and the tables
+  //of each kernel column are only built the first time they are needed (see
+  //NCLazyRows.hh). Since a narrow band of neutron energies only reaches the
+  //columns with beta>-ekin/kT, the columns of large energy losses are then
+  //never built. Lazy tables can not be written with writeTables.
+  //
+  //The guide tables have guideDensity() entries per grid point, chosen as the
+  //largest power of two (up to 4) for which all tables fit within the given
+  //memory budget. BadInput is raised if not even the minimal tables (with
+  //density 1/4) fit.
+
+  class FastSampler final : public NC::MoveOnly {
+  public:
+
+    FastSampler( std::shared_ptr<const KernelScatter>, std::size_t memory_budget,
+                 unsigned nthreads = 1, bool lazy_tables = false );
+
+    //Tables written with writeTables (see SharedTables):
+    FastSampler( std::shared_ptr<const KernelScatter>, TableReader& );
+    void writeTables( TableWriter& ) const;//excluding the KernelScatter
+
+    const KernelScatter& scatter() const { return *m_scatter; }
+
+    using Outcome = KernelScatter::Outcome;
+    Outcome sampleScatteringEvent( NC::RNG& rng, double neutron_ekin ) const;
+    Outcome sampleScatteringEvent( NC::RNG& rng, const KernelScatter::GridLookup& ) const;
+
+    double guideDensity() const { return m_guideDensity; }
+    bool lazyTables() const { return m_lazyColumns.enabled(); }
+    //Number of energy grid points with guide tables built (so far, with lazy
+    //tables):
+    std::size_t nBuiltTables() const
+    {
+      return lazyTables() ? m_lazyBetaGuide.nBuilt() : m_scatter->energyGrid().size();
+    }
+    std::size_t memoryUsage() const;//excluding the KernelScatter
+
+  private:
+    std::shared_ptr<const KernelScatter> m_scatter;
+    std::size_t m_nbeta;
+    std::size_t m_nalpha;
+    std::size_t m_nBetaGuide;//guide table entries per energy grid point
+    std::size_t m_nAlphaGuide;//guide table entries per kernel column
+    double m_guideDensity;
+    double m_kT;
+    double m_massAMU;
+    //For each energy grid point:
+    TableArray<std::uint32_t> m_betaGuide;
+    //For each kernel column (i.e. beta grid point), at each alpha grid point
+    //(in the precision of the kernel):
+    ValueTable m_columnValues;
+    ValueTable m_columnCDF;
+    TableArray<std::uint32_t> m_alphaGuide;
+    //For finding the alpha grid cell of a given alpha value, with a guide
+    //table over a coordinate in which the alpha grid is roughly uniform:
+    enum class AlphaScale : std::uint32_t { Linear, Sqrt, Log };
+    static AlphaScale chooseAlphaScale( const NC::VectD& agrid, std::size_t nguide );
+    double alphaCoordinate( double alpha ) const
+    {
+      return ( m_alphaScale == AlphaScale::Linear ? alpha
+               : ( m_alphaScale == AlphaScale::Sqrt ? std::sqrt( alpha ) : std::log( alpha ) ) );
+    }
+    std::vector<std::uint32_t> m_alphaCellGuide;
+    AlphaScale m_alphaScale = AlphaScale::Linear;
+    double m_alphaGuideOffset;
+    double m_alphaGuideFactor;
+    //Instead of m_betaGuide, m_columnValues, m_columnCDF and m_alphaGuide with
+    //lazy tables:
+    struct Column {
+      ValueTable values;
+      ValueTable cdf;
+      std::vector<std::uint32_t> guide;
+    };
+    LazyRows<std::vector<std::uint32_t>> m_lazyBetaGuide;
+    LazyRows<Column> m_lazyColumns;
+
+    //Kernel column values and cumulative integrals at each alpha grid point
+    //(the kernel is linear in alpha between grid points, so the trapezoidal
+    //rule is exact):
+    void calcColumn( std::size_t ibeta, NC::VectD& values, NC::VectD& cdf ) const;
+    //Table access (building lazy tables first if needed):
+    template<class TValue>
+    struct ColumnTables {
+      const TValue * values;
+      const TValue * cdf;
+      const std::uint32_t * guide;
+    };
+    template<class TValue>
+    ColumnTables<TValue> column( std::size_t ibeta ) const;
+    const std::uint32_t * betaGuide( std::size_t ie ) const;
+
+    //Column CDF at alpha, and the integral of the column over the alpha range
+    //allowed at the given beta and ekin/kT (with the CDF at the lower end of
+    //that range in cdflow). TValue is the storage type of the tables:
+    template<class TValue>
+    double columnCDF( std::size_t ibeta, double alpha ) const;
+    template<class TValue>
+    double integrateAlpha( std::size_t ibeta, double ekin_div_kT, double beta, double& cdflow ) const;
+    //Inverse of the column CDF:
+    template<class TValue>
+    double sampleAlpha( std::size_t ibeta, double target ) const;
+    template<class TValue>
+    bool trySample( const TValue * betaCDF, std::size_t ie, double ekin, NC::RNG&, Outcome& ) const;
+  };
+
+}
+
+#endif
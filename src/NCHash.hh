@@ -0,0 +1,39 @@
+#ifndef NCPlugin_Hash_hh
+#define NCPlugin_Hash_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+#include <cstring>
+
+namespace NCPluginNamespace {
+
+  //64bit FNV-1a hash, used for the keys of cached and shared data. Hash
+  //several pieces of data by passing the result for one as h for the next:
+  constexpr std::uint64_t fnvOffset = 0xcbf29ce484222325ULL;
+  constexpr std::uint64_t fnvPrime = 0x100000001b3ULL;
+  inline std::uint64_t fnv1a( std::uint64_t h, const void * data, std::size_t n )
+  {
+    auto p = static_cast<const unsigned char*>(data);
+    for ( std::size_t i = 0; i < n; ++i )
+      h = ( h ^ p[i] ) * fnvPrime;
+    return h;
+  }
+
+  //Variant consuming 8 bytes at a time (so checking large files stays fast),
+  //for data padded to a multiple of 8 bytes:
+  inline std::uint64_t fnv1aWords( const char * data, std::size_t n )
+  {
+    nc_assert( n % 8 == 0 );
+    std::uint64_t h = fnvOffset;
+    for ( std::size_t i = 0; i < n; i += 8 ) {
+      std::uint64_t w;
+      std::memcpy( &w, data + i, 8 );
+      h = ( h ^ w ) * fnvPrime;
+    }
+    return h;
+  }
+
+}
+
+#endif
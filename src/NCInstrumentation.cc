@@ -0,0 +1,169 @@
+#include "NCInstrumentation.hh"
+#include "NCPluginOptions.hh"
+#include <algorithm>
+#include <mutex>
+
+namespace NCPluginNamespace {
+  namespace {
+
+    constexpr unsigned ncounters = static_cast<unsigned>( Counter::N );
+
+    struct ThreadCounters;
+
+    struct Registry {
+      std::mutex mtx;
+      std::vector<ThreadCounters*> threads;
+      unsigned nThreadsSeen = 0;
+      std::uint64_t retired[ncounters] = {};//from threads which have ended
+      std::vector<InstrumentationReport::Phase> phases;
+      std::size_t kernelMemory = 0;
+      std::size_t tableMemory = 0;
+    };
+
+    Registry& registry()
+    {
+      //Intentionally leaked, so it is still available while the thread_local
+      //counters of the main thread are destroyed at exit:
+      static Registry * reg = new Registry;
+      return *reg;
+    }
+
+    //The counters of each thread are only written by that thread, so
+    //increments need no atomic read-modify-write operations (the atomics only
+    //make it safe to read them from other threads):
+    struct ThreadCounters {
+      std::atomic<std::uint64_t> values[ncounters] = {};
+      ThreadCounters()
+      {
+        auto& reg = registry();
+        std::lock_guard<std::mutex> lock( reg.mtx );
+        reg.threads.push_back( this );
+        ++reg.nThreadsSeen;
+      }
+      ~ThreadCounters()
+      {
+        auto& reg = registry();
+        std::lock_guard<std::mutex> lock( reg.mtx );
+        for ( unsigned i = 0; i < ncounters; ++i )
+          reg.retired[i] += values[i].load( std::memory_order_relaxed );
+        reg.threads.erase( std::find( reg.threads.begin(), reg.threads.end(), this ) );
+      }
+    };
+
+    thread_local ThreadCounters threadCounters;
+
+    //Evaluated when the plugin is loaded, so invalid values can not be
+    //reported with an exception and are simply treated as "0":
+    bool enabledFromEnvironment()
+    {
+      return getOptionStr( "STATS" ) == "1";
+    }
+
+  }
+}
+
+std::atomic<bool> NCP::detail::instrumentationFlag{ enabledFromEnvironment() };
+
+namespace NCPluginNamespace {
+  namespace {
+
+    //Prints the summary when static objects are destroyed, i.e. at exit or
+    //when the plugin is unloaded (unlike std::atexit handlers, which would
+    //then point into unmapped code):
+    struct ReportAtExit {
+      const bool enabled = detail::instrumentationFlag.load();
+      ~ReportAtExit()
+      {
+        if ( enabled && instrumentationEnabled() )
+          printInstrumentationReport();
+      }
+    } reportAtExit;
+
+  }
+}
+
+void NCP::setInstrumentationEnabled( bool enable )
+{
+  detail::instrumentationFlag.store( enable, std::memory_order_relaxed );
+}
+
+void NCP::addCount( Counter c, std::uint64_t n )
+{
+  auto& v = threadCounters.values[static_cast<unsigned>(c)];
+  v.store( v.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+}
+
+void NCP::addMemoryUsage( std::size_t kernel_bytes, std::size_t table_bytes )
+{
+  if ( !instrumentationEnabled() )
+    return;
+  auto& reg = registry();
+  std::lock_guard<std::mutex> lock( reg.mtx );
+  reg.kernelMemory += kernel_bytes;
+  reg.tableMemory += table_bytes;
+}
+
+void NCP::PhaseTimer::record()
+{
+  const double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - m_t0 ).count();
+  auto& reg = registry();
+  std::lock_guard<std::mutex> lock( reg.mtx );
+  for ( auto& p : reg.phases ) {
+    if ( p.name == m_phase ) {
+      ++p.count;
+      p.seconds += seconds;
+      return;
+    }
+  }
+  reg.phases.push_back( { m_phase, 1, seconds } );
+}
+
+NCP::InstrumentationReport NCP::getInstrumentationReport()
+{
+  InstrumentationReport report;
+  auto& reg = registry();
+  std::lock_guard<std::mutex> lock( reg.mtx );
+  report.phases = reg.phases;
+  report.kernelMemory = reg.kernelMemory;
+  report.tableMemory = reg.tableMemory;
+  report.nThreads = reg.nThreadsSeen;
+  for ( unsigned i = 0; i < ncounters; ++i ) {
+    report.counters[i] = reg.retired[i];
+    for ( auto t : reg.threads )
+      report.counters[i] += t->values[i].load( std::memory_order_relaxed );
+  }
+  return report;
+}
+
+void NCP::resetInstrumentation()
+{
+  auto& reg = registry();
+  std::lock_guard<std::mutex> lock( reg.mtx );
+  reg.phases.clear();
+  reg.kernelMemory = reg.tableMemory = 0;
+  reg.nThreadsSeen = static_cast<unsigned>( reg.threads.size() );
+  for ( unsigned i = 0; i < ncounters; ++i ) {
+    reg.retired[i] = 0;
+    //Only approximate for threads currently updating their counters:
+    for ( auto t : reg.threads )
+      t->values[i].store( 0, std::memory_order_relaxed );
+  }
+}
+
+void NCP::printInstrumentationReport()
+{
+  const auto report = getInstrumentationReport();
+  NCPLUGIN_MSG("Instrumentation summary:");
+  for ( const auto& p : report.phases )
+    NCPLUGIN_MSG("  phase \""<<p.name<<"\": "<<p.seconds*1e3<<" ms ("<<p.count<<" times)");
+  NCPLUGIN_MSG("  kernel memory: "<<report.kernelMemory*1e-6<<" MB, table memory: "
+               <<report.tableMemory*1e-6<<" MB");
+  NCPLUGIN_MSG("  cross section evaluations: "<<report.count( Counter::XSCalls ));
+  NCPLUGIN_MSG("  sampled scattering events: "<<report.count( Counter::SampleCalls ));
+  NCPLUGIN_MSG("  rejected sampling attempts: "<<report.count( Counter::RejectedSamples )
+               <<" (fallbacks to exact sampling tables: "
+               <<report.count( Counter::ExactSampleFallbacks )<<")");
+  NCPLUGIN_MSG("  energy grid lookups reused from cache: "<<report.count( Counter::CachedLookups ));
+  NCPLUGIN_MSG("  lazily built sampling table rows: "<<report.count( Counter::LazyRowsBuilt ));
+  NCPLUGIN_MSG("  threads: "<<report.nThreads);
+}
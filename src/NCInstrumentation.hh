@@ -0,0 +1,85 @@
+#ifndef NCPlugin_Instrumentation_hh
+#define NCPlugin_Instrumentation_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace NCPluginNamespace {
+
+  //Opt-in instrumentation of the plugin, enabled by setting the environment
+  //variable NCPLUGIN_BZSCOPE_STATS=1 (in which case a summary is printed at
+  //exit or when the plugin is unloaded), or by calling
+  //setInstrumentationEnabled(true). It records:
+  //
+  //  * Wall time of each phase of the model construction (parsing, kernel
+  //    cache access, conversion to the SAB format, integrator setup, table
+  //    building, ...), accumulated over all models built.
+  //  * Memory used by the kernels and by the tables built from them.
+  //  * Per-thread counters of cross section evaluations, sampled scattering
+  //    events and rejected sampling attempts (the latter only in the sparse
+  //    kernel mode, as the dense mode samples inside NCrystal), of energy grid
+  //    lookups reused from the NC::CachePtr of the caller, and of sampling
+  //    table rows built on first use (with the lazyTables option).
+  //
+  //When disabled, the only cost is a check of a relaxed atomic flag at each
+  //instrumentation point.
+
+  namespace detail { extern std::atomic<bool> instrumentationFlag; }
+
+  inline bool instrumentationEnabled()
+  {
+    return detail::instrumentationFlag.load( std::memory_order_relaxed );
+  }
+  void setInstrumentationEnabled( bool );
+
+  enum class Counter : unsigned { XSCalls, SampleCalls, RejectedSamples, ExactSampleFallbacks,
+                                  CachedLookups, LazyRowsBuilt, N };
+
+  //Add to a counter of the calling thread (should only be called when
+  //instrumentationEnabled() is true):
+  void addCount( Counter, std::uint64_t n = 1 );
+
+  //Add memory usage of a newly built kernel model:
+  void addMemoryUsage( std::size_t kernel_bytes, std::size_t table_bytes );
+
+  //Times the phase from construction to destruction or stop() (does nothing
+  //if instrumentation was disabled at construction). Phase names must be
+  //string literals:
+  class PhaseTimer final : NC::NoCopyMove {
+  public:
+    explicit PhaseTimer( const char * phase )
+      : m_phase( instrumentationEnabled() ? phase : nullptr )
+    {
+      if ( m_phase )
+        m_t0 = std::chrono::steady_clock::now();
+    }
+    ~PhaseTimer() { stop(); }
+    void stop() { if ( m_phase ) { record(); m_phase = nullptr; } }
+  private:
+    const char * m_phase;
+    std::chrono::steady_clock::time_point m_t0;
+    void record();
+  };
+
+  //Query the information collected so far (including the counters of threads
+  //which are still running):
+  struct InstrumentationReport {
+    struct Phase { std::string name; std::uint64_t count; double seconds; };
+    std::vector<Phase> phases;//in order of first occurrence
+    std::size_t kernelMemory = 0;
+    std::size_t tableMemory = 0;
+    std::uint64_t counters[static_cast<unsigned>(Counter::N)] = {};
+    unsigned nThreads = 0;//threads which have updated counters
+    std::uint64_t count( Counter c ) const { return counters[static_cast<unsigned>(c)]; }
+  };
+  InstrumentationReport getInstrumentationReport();
+  void resetInstrumentation();
+  void printInstrumentationReport();//via NCPLUGIN_MSG
+
+}
+
+#endif
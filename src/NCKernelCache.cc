@@ -0,0 +1,218 @@
+#include "NCKernelCache.hh"
+#include "NCHash.hh"
+#include "NCKernelFile.hh"
+#include "NCPluginOptions.hh"
+#include "NCrystal/internal/utils/NCMsg.hh"
+#include <atomic>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#ifdef _WIN32
+#  include <process.h>
+#else
+#  include <unistd.h>
+#endif
+
+namespace NCPluginNamespace {
+  namespace {
+
+    //Bump whenever the layout of the files changes:
+    constexpr std::uint32_t cacheFormatVersion = 1;
+    constexpr char cacheMagic[8] = { 'N','C','B','Z','S','K','C','\0' };
+    constexpr std::uint32_t endianMarker = 0x01020304;
+
+    class Writer {
+    public:
+      template<class T>
+      void put( const T& t ) { putRaw( &t, sizeof(T) ); }
+      void putVect( const NC::VectD& v )
+      {
+        put<std::uint64_t>( v.size() );
+        putRaw( v.data(), v.size()*sizeof(double) );
+      }
+      void putRaw( const void * data, std::size_t n )
+      {
+        auto p = static_cast<const char*>(data);
+        m_buf.insert( m_buf.end(), p, p + n );
+      }
+      const std::vector<char>& buffer() const { return m_buf; }
+    private:
+      std::vector<char> m_buf;
+    };
+
+    inline long processId()
+    {
+#ifdef _WIN32
+      return ::_getpid();
+#else
+      return ::getpid();
+#endif
+    }
+
+    class Reader {
+    public:
+      Reader( const char * data, std::size_t n ) : m_it(data), m_end(data+n) {}
+      template<class T>
+      bool get( T& t ) { return getRaw( &t, sizeof(T) ); }
+      bool getVect( NC::VectD& v )
+      {
+        std::uint64_t n;
+        if ( !get(n) || n > std::uint64_t(m_end-m_it)/sizeof(double) )
+          return false;
+        v.resize( n );
+        return getRaw( v.data(), n*sizeof(double) );
+      }
+      bool getRaw( void * data, std::size_t n )
+      {
+        if ( std::size_t(m_end-m_it) < n )
+          return false;
+        std::memcpy( data, m_it, n );
+        m_it += n;
+        return true;
+      }
+      bool atEnd() const { return m_it == m_end; }
+    private:
+      const char * m_it;
+      const char * m_end;
+    };
+
+  }
+}
+
+NCP::KernelCache::KernelCache( const NC::Info::CustomSectionData& data,
+                               NC::Temperature temperature,
+                               const KernelFile * kernelfile )
+  : m_key(fnvOffset)
+{
+  const char wordsep = ' ';
+  const char linesep = '\n';
+  for ( const auto& line : data ) {
+    for ( const auto& word : line ) {
+      m_key = fnv1a( m_key, word.data(), word.size() );
+      m_key = fnv1a( m_key, &wordsep, 1 );
+    }
+    m_key = fnv1a( m_key, &linesep, 1 );
+  }
+  //Sections referring to a kernel file are keyed by the content of the file
+  //as well, while the file itself makes the on-disk cache redundant:
+  const auto opened = ( kernelfile ? nullptr : KernelFile::open( data ) );
+  if ( opened )
+    kernelfile = opened.get();
+  if ( kernelfile ) {
+    const std::uint64_t filekey = kernelfile->checksum();
+    m_key = fnv1a( m_key, &filekey, sizeof(filekey) );
+  }
+  const double tval = temperature.dbl();
+  m_key = fnv1a( m_key, &tval, sizeof(tval) );
+
+  std::string dir = getOptionStr("CACHEDIR");
+  if ( dir.empty() || kernelfile )
+    return;
+  if ( dir.back() != '/' )
+    dir += '/';
+  char keystr[17];
+  std::snprintf( keystr, sizeof(keystr), "%016llx",
+                 static_cast<unsigned long long>(m_key) );
+  m_path = dir + pluginName() + "_" + keystr + ".bzkc";
+}
+
+bool NCP::KernelCache::load( NC::ScatKnlData& out ) const
+{
+  if ( !enabled() )
+    return false;
+  std::ifstream fh( m_path, std::ios::binary | std::ios::ate );
+  if ( !fh.good() )
+    return false;
+  const auto fsize = static_cast<std::size_t>( fh.tellg() );
+  std::uint64_t checksum;
+  if ( fsize < sizeof(cacheMagic) + sizeof(checksum) )
+    return false;
+  std::vector<char> buf( fsize );
+  fh.seekg( 0 );
+  if ( !fh.read( buf.data(), fsize ) )
+    return false;
+
+  //Checksum is appended after the payload:
+  const std::size_t npayload = fsize - sizeof(checksum);
+  std::memcpy( &checksum, buf.data() + npayload, sizeof(checksum) );
+  if ( checksum != fnv1a( fnvOffset, buf.data(), npayload ) )
+    return false;
+
+  Reader r( buf.data(), npayload );
+  char magic[sizeof(cacheMagic)];
+  std::uint32_t version, endian, knltype, betaGridOptimised;
+  std::uint64_t key;
+  double temperature, boundXS, massAMU, suggestedEmax;
+  NC::ScatKnlData res;
+  bool ok = r.getRaw( magic, sizeof(magic) )
+    && std::memcmp( magic, cacheMagic, sizeof(magic) ) == 0
+    && r.get( version ) && version == cacheFormatVersion
+    && r.get( endian ) && endian == endianMarker
+    && r.get( key ) && key == m_key
+    && r.get( temperature ) && r.get( boundXS ) && r.get( massAMU )
+    && r.get( suggestedEmax ) && r.get( knltype ) && r.get( betaGridOptimised )
+    && r.getVect( res.alphaGrid ) && r.getVect( res.betaGrid )
+    && r.getVect( res.sab ) && r.atEnd();
+  if ( !ok )
+    return false;
+  using KnlType = NC::ScatKnlData::KnlType;
+  if ( knltype == static_cast<std::uint32_t>(KnlType::SAB) )
+    res.knltype = KnlType::SAB;
+  else if ( knltype == static_cast<std::uint32_t>(KnlType::SCALED_SYM_SAB) )
+    res.knltype = KnlType::SCALED_SYM_SAB;
+  else
+    return false;
+  if ( res.alphaGrid.empty() || res.betaGrid.empty()
+       || res.alphaGrid.size()*res.betaGrid.size() != res.sab.size() )
+    return false;
+  res.temperature = NC::Temperature{ temperature };
+  res.boundXS = NC::SigmaBound{ boundXS };
+  res.elementMassAMU = NC::AtomMass{ massAMU };
+  res.suggestedEmax = suggestedEmax;
+  res.betaGridOptimised = ( betaGridOptimised != 0 );
+  out = std::move( res );
+  return true;
+}
+
+void NCP::KernelCache::store( const NC::ScatKnlData& data ) const
+{
+  if ( !enabled() )
+    return;
+  Writer w;
+  w.putRaw( cacheMagic, sizeof(cacheMagic) );
+  w.put( cacheFormatVersion );
+  w.put( endianMarker );
+  w.put( m_key );
+  w.put( data.temperature.dbl() );
+  w.put( data.boundXS.dbl() );
+  w.put( data.elementMassAMU.dbl() );
+  w.put( data.suggestedEmax );
+  w.put( static_cast<std::uint32_t>( data.knltype ) );
+  w.put( static_cast<std::uint32_t>( data.betaGridOptimised ? 1 : 0 ) );
+  w.putVect( data.alphaGrid );
+  w.putVect( data.betaGrid );
+  w.putVect( data.sab );
+  const auto& buf = w.buffer();
+  const std::uint64_t checksum = fnv1a( fnvOffset, buf.data(), buf.size() );
+
+  //Write to a unique temporary file and rename it into place, so concurrent
+  //processes never see partially written entries:
+  static std::atomic<unsigned> counter{ 0 };
+  const std::string tmppath = m_path + ".tmp" + std::to_string( processId() )
+    + "_" + std::to_string( counter++ );
+  {
+    std::ofstream fh( tmppath, std::ios::binary | std::ios::trunc );
+    fh.write( buf.data(), buf.size() );
+    fh.write( reinterpret_cast<const char*>(&checksum), sizeof(checksum) );
+    if ( !fh.good() ) {
+      fh.close();
+      std::remove( tmppath.c_str() );
+      NCPLUGIN_WARN("Could not write kernel cache file " << tmppath);
+      return;
+    }
+  }
+  if ( std::rename( tmppath.c_str(), m_path.c_str() ) != 0 ) {
+    std::remove( tmppath.c_str() );
+    NCPLUGIN_WARN("Could not create kernel cache file " << m_path);
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef NCPlugin_KernelCache_hh
+#define NCPlugin_KernelCache_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+
+namespace NCPluginNamespace {
+
+  //Persistent on-disk cache of kernels parsed from @CUSTOM_BZSCOPE sections,
+  //which lets short-lived processes skip the text parsing of the (very large)
+  //sections. The cache is only active when the NCPLUGIN_BZSCOPE_CACHEDIR
+  //environment variable is set to a writable directory. Each entry is a
+  //versioned binary file, keyed by a hash of the section content and the
+  //material temperature. Missing, stale or corrupt entries are simply treated
+  //as cache misses, and failures to write new entries only result in a warning.
+  //Sections referring to a binary kernel file (see NCKernelFile.hh) are never
+  //cached, but their keys include the checksum of the file.
+
+  class KernelFile;
+
+  class KernelCache final : public NC::MoveOnly {
+  public:
+
+    KernelCache( const NC::Info::CustomSectionData&, NC::Temperature,
+                 const KernelFile* = nullptr );//see KernelFile::open
+
+    bool enabled() const { return !m_path.empty(); }
+    std::uint64_t key() const { return m_key; }
+
+    //Returns false (leaving the argument untouched) if no valid entry exists:
+    bool load( NC::ScatKnlData& ) const;
+    void store( const NC::ScatKnlData& ) const;
+
+  private:
+    std::string m_path;
+    std::uint64_t m_key;
+  };
+
+}
+
+#endif
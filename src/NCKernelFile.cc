@@ -0,0 +1,348 @@
+#include "NCKernelFile.hh"
+#include "NCHash.hh"
+#include "NCKernelParser.hh"
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <dlfcn.h>
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+namespace NCPluginNamespace {
+  namespace {
+
+    //Bump whenever the layout of the files changes (and update the converter
+    //script accordingly):
+    constexpr std::uint32_t kernelFileFormatVersion = 1;
+    constexpr char kernelFileMagic[8] = { 'N','C','B','Z','S','K','F','\0' };
+    constexpr std::uint32_t endianMarker = 0x01020304;
+
+    struct Header {
+      char magic[8];
+      std::uint32_t version;
+      std::uint32_t endian;
+      std::uint64_t payloadSize;
+      std::uint64_t checksum;
+    };
+
+    //Start of the payload, followed by the grids and kernel values:
+    struct Fields {
+      double temperature;
+      std::uint32_t knltype;//0: sab_scaled, 1: sab
+      std::uint32_t reserved;
+      std::uint64_t nalpha;
+      std::uint64_t nbeta;
+    };
+
+    static_assert( sizeof(Header) == 32 && sizeof(Fields) == 32,
+                   "Kernel file layout must not depend on the compiler" );
+
+#ifdef _WIN32
+    bool isFile( const std::string& path )
+    {
+      std::error_code ec;
+      return std::filesystem::is_regular_file( path, ec );
+    }
+
+    //Path of the plugin library (empty if not found):
+    std::string libraryPath()
+    {
+      static const char anchor = 0;
+      HMODULE module = nullptr;
+      char buf[4096];
+      if ( !::GetModuleHandleExA( GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
+                                  | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                                  &anchor, &module ) )
+        return {};
+      const DWORD n = ::GetModuleFileNameA( module, buf, sizeof(buf) );
+      return ( n > 0 && n < sizeof(buf) ) ? std::string( buf, n ) : std::string();
+    }
+#else
+    class Mapping final : public NC::MoveOnly {
+    public:
+      Mapping( void * addr, std::size_t size ) : m_addr(addr), m_size(size) {}
+      ~Mapping() { ::munmap( m_addr, m_size ); }
+      const char * data() const { return static_cast<const char*>( m_addr ); }
+    private:
+      void * m_addr;
+      std::size_t m_size;
+    };
+
+    bool isFile( const std::string& path )
+    {
+      struct stat st;
+      return ::stat( path.c_str(), &st ) == 0 && S_ISREG( st.st_mode );
+    }
+
+    //Path of the plugin library (empty if not found):
+    std::string libraryPath()
+    {
+      static const char anchor = 0;
+      Dl_info dlinfo;
+      if ( !::dladdr( &anchor, &dlinfo ) || !dlinfo.dli_fname )
+        return {};
+      return dlinfo.dli_fname;
+    }
+#endif
+
+    //Data directory of the plugin, which CMakeLists.txt installs next to the
+    //directory of the plugin library (empty if the library is not found):
+    std::string pluginDataDir()
+    {
+      std::string dir = libraryPath();
+      if ( dir.empty() )
+        return {};
+      for ( int i = 0; i < 2; ++i ) {
+        const auto pos = dir.find_last_of( "/\\" );
+        dir = ( pos == std::string::npos ? std::string(".") : dir.substr( 0, pos ) );
+      }
+      return dir + "/data";
+    }
+
+    //Only checks for the existence of files, without reading any of them:
+    std::string locate( const std::string& name, const std::string& materialDir )
+    {
+      const std::string pluginPrefix = std::string("plugins::") + pluginName() + "/";
+      if ( name.compare( 0, pluginPrefix.size(), pluginPrefix ) == 0 ) {
+        const std::string dir = pluginDataDir();
+        const std::string candidate = dir + '/' + name.substr( pluginPrefix.size() );
+        if ( !dir.empty() && isFile( candidate ) )
+          return candidate;
+      } else {
+        if ( !materialDir.empty() && !name.empty() && name.front() != '/' ) {
+          const std::string candidate = materialDir + '/' + name;
+          if ( isFile( candidate ) )
+            return candidate;
+        }
+        if ( isFile( name ) )
+          return name;
+        if ( !name.empty() && name.front() != '/' ) {
+          const char * searchpath = std::getenv( "NCRYSTAL_DATA_PATH" );
+          std::string dirs = ( searchpath ? searchpath : "" );
+          std::size_t start = 0;
+          while ( start < dirs.size() ) {
+            std::size_t end = dirs.find( ':', start );
+            if ( end == std::string::npos )
+              end = dirs.size();
+            if ( end > start ) {
+              const std::string candidate = dirs.substr( start, end - start ) + '/' + name;
+              if ( isFile( candidate ) )
+                return candidate;
+            }
+            start = end + 1;
+          }
+        }
+      }
+      NCRYSTAL_THROW2(BadInput,"Could not find the kernel file \""<<name<<"\" referenced in the"
+                      " @CUSTOM_"<<pluginNameUpperCase()<<" section");
+    }
+
+    template<class T>
+    T readAt( const char * data )
+    {
+      T t;
+      std::memcpy( &t, data, sizeof(T) );
+      return t;
+    }
+
+  }
+}
+
+std::string NCP::KernelFile::referencedName( const NC::Info::CustomSectionData& raw )
+{
+  std::string name;
+  bool otherFields = false;
+  for ( const auto& line : raw ) {
+    if ( line.empty() )
+      continue;
+    if ( line.front() != "kernelfile" ) {
+      otherFields = true;
+      continue;
+    }
+    if ( line.size() != 2 )
+      NCRYSTAL_THROW2(BadInput,"Field kernelfile must be specified as \"kernelfile <name>\""
+                      " on a single line in the @CUSTOM_"<<pluginNameUpperCase()<<" section");
+    if ( !name.empty() )
+      NCRYSTAL_THROW2(BadInput,"Field kernelfile specified more than once in the @CUSTOM_"
+                      <<pluginNameUpperCase()<<" section");
+    name = line[1];
+  }
+  if ( !name.empty() && otherFields )
+    NCRYSTAL_THROW2(BadInput,"Field kernelfile can not be combined with other fields in the"
+                    " @CUSTOM_"<<pluginNameUpperCase()<<" section");
+  return name;
+}
+
+std::shared_ptr<const NCP::KernelFile>
+NCP::KernelFile::open( const NC::Info::CustomSectionData& raw, const std::string& materialDir )
+{
+  const std::string name = referencedName( raw );
+  return name.empty() ? nullptr : std::make_shared<const KernelFile>( name, materialDir );
+}
+
+std::string NCP::KernelFile::materialDirectory( const NC::Info& info )
+{
+  std::string path;
+  try {
+    const auto textData = NC::createTextData( NC::TextDataPath( info.getDataSourceName().str() ) );
+    if ( textData->getLastKnownOnDiskAbsPath().has_value() )
+      path = textData->getLastKnownOnDiskAbsPath().value();
+  } catch ( NC::Error::FileNotFound& ) {
+    //e.g. materials created directly from text data
+  }
+  const auto pos = path.find_last_of( "/\\" );
+  return pos == std::string::npos ? std::string() : path.substr( 0, pos );
+}
+
+NCP::KernelFile::KernelFile( const std::string& name, const std::string& materialDir )
+  : m_path( locate( name, materialDir ) )
+{
+#ifdef _WIN32
+  //Read into memory rather than mapped (values are always read with memcpy,
+  //so the buffer needs no particular alignment):
+  std::ifstream fh( m_path, std::ios::binary | std::ios::ate );
+  if ( !fh.good() )
+    NCRYSTAL_THROW2(DataLoadError,"Could not open kernel file "<<m_path);
+  m_size = static_cast<std::size_t>( fh.tellg() );
+  if ( m_size < sizeof(Header) + sizeof(Fields) )
+    NCRYSTAL_THROW2(DataLoadError,"Kernel file "<<m_path<<" is too short");
+  auto buf = std::make_shared<std::vector<char>>( m_size );
+  fh.seekg( 0 );
+  if ( !fh.read( buf->data(), m_size ) )
+    NCRYSTAL_THROW2(DataLoadError,"Could not read kernel file "<<m_path);
+  m_data = buf->data();
+  m_mapping = std::move( buf );
+#else
+  const int fd = ::open( m_path.c_str(), O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 )
+    NCRYSTAL_THROW2(DataLoadError,"Could not open kernel file "<<m_path);
+  struct stat st;
+  if ( ::fstat( fd, &st ) != 0
+       || std::size_t( st.st_size ) < sizeof(Header) + sizeof(Fields) ) {
+    ::close( fd );
+    NCRYSTAL_THROW2(DataLoadError,"Kernel file "<<m_path<<" is too short");
+  }
+  m_size = static_cast<std::size_t>( st.st_size );
+  void * addr = ::mmap( nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0 );
+  ::close( fd );//the mapping stays valid
+  if ( addr == MAP_FAILED )
+    NCRYSTAL_THROW2(DataLoadError,"Could not map kernel file "<<m_path);
+  auto mapping = std::make_shared<const Mapping>( addr, m_size );
+  m_data = mapping->data();
+  m_mapping = std::move( mapping );
+#endif
+
+  const auto h = readAt<Header>( m_data );
+  if ( std::memcmp( h.magic, kernelFileMagic, sizeof(h.magic) ) != 0 )
+    NCRYSTAL_THROW2(DataLoadError,"File "<<m_path<<" is not a kernel file");
+  if ( h.version != kernelFileFormatVersion || h.endian != endianMarker )
+    NCRYSTAL_THROW2(DataLoadError,"Kernel file "<<m_path<<" has an unsupported format"
+                    " version or endianness (version "<<h.version<<", expected "
+                    <<kernelFileFormatVersion<<")");
+  const auto f = readAt<Fields>( m_data + sizeof(Header) );
+  const std::uint64_t maxValues = m_size / sizeof(double);
+  if ( h.payloadSize != m_size - sizeof(Header)
+       || !( f.temperature > 0.0 ) || f.knltype > 1
+       || f.nalpha == 0 || f.nbeta == 0 || f.nalpha > maxValues || f.nbeta > maxValues / f.nalpha
+       || h.payloadSize != sizeof(Fields) + sizeof(double) * ( f.nalpha + f.nbeta + f.nalpha * f.nbeta ) )
+    NCRYSTAL_THROW2(DataLoadError,"Kernel file "<<m_path<<" is inconsistent or truncated");
+}
+
+double NCP::KernelFile::temperature() const
+{
+  return readAt<Fields>( m_data + sizeof(Header) ).temperature;
+}
+
+std::uint64_t NCP::KernelFile::checksum() const
+{
+  return readAt<Header>( m_data ).checksum;
+}
+
+NC::ScatKnlData NCP::KernelFile::kernel() const
+{
+  const auto h = readAt<Header>( m_data );
+  const char * payload = m_data + sizeof(Header);
+  if ( fnv1aWords( payload, h.payloadSize ) != h.checksum )
+    NCRYSTAL_THROW2(DataLoadError,"Kernel file "<<m_path<<" is corrupt (checksum mismatch)");
+  const auto f = readAt<Fields>( payload );
+  NC::ScatKnlData res;
+  res.temperature = NC::Temperature{ f.temperature };
+  res.knltype = ( f.knltype ? NC::ScatKnlData::KnlType::SAB
+                  : NC::ScatKnlData::KnlType::SCALED_SYM_SAB );
+  const char * it = payload + sizeof(Fields);
+  auto getValues = [&it]( NC::VectD& v, std::size_t n )
+  {
+    v.resize( n );
+    std::memcpy( v.data(), it, n * sizeof(double) );
+    it += n * sizeof(double);
+  };
+  getValues( res.alphaGrid, f.nalpha );
+  getValues( res.betaGrid, f.nbeta );
+  getValues( res.sab, f.nalpha * f.nbeta );
+  completeKernel( res );
+  return res;
+}
+
+void NCP::KernelFile::write( const std::string& path, const NC::ScatKnlData& data )
+{
+  using KnlType = NC::ScatKnlData::KnlType;
+  if ( data.knltype != KnlType::SAB && data.knltype != KnlType::SCALED_SYM_SAB )
+    NCRYSTAL_THROW2(BadInput,"Kernel files only support kernels of type SAB or SCALED_SYM_SAB");
+  if ( data.alphaGrid.empty() || data.betaGrid.empty()
+       || data.alphaGrid.size() * data.betaGrid.size() != data.sab.size() )
+    NCRYSTAL_THROW2(BadInput,"Inconsistent kernel sizes, can not write kernel file "<<path);
+
+  Fields f{ data.temperature.dbl(), ( data.knltype == KnlType::SAB ? 1u : 0u ), 0,
+            data.alphaGrid.size(), data.betaGrid.size() };
+  std::vector<char> payload( sizeof(Fields) );
+  std::memcpy( payload.data(), &f, sizeof(Fields) );
+  for ( const NC::VectD * v : { &data.alphaGrid, &data.betaGrid, &data.sab } ) {
+    auto p = reinterpret_cast<const char*>( v->data() );
+    payload.insert( payload.end(), p, p + v->size() * sizeof(double) );
+  }
+  Header h;
+  std::memcpy( h.magic, kernelFileMagic, sizeof(h.magic) );
+  h.version = kernelFileFormatVersion;
+  h.endian = endianMarker;
+  h.payloadSize = payload.size();
+  h.checksum = fnv1aWords( payload.data(), payload.size() );
+
+  std::ofstream fh( path, std::ios::binary | std::ios::trunc );
+  fh.write( reinterpret_cast<const char*>( &h ), sizeof(h) );
+  fh.write( payload.data(), payload.size() );
+  if ( !fh.good() )
+    NCRYSTAL_THROW2(BadInput,"Could not write kernel file "<<path);
+}
+
+std::vector<std::string> NCP::pluginDataFiles()
+{
+  std::vector<std::string> res;
+  const std::string dir = pluginDataDir();
+  std::error_code ec;
+  if ( dir.empty() || !std::filesystem::is_directory( dir, ec ) )
+    return res;
+  const std::string marker = std::string("@CUSTOM_") + pluginNameUpperCase();
+  for ( const auto& entry : std::filesystem::directory_iterator( dir, ec ) ) {
+    if ( !entry.is_regular_file( ec ) || entry.path().extension() != ".ncmat" )
+      continue;
+    std::ifstream fh( entry.path().string() );
+    std::string line;
+    while ( std::getline( fh, line ) ) {
+      if ( line.compare( 0, marker.size(), marker ) == 0 ) {
+        res.push_back( std::string("plugins::") + pluginName() + "/"
+                       + entry.path().filename().string() );
+        break;
+      }
+    }
+  }
+  std::sort( res.begin(), res.end() );
+  return res;
+}
@@ -0,0 +1,90 @@
+#ifndef NCPlugin_KernelFile_hh
+#define NCPlugin_KernelFile_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+
+namespace NCPluginNamespace {
+
+  //Binary kernel files (.bzk), holding the content of a @CUSTOM_BZSCOPE
+  //section in compact form. A section then only needs the single line
+  //
+  //   kernelfile <name>
+  //
+  //so the NC::Info of the material no longer keeps the kernel as (a very large
+  //number of) strings, and no text needs to be parsed. Files are produced from
+  //the text sections by the testcode/scripts/ncbzscope_tobzk script (or with
+  //KernelFile::write).
+  //
+  //A name of the form plugins::BzScope/<file> refers to a file in the data
+  //directory installed with the plugin. Other relative names are looked up in
+  //the directory of the NCMAT file referencing them (when that is known and
+  //on disk, see materialDirectory), then relative to the working directory,
+  //and then in the directories of the NCRYSTAL_DATA_PATH environment
+  //variable. The lookup only checks whether files exist, so they must be on
+  //disk (rather than e.g. registered with NCrystal as in-memory data).
+  //
+  //Files are mapped read-only into memory (or read into memory on Windows).
+  //They start with a header (magic bytes, format version, endianness marker,
+  //payload size and a checksum of the payload), followed by the temperature,
+  //the kernel type (0 for sab_scaled and 1 for sab), the sizes of the alpha
+  //and beta grids, and the grids and kernel values as doubles (in the order
+  //of the text section).
+  //Invalid files raise DataLoadError, with the checksum verified when the
+  //kernel is read.
+
+  class KernelFile final : public NC::MoveOnly {
+  public:
+
+    //Name of the kernel file referenced by a section, or an empty string if
+    //the section holds the kernel as text (BadInput if the kernelfile line is
+    //malformed or the section holds other fields as well):
+    static std::string referencedName( const NC::Info::CustomSectionData& );
+
+    //The kernel file referenced by a section, or nullptr if the section holds
+    //the kernel as text. Functions handling sections take the result as an
+    //optional argument, so the file is only located and mapped once per
+    //section (they open it themselves when not given, without knowing the
+    //directory of the material):
+    static std::shared_ptr<const KernelFile> open( const NC::Info::CustomSectionData&,
+                                                   const std::string& materialDir = {} );
+
+    //Directory of the NCMAT file from which the material was loaded, as found
+    //by the file lookup of NCrystal (which normally has the text data cached
+    //already), or an empty string if the data is not from a file on disk:
+    static std::string materialDirectory( const NC::Info& );
+
+    //Locate and map the file (BadInput if it can not be found), with relative
+    //names looked up in materialDir first (if not empty):
+    explicit KernelFile( const std::string& name, const std::string& materialDir = {} );
+
+    const std::string& path() const { return m_path; }
+    double temperature() const;
+
+    //Checksum of the content as stored in the header (which is used as a key
+    //of the content, without reading all of it):
+    std::uint64_t checksum() const;
+
+    //The kernel, as parseCustomSection would give it for the text section:
+    NC::ScatKnlData kernel() const;
+
+    //Write a kernel to a file (BadInput in case of errors):
+    static void write( const std::string& path, const NC::ScatKnlData& );
+
+  private:
+    std::string m_path;
+    std::shared_ptr<const void> m_mapping;
+    const char * m_data = nullptr;
+    std::size_t m_size = 0;
+  };
+
+  //Names (of the form plugins::BzScope/<file>, sorted) of the NCMAT files in
+  //the data directory installed with the plugin which have a @CUSTOM_BZSCOPE
+  //section, for tests and benchmarks to run over all of them. Empty if the
+  //data directory is not found:
+  std::vector<std::string> pluginDataFiles();
+
+}
+
+#endif
@@ -0,0 +1,376 @@
+#include "NCKernelModel.hh"
+#include "NCFastSampler.hh"
+#include "NCInstrumentation.hh"
+#include "NCKernelCache.hh"
+#include "NCKernelParser.hh"
+#include "NCKernelRegrid.hh"
+#include "NCKernelScatter.hh"
+#include "NCMultiPhonon.hh"
+#include "NCParallel.hh"
+#include "NCSharedTables.hh"
+#include "NCXSTable.hh"
+
+#include "NCrystal/internal/sabscatter/NCSABScatter.hh"
+#include "NCrystal/internal/sab/NCSABExtender.hh"
+#include "NCrystal/internal/sab/NCSABIntegrator.hh"
+#include "NCrystal/internal/sab/NCSABUtils.hh"
+#include "NCrystal/internal/utils/NCMsg.hh"
+
+namespace NCPluginNamespace {
+  namespace {
+    //Cross section tables start at this energy (below it, the exact cross
+    //sections are used):
+    constexpr double xsTableEmin = 1e-5;//eV
+
+    //Report the resulting grids when they are not the defaults:
+    bool reportGrid( const PhysicsModel::Options& opts )
+    {
+      return opts.gridDensity != 1.0 || opts.memoryBudgetMB > 0.0;
+    }
+
+    std::size_t megaBytes( double mb )
+    {
+      return static_cast<std::size_t>( mb * 1e6 );
+    }
+
+    //Parsing the large text section is skipped when a valid entry exists in the
+    //on-disk kernel cache (which holds the kernel of the section, before any
+    //multi-phonon terms are added and before any regridding). With terms, the
+    //cross section at Emax of the kernel of the section alone is returned in
+    //section_xs_at_emax (see KernelModel::lacksTermsAt):
+    NC::ScatKnlData loadKernel( const NC::Info::CustomSectionData& raw, const KernelFile * kernelfile,
+                                const KernelCache& cache, const MultiPhononTerms * terms,
+                                const PhysicsModel::Options& opts, double& section_xs_at_emax )
+    {
+      NC::ScatKnlData phononSab;
+      PhaseTimer timer_load( "load kernel cache" );
+      const bool loaded = cache.load( phononSab );
+      timer_load.stop();
+      if ( !loaded ) {
+        PhaseTimer timer_parse( "parse section" );
+        phononSab = parseCustomSection( raw, kernelfile );
+        timer_parse.stop();
+        PhaseTimer timer_store( "store kernel cache" );
+        cache.store( phononSab );
+      }
+      if ( terms ) {
+        PhaseTimer timer_terms( "build multi-phonon terms" );
+        const auto termKernels = terms->kernels();
+        timer_terms.stop();
+        PhaseTimer timer_merge( "merge multi-phonon terms" );
+        section_xs_at_emax = KernelScatter::exactCrossSection( SparseKernel( phononSab ),
+                                                               phononSab.suggestedEmax );
+        phononSab = mergeKernels( phononSab, termKernels, resolveThreadCount( opts.nThreads ) );
+      }
+      if ( opts.regridTolerance > 0.0 ) {
+        PhaseTimer timer_regrid( "regrid kernel" );
+        const std::size_t nalpha = phononSab.alphaGrid.size();
+        const std::size_t nbeta = phononSab.betaGrid.size();
+        phononSab = regridKernel( phononSab, opts.regridTolerance );
+        timer_regrid.stop();
+        NCPLUGIN_MSG("Regridded kernel at T="<<phononSab.temperature.dbl()<<"K: alpha grid "
+                     <<nalpha<<" -> "<<phononSab.alphaGrid.size()<<" points, beta grid "
+                     <<nbeta<<" -> "<<phononSab.betaGrid.size()<<" points ("
+                     <<100.0 * phononSab.sab.size() / ( nalpha * nbeta )
+                     <<"% of the kernel values kept)");
+      }
+      return phononSab;
+    }
+
+    //Shared tables for the sparse kernel built with the given memory budget
+    //(all options affecting the tables are included in the key):
+    SharedTables sharedTables( const KernelCache& cache, const PhysicsModel::Options& opts,
+                               std::size_t memory_budget, const MultiPhononTerms * terms )
+    {
+      const std::uint64_t terms_key = ( terms ? terms->key() : 0 );
+      return SharedTables( cache.key(), { opts.singlePrecision ? 1.0 : 0.0, opts.gridDensity,
+                                          opts.xsTableAccuracy, opts.regridTolerance,
+                                          static_cast<double>( memory_budget ),
+                                          opts.fastSampling ? opts.fastSamplingMemoryMB : 0.0,
+                                          static_cast<double>( terms_key >> 32 ),
+                                          static_cast<double>( terms_key & 0xffffffff ) } );
+    }
+
+    //The energy grid starts at the density of the gridDensity option, and is
+    //refined until cross sections are interpolated to within xsTableAccuracy.
+    //Both are limited as needed for the kernel and tables to fit in the given
+    //memory budget (unless 0):
+    std::shared_ptr<const KernelScatter> buildSparse( const NC::ScatKnlData& phononSab,
+                                                      const PhysicsModel::Options& opts,
+                                                      std::size_t memory_budget )
+    {
+      PhaseTimer timer_kernel( "build sparse kernel" );
+      auto kernel = NC::makeSO<const SparseKernel>( phononSab, opts.singlePrecision );
+      timer_kernel.stop();
+      const double emax = phononSab.suggestedEmax;
+      double pointsPerDecade = KernelScatter::defaultPointsPerDecade * opts.gridDensity;
+      std::size_t max_memory = 0;
+      if ( memory_budget ) {
+        const std::size_t kernelMemory = kernel->memoryUsage();
+        const double maxPointsPerDecade
+          = ( memory_budget > kernelMemory
+              ? KernelScatter::maxPointsPerDecade( *kernel, emax, memory_budget - kernelMemory )
+              : 0.0 );
+        if ( maxPointsPerDecade < KernelScatter::minPointsPerDecade )
+          NCRYSTAL_THROW2(BadInput,"Memory budget of "<<memory_budget*1e-6<<" MB is too small for"
+                          " the kernel and its tables (at least "
+                          <<( kernelMemory + KernelScatter::estimateMemoryUsage( *kernel, emax,
+                                                                                 KernelScatter::minPointsPerDecade ) )*1e-6
+                          <<" MB needed)");
+        pointsPerDecade = NC::ncmin( pointsPerDecade, maxPointsPerDecade );
+        max_memory = memory_budget - kernelMemory;
+      }
+      PhaseTimer timer_tables( "build sparse tables" );
+      return std::make_shared<const KernelScatter>( std::move(kernel), emax,
+                                                    resolveThreadCount( opts.nThreads ),
+                                                    pointsPerDecade, opts.xsTableAccuracy,
+                                                    max_memory );
+    }
+
+    std::shared_ptr<const FastSampler> buildFastSampler( std::shared_ptr<const KernelScatter> scatter,
+                                                         const PhysicsModel::Options& opts )
+    {
+      PhaseTimer timer( "build fast sampling tables" );
+      return std::make_shared<const FastSampler>( std::move(scatter),
+                                                  megaBytes( opts.fastSamplingMemoryMB ),
+                                                  resolveThreadCount( opts.nThreads ),
+                                                  opts.lazyTables );
+    }
+  }
+}
+
+NCP::KernelModel::KernelModel( const NC::Info::CustomSectionData& raw,
+                               const KernelFile * kernelfile,
+                               const KernelCache& cache,
+                               const Options& opts,
+                               const MultiPhononTerms * terms )
+{
+  //In sparse mode, the kernel is only needed if the tables are not already
+  //available from another process (lazy tables are never shared, since they
+  //are completed while in use):
+  const bool lazy = opts.lazyTables && opts.fastSampling;
+  if ( opts.kernelMode == Options::KernelMode::Sparse ) {
+    const std::size_t memory_budget = megaBytes( opts.memoryBudgetMB );
+    auto build = [&]()
+    {
+      SharedTables::Tables res;
+      res.scatter = buildSparse( loadKernel( raw, kernelfile, cache, terms, opts, res.sectionXSAtEmax ),
+                                 opts, memory_budget );
+      if ( opts.fastSampling )
+        res.fast = buildFastSampler( res.scatter, opts );
+      return res;
+    };
+    auto tables = ( lazy ? build()
+                    : sharedTables( cache, opts, memory_budget, terms ).getOrBuild( build ) );
+    m_sparse = std::move( tables.scatter );
+    m_fast = std::move( tables.fast );
+    m_temperature = m_sparse->kernel().temperature();
+    if ( terms ) {
+      m_mergedEmax = m_sparse->energyGrid().back();
+      m_sectionXSAtEmax = tables.sectionXSAtEmax;
+    }
+    addMemoryUsage( m_sparse->kernel().memoryUsage(), memoryUsage() - m_sparse->kernel().memoryUsage() );
+    if ( reportGrid( opts ) ) {
+      PhaseTimer timer_check( "check sparse tables" );
+      NCPLUGIN_MSG("Sparse tables at T="<<m_temperature<<"K: "<<m_sparse->energyGrid().size()
+                   <<" energy grid points ("<<m_sparse->pointsPerDecade()<<" per decade),"
+                   " kernel and tables use "<<( m_sparse->memoryUsage() + m_sparse->kernel().memoryUsage() )*1e-6
+                   <<" MB, cross sections interpolated to within "
+                   <<m_sparse->selfCheck( resolveThreadCount( opts.nThreads ) )*100.0<<"%");
+    }
+    return;
+  }
+
+  NC::ScatKnlData phononSab = loadKernel( raw, kernelfile, cache, terms, opts, m_sectionXSAtEmax );
+  m_temperature = phononSab.temperature.dbl();
+  if ( terms )
+    m_mergedEmax = phononSab.suggestedEmax;
+
+  //Fast sampling in dense mode needs the sparse kernel as well (built before
+  //the kernel is moved into the standard format, and not counted against the
+  //memory budget). Only those tables can be shared between processes, since
+  //the SAB tables of NCrystal can not be placed in shared memory:
+  if ( opts.fastSampling ) {
+    auto build = [&]()
+    {
+      SharedTables::Tables res;
+      res.fast = buildFastSampler( buildSparse( phononSab, opts, 0 ), opts );
+      return res;
+    };
+    m_fast = ( lazy ? build()
+               : sharedTables( cache, opts, 0, terms ).getOrBuild( build ) ).fast;
+  }
+
+  const double emax = phononSab.suggestedEmax;
+  PhaseTimer timer_transform( "transformKernelToStdFormat" );
+  NC::SABData sglphdata = NC::SABUtils::transformKernelToStdFormat(std::move(phononSab));
+  timer_transform.stop();
+  const std::size_t kernelMemory = sizeof(double) * ( sglphdata.sab().size()
+                                                      + sglphdata.alphaGrid().size()
+                                                      + sglphdata.betaGrid().size() );
+
+  //NCrystal picks the energy grid of the SAB integration, unless another grid
+  //density is requested. In that case, the grid gets the same number of
+  //points as in sparse mode (the SABIntegrator interprets a grid with three
+  //values as emin, emax and the number of points):
+  NC::VectD egrid;
+  if ( opts.gridDensity != 1.0 && emax > xsTableEmin )
+    egrid = { xsTableEmin, emax,
+              std::ceil( std::log10( emax / xsTableEmin )
+                         * KernelScatter::defaultPointsPerDecade * opts.gridDensity ) + 1.0 };
+
+  PhaseTimer timer_integrator( "integrator setup" );
+  auto sglphsab = NC::makeSO<NC::SABData>(std::move(sglphdata));
+  auto sglphintegrator = NC::makeSO<NC::SAB::SABIntegrator>(std::move(sglphsab), egrid.empty() ? nullptr : &egrid, std::move(NC::makeSO<NC::SAB::SABNullExtender>()));
+  auto sglphhelper = NC::makeSO<const NC::SAB::SABScatterHelper>(std::move(sglphintegrator->createScatterHelper()));
+  //The SABScatter process keeps all per-neutron state in the CachePtr of the
+  //caller, so it can be shared between threads:
+  m_dense = std::make_shared<const NC::SABScatter>(sglphhelper);
+  timer_integrator.stop();
+
+  //Tabulate the cross sections (verifying the table against the exact values
+  //at energies not used for its construction). The exact values are evaluated
+  //from several threads, so each call gets its own cache:
+  if ( opts.xsTableAccuracy > 0.0 && emax > xsTableEmin ) {
+    auto exact_xs = [this]( double ekin )
+    {
+      NC::CachePtr xscache;
+      return m_dense->crossSectionIsotropic( xscache, NC::NeutronEnergy{ekin} ).dbl();
+    };
+    PhaseTimer timer_table( "build cross section table" );
+    m_xstable = std::make_shared<const XSTable>( exact_xs, xsTableEmin, emax,
+                                                 opts.xsTableAccuracy,
+                                                 resolveThreadCount( opts.nThreads ),
+                                                 megaBytes( opts.memoryBudgetMB ) );
+    timer_table.stop();
+    PhaseTimer timer_check( "check cross section table" );
+    const double deviation = m_xstable->selfCheck( exact_xs, 1000 );
+    timer_check.stop();
+    if ( reportGrid( opts ) )
+      NCPLUGIN_MSG("Cross section table at T="<<m_temperature<<"K: "<<m_xstable->size()
+                   <<" energy grid points, "<<m_xstable->memoryUsage()*1e-6
+                   <<" MB, deviating by up to "<<deviation*100.0<<"% from the exact values"
+                   " (SAB integration energy grid: "
+                   <<( egrid.empty() ? std::string("NCrystal default")
+                       : std::to_string( static_cast<unsigned>( egrid.back() ) ) + " points" )<<")");
+    else if ( deviation > 10.0 * opts.xsTableAccuracy )
+      NCPLUGIN_WARN("Cross section table deviates by up to "<<deviation*100.0
+                    <<"% from the exact values (requested accuracy: "
+                    <<opts.xsTableAccuracy*100.0<<"%)");
+  }
+  addMemoryUsage( kernelMemory + ( m_fast ? m_fast->scatter().kernel().memoryUsage() : 0 ),
+                  memoryUsage() - ( m_fast ? m_fast->scatter().kernel().memoryUsage() : 0 ) );
+}
+
+namespace NCPluginNamespace {
+  namespace {
+    //Per-thread state of a KernelModel, kept in the NC::CachePtr of the
+    //caller. The energy grid lookup of the last call is kept, so the common
+    //pattern of a cross section evaluation followed by sampling at the same
+    //energy only needs a single lookup:
+    struct KernelModelCache final : public NC::CacheBase {
+      NC::CachePtr dense;//for the SABScatter
+      KernelScatter::GridLookup last{ -1.0, 0.0, 0, 0, 1.0, 0.0 };
+      void invalidateCache() override
+      {
+        last.ekin = -1.0;
+        if ( dense )
+          dense->invalidateCache();
+      }
+    };
+    KernelModelCache& kernelModelCache( NC::CachePtr& cache )
+    {
+      if ( !cache )
+        cache = std::make_unique<KernelModelCache>();
+      return static_cast<KernelModelCache&>( *cache );
+    }
+    const KernelScatter::GridLookup& cachedLookup( KernelModelCache& c, const KernelScatter& scatter,
+                                                   double ekin )
+    {
+      if ( c.last.ekin != ekin )
+        c.last = scatter.lookup( ekin );
+      else if ( instrumentationEnabled() )
+        addCount( Counter::CachedLookups );
+      return c.last;
+    }
+  }
+}
+
+double NCP::KernelModel::crossSection( NC::CachePtr& cache, double neutron_ekin ) const
+{
+  if ( lacksTermsAt( neutron_ekin ) )
+    return m_sectionXSAtEmax * m_mergedEmax / neutron_ekin;
+  auto& c = kernelModelCache( cache );
+  if ( m_sparse )
+    return cachedLookup( c, *m_sparse, neutron_ekin ).xs;
+  if ( m_xstable && m_xstable->inRange( neutron_ekin ) )
+    return m_xstable->lookup( neutron_ekin );
+  return m_dense->crossSectionIsotropic( c.dense, NC::NeutronEnergy{neutron_ekin} ).dbl();
+}
+
+void NCP::KernelModel::crossSections( NC::CachePtr& cache, const double * neutron_ekin,
+                                      std::size_t n, double * out_xs ) const
+{
+  if ( m_sparse ) {
+    m_sparse->crossSections( neutron_ekin, n, out_xs );
+  } else if ( m_xstable ) {
+    //Table lookups for all, then fix up the few outside the table:
+    m_xstable->lookupMany( neutron_ekin, n, out_xs );
+    for ( std::size_t i = 0; i < n; ++i )
+      if ( !m_xstable->inRange( neutron_ekin[i] ) )
+        out_xs[i] = m_dense->crossSectionIsotropic( kernelModelCache( cache ).dense,
+                                                    NC::NeutronEnergy{neutron_ekin[i]} ).dbl();
+  } else {
+    m_dense->evalManyXSIsotropic( kernelModelCache( cache ).dense, neutron_ekin, n, out_xs );
+  }
+  if ( m_mergedEmax < NC::kInfinity )
+    for ( std::size_t i = 0; i < n; ++i )
+      if ( lacksTermsAt( neutron_ekin[i] ) )
+        out_xs[i] = m_sectionXSAtEmax * m_mergedEmax / neutron_ekin[i];
+}
+
+NCP::KernelModel::ScatEvent NCP::KernelModel::sampleScatteringEvent( NC::CachePtr& cache,
+                                                                     NC::RNG& rng,
+                                                                     double neutron_ekin ) const
+{
+  ScatEvent result;
+  auto& c = kernelModelCache( cache );
+  if ( m_fast ) {
+    auto outcome = m_fast->sampleScatteringEvent( rng, cachedLookup( c, m_fast->scatter(), neutron_ekin ) );
+    result.ekin_final = outcome.ekin_final;
+    result.mu = outcome.mu;
+    return result;
+  }
+  if ( m_sparse ) {
+    auto outcome = m_sparse->sampleScatteringEvent( rng, cachedLookup( c, *m_sparse, neutron_ekin ) );
+    result.ekin_final = outcome.ekin_final;
+    result.mu = outcome.mu;
+    return result;
+  }
+  auto res = m_dense->sampleScatterIsotropic( c.dense, rng, NC::NeutronEnergy{neutron_ekin} );
+  result.ekin_final = res.ekin.dbl();
+  result.mu = res.mu.dbl();
+  return result;
+}
+
+NCP::KernelModel::TableBins NCP::KernelModel::samplingTableBins() const
+{
+  if ( m_fast )
+    return { m_fast->nBuiltTables(), m_fast->scatter().energyGrid().size() };
+  if ( m_sparse )
+    return { m_sparse->energyGrid().size(), m_sparse->energyGrid().size() };
+  return { 0, 0 };
+}
+
+std::size_t NCP::KernelModel::memoryUsage() const
+{
+  std::size_t usage = 0;
+  if ( m_fast ) {
+    usage += m_fast->memoryUsage();
+    if ( !m_sparse )
+      usage += m_fast->scatter().memoryUsage() + m_fast->scatter().kernel().memoryUsage();
+  }
+  if ( !m_sparse )
+    return usage + ( m_xstable ? m_xstable->memoryUsage() : 0 );
+  return usage + m_sparse->memoryUsage() + m_sparse->kernel().memoryUsage();
+}
@@ -0,0 +1,74 @@
+#ifndef NCPlugin_KernelModel_hh
+#define NCPlugin_KernelModel_hh
+
+#include "NCPhysicsModel.hh"
+#include "NCrystal/interfaces/NCProcImpl.hh"
+
+namespace NCPluginNamespace {
+
+  class FastSampler;
+  class KernelCache;
+  class KernelFile;
+  class KernelScatter;
+  class MultiPhononTerms;
+  class XSTable;
+
+  //Cross sections and sampling for the kernel in a single @CUSTOM_BZSCOPE
+  //section (i.e. at a single temperature), in either the dense or sparse
+  //kernel mode. A PhysicsModel combines one or two of these. Instances are
+  //immutable after construction, with any per-thread state kept in the
+  //NC::CachePtr of the caller. With the fastSampling option, scattering events
+  //are sampled by a FastSampler in both modes (in dense mode based on a sparse
+  //copy of the kernel, which is only used for sampling).
+
+  class KernelModel final : public NC::MoveOnly {
+  public:
+
+    using Options = PhysicsModel::Options;
+    using ScatEvent = PhysicsModel::ScatEvent;
+
+    //The KernelCache must be the one for the given section (it is used to
+    //skip parsing the section when possible), and the KernelFile the one of
+    //the section, if any (see KernelFile::open). Any multi-phonon terms are
+    //added to the kernel of the section (see NCMultiPhonon.hh):
+    KernelModel( const NC::Info::CustomSectionData&, const KernelFile*, const KernelCache&,
+                 const Options&, const MultiPhononTerms* = nullptr );
+
+    double temperature() const { return m_temperature; }
+
+    //With multi-phonon terms, the merged kernel is only used up to its Emax
+    //(the suggested Emax of the section). Above, the cross section is that of
+    //the kernel of the section alone, extrapolated as 1/E from Emax (as
+    //without the terms), and the terms must be provided separately (see
+    //NCPluginFactory.cc). Events are still sampled from the merged kernel
+    //there (an approximation, as is the extrapolation of the kernel of the
+    //section beyond its Emax):
+    bool lacksTermsAt( double neutron_ekin ) const { return neutron_ekin > m_mergedEmax; }
+
+    double crossSection( NC::CachePtr&, double neutron_ekin ) const;
+    void crossSections( NC::CachePtr&, const double * neutron_ekin,
+                        std::size_t n, double * out_xs ) const;
+    ScatEvent sampleScatteringEvent( NC::CachePtr&, NC::RNG&, double neutron_ekin ) const;
+
+    std::size_t memoryUsage() const;
+
+    //Number of energy grid points with sampling tables built so far, out of
+    //the total, in the tables of the plugin (only fewer than all with the
+    //lazyTables option and fast sampling, and both 0 in dense mode without
+    //fast sampling):
+    struct TableBins { std::size_t built, total; };
+    TableBins samplingTableBins() const;
+
+  private:
+    double m_temperature;
+    double m_mergedEmax = NC::kInfinity;//without terms, never lacking them
+    double m_sectionXSAtEmax = 0.0;
+    std::shared_ptr<const NC::ProcImpl::ScatterIsotropicMat> m_dense;
+    std::shared_ptr<const KernelScatter> m_sparse;
+    std::shared_ptr<const XSTable> m_xstable;
+    std::shared_ptr<const FastSampler> m_fast;
+  };
+
+}
+
+#endif
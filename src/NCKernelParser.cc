@@ -0,0 +1,246 @@
+#include "NCKernelParser.hh"
+#include "NCKernelFile.hh"
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+namespace NCPluginNamespace {
+  namespace {
+
+    //For error messages:
+    struct SectionLine { std::size_t lineno; };
+    std::ostream& operator<<( std::ostream& os, const SectionLine& l )
+    {
+      return os << "line " << l.lineno << " of the @CUSTOM_"
+                << pluginNameUpperCase() << " section";
+    }
+
+    inline bool isKeywordStart( char c )
+    {
+      return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' );
+    }
+
+    inline bool isDecimalChar( char c )
+    {
+      return ( c >= '0' && c <= '9' ) || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-';
+    }
+
+    //Parses a double at the beginning of [it,end), advancing it past it. The
+    //number (only characters of decimal notation, so no hex floats, "inf" or
+    //"nan") is copied to a small buffer for std::strtod, since floating point
+    //std::from_chars is missing from several supported standard libraries:
+    inline bool parseDbl( const char*& it, const char * end, double& val )
+    {
+      const char * numEnd = it;
+      while ( numEnd != end && isDecimalChar( *numEnd ) )
+        ++numEnd;
+      char buf[64];
+      const std::size_t n = numEnd - it;
+      if ( n == 0 || n >= sizeof(buf) )
+        return false;
+      std::memcpy( buf, it, n );
+      buf[n] = '\0';
+      char * parsed;
+      val = std::strtod( buf, &parsed );
+      if ( parsed != buf + n || !std::isfinite(val) )
+        return false;
+      it = numEnd;
+      return true;
+    }
+
+    //Value of a "temperature <value>" line:
+    double parseTemperatureLine( const NC::Info::CustomLine& line, std::size_t lineno )
+    {
+      if ( line.size() != 2 )
+        NCRYSTAL_THROW2(BadInput,"Field temperature must be specified as"
+                        " \"temperature <value>\" on a single line ("
+                        <<SectionLine{lineno}<<")");
+      double t;
+      const char * it = line[1].data();
+      const char * itE = it + line[1].size();
+      if ( !parseDbl( it, itE, t ) || it != itE || !(t > 0.0) )
+        NCRYSTAL_THROW2(BadInput,"Invalid temperature value \""<<line[1]
+                        <<"\" ("<<SectionLine{lineno}<<")");
+      return t;
+    }
+
+  }
+}
+
+double NCP::parseSectionTemperature( const NC::Info::CustomSectionData& raw,
+                                     const KernelFile * kernelfile )
+{
+  const auto opened = ( kernelfile ? nullptr : KernelFile::open( raw ) );
+  if ( opened )
+    kernelfile = opened.get();
+  if ( kernelfile )
+    return kernelfile->temperature();
+  double temperature = -1.0;
+  std::size_t lineno = 0;
+  for ( const auto& line : raw ) {
+    ++lineno;
+    if ( line.empty() || line.front() != "temperature" )
+      continue;
+    if ( temperature != -1.0 )
+      NCRYSTAL_THROW2(BadInput,"Field temperature specified more than once ("
+                      <<SectionLine{lineno}<<")");
+    temperature = parseTemperatureLine( line, lineno );
+  }
+  if ( !(temperature > 0.0) )
+    NCRYSTAL_THROW2(BadInput,"Missing temperature field in the @CUSTOM_"
+                    <<pluginNameUpperCase()<<" section");
+  return temperature;
+}
+
+void NCP::completeKernel( NC::ScatKnlData& phononSab )
+{
+  phononSab.betaGridOptimised = true;
+  // AtomMass should not have any impact to the result, as SABNullExtender
+  // is used for the energy range beyond the range of the single phonon sab
+  phononSab.elementMassAMU = NC::AtomMass{0.1};
+  // The incoherent model in NCrystal is going to scale sab by ScatKnlData.SigmaBound.
+  // However the bound scatting lengths are already included in the sab, so it should be unity.
+  phononSab.boundXS = NC::SigmaBound{1};
+
+  // The code for calculating EmaxUpperBound is copied from the NC::validateScatKnlData function in NCScatKnlData.cc
+  const double bmin = phononSab.betaGrid.front();
+  const double amax = phononSab.alphaGrid.back();
+  const double EmaxUpperBound = NC::constant_boltzmann*phononSab.temperature.get()*(bmin-amax)*(bmin-amax)/(4*amax);
+
+  phononSab.suggestedEmax = NC::ncmin(EmaxUpperBound, 100.0);
+}
+
+NC::ScatKnlData NCP::parseCustomSection( const NC::Info::CustomSectionData& raw,
+                                         const KernelFile * kernelfile )
+{
+  const auto opened = ( kernelfile ? nullptr : KernelFile::open( raw ) );
+  if ( opened )
+    kernelfile = opened.get();
+  if ( kernelfile )
+    return kernelfile->kernel();
+
+  NC::ScatKnlData phononSab;
+  phononSab.temperature = NC::Temperature{-1};
+
+  NC::VectD * curField = nullptr;
+  const char * curFieldName = nullptr;
+  const char * sabFieldName = nullptr;
+  std::size_t sabExpectedSize = 0;//known once both grids are complete
+  bool hasAlphaGrid(false), hasBetaGrid(false);
+
+  auto finishField = [&]()
+  {
+    if ( curField && curField->empty() )
+      NCRYSTAL_THROW2(BadInput,"No values provided for field "<<curFieldName
+                      <<" in the @CUSTOM_"<<pluginNameUpperCase()<<" section");
+  };
+
+  std::size_t lineno = 0;
+  for ( const auto& line : raw ) {
+    ++lineno;
+    for ( const auto& word : line ) {
+      const char * it = word.data();
+      const char * itE = it + word.size();
+      if ( it == itE )
+        continue;
+
+      if ( isKeywordStart( *it ) ) {
+        finishField();
+        if ( word == "temperature" ) {
+          if ( phononSab.temperature.get() != -1.0 )
+            NCRYSTAL_THROW2(BadInput,"Field temperature specified more than once ("
+                            <<SectionLine{lineno}<<")");
+          if ( &word != &line.front() )
+            NCRYSTAL_THROW2(BadInput,"Field temperature must be specified as"
+                            " \"temperature <value>\" on a single line ("
+                            <<SectionLine{lineno}<<")");
+          phononSab.temperature.set( parseTemperatureLine( line, lineno ) );
+          curField = nullptr;
+          curFieldName = nullptr;
+          break;
+        }
+        bool * hasGrid = nullptr;
+        if ( word == "alphagrid" ) {
+          curField = &phononSab.alphaGrid;
+          hasGrid = &hasAlphaGrid;
+        } else if ( word == "betagrid" ) {
+          curField = &phononSab.betaGrid;
+          hasGrid = &hasBetaGrid;
+        } else if ( word == "sab_scaled" || word == "sab" ) {
+          if ( sabFieldName )
+            NCRYSTAL_THROW2(BadInput,"Field "<<word<<" not allowed since "<<sabFieldName
+                            <<" was already specified ("<<SectionLine{lineno}<<")");
+          curField = &phononSab.sab;
+          phononSab.knltype = ( word == "sab"
+                                ? NC::ScatKnlData::KnlType::SAB
+                                : NC::ScatKnlData::KnlType::SCALED_SYM_SAB );
+          if ( hasAlphaGrid && hasBetaGrid ) {
+            sabExpectedSize = phononSab.alphaGrid.size() * phononSab.betaGrid.size();
+            phononSab.sab.reserve( sabExpectedSize );
+          }
+        } else {
+          NCRYSTAL_THROW2(BadInput,"Unknown field name \""<<word<<"\" ("
+                          <<SectionLine{lineno}<<")");
+        }
+        if ( hasGrid ) {
+          if ( *hasGrid )
+            NCRYSTAL_THROW2(BadInput,"Field "<<word<<" specified more than once ("
+                            <<SectionLine{lineno}<<")");
+          *hasGrid = true;
+        }
+        curFieldName = word.c_str();
+        if ( curField == &phononSab.sab )
+          sabFieldName = curFieldName;
+        continue;
+      }
+
+      if ( !curField )
+        NCRYSTAL_THROW2(BadInput,"Value \""<<word<<"\" is not preceded by a field name ("
+                        <<SectionLine{lineno}<<")");
+
+      double val;
+      if ( !parseDbl( it, itE, val ) )
+        NCRYSTAL_THROW2(BadInput,"Invalid value \""<<word<<"\" in field "<<curFieldName
+                        <<" ("<<SectionLine{lineno}<<")");
+      std::size_t count = 1;
+      if ( it != itE ) {
+        //Repeated entries, "<value>r<count>":
+        auto res = ( *it == 'r'
+                     ? std::from_chars( it + 1, itE, count )
+                     : std::from_chars_result{ it, std::errc::invalid_argument } );
+        if ( res.ec != std::errc() || res.ptr != itE || count == 0 )
+          NCRYSTAL_THROW2(BadInput,"Invalid value \""<<word<<"\" in field "<<curFieldName
+                          <<" (expected a number or <value>r<count>; "
+                          <<SectionLine{lineno}<<")");
+      }
+      if ( sabExpectedSize && curField == &phononSab.sab
+           && count > sabExpectedSize - phononSab.sab.size() )
+        NCRYSTAL_THROW2(BadInput,"Field "<<curFieldName<<" has more than the"
+                        " expected "<<sabExpectedSize<<" = "<<phononSab.alphaGrid.size()
+                        <<" (alphagrid) x "<<phononSab.betaGrid.size()
+                        <<" (betagrid) values ("<<SectionLine{lineno}<<")");
+      if ( count == 1 )
+        curField->push_back( val );
+      else
+        curField->insert( curField->end(), count, val );
+    }
+  }
+  finishField();
+
+  if ( !(phononSab.temperature.get() > 0.0) )
+    NCRYSTAL_THROW2(BadInput,"Missing temperature field in the @CUSTOM_"
+                    <<pluginNameUpperCase()<<" section");
+  if ( !hasAlphaGrid || !hasBetaGrid || !sabFieldName )
+    NCRYSTAL_THROW2(BadInput,"The @CUSTOM_"<<pluginNameUpperCase()<<" section must"
+                    " contain all of the fields alphagrid, betagrid and sab_scaled (or sab)");
+
+  if ( phononSab.alphaGrid.size()*phononSab.betaGrid.size() != phononSab.sab.size() )
+    NCRYSTAL_THROW2(BadInput,"Field "<<sabFieldName<<" has "<<phononSab.sab.size()
+                    <<" values, but expected "<<phononSab.alphaGrid.size()
+                    <<" (alphagrid) x "<<phononSab.betaGrid.size()<<" (betagrid) = "
+                    <<phononSab.alphaGrid.size()*phononSab.betaGrid.size());
+
+  completeKernel( phononSab );
+  return phononSab;
+}
@@ -0,0 +1,40 @@
+#ifndef NCPlugin_KernelParser_hh
+#define NCPlugin_KernelParser_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+
+namespace NCPluginNamespace {
+
+  class KernelFile;
+
+  //Parse the content of a @CUSTOM_BZSCOPE section into a scattering kernel
+  //(will raise BadInput in case of syntax errors). The section contains the
+  //fields "temperature", "alphagrid", "betagrid" and either "sab_scaled" or
+  //"sab". Values can use the "<value>r<count>" notation for repeated entries.
+  //
+  //The parser makes a single pass over the words, converting them with
+  //std::strtod from a small buffer on the stack (and repetition counts with
+  //std::from_chars), and the kernel vector is sized from the grid lengths up
+  //front, so no temporary strings or reallocations are involved.
+  //
+  //Instead of the fields, a section can hold the single line "kernelfile
+  //<name>", in which case the kernel is read from that binary kernel file (see
+  //NCKernelFile.hh, and KernelFile::open for the optional argument).
+
+  NC::ScatKnlData parseCustomSection( const NC::Info::CustomSectionData&,
+                                      const KernelFile* = nullptr );
+
+  //Extract just the value of the temperature field, without parsing the rest
+  //of the section:
+  double parseSectionTemperature( const NC::Info::CustomSectionData&,
+                                  const KernelFile* = nullptr );
+
+  //Set the fields of a kernel which are not given in the section (everything
+  //except the temperature, the grids, the kernel values and their type):
+  void completeKernel( NC::ScatKnlData& );
+
+}
+
+#endif
@@ -0,0 +1,162 @@
+#include "NCKernelRegrid.hh"
+
+namespace NCPluginNamespace {
+  namespace {
+
+    //Integral over an interval of width h of |d|, for d varying linearly from
+    //d0 to d1:
+    inline double absIntegral( double d0, double d1, double h )
+    {
+      const double a0 = NC::ncabs( d0 );
+      const double a1 = NC::ncabs( d1 );
+      if ( ( d0 >= 0.0 ) == ( d1 >= 0.0 ) )
+        return 0.5 * h * ( a0 + a1 );
+      return 0.5 * h * ( a0 * a0 + a1 * a1 ) / ( a0 + a1 );
+    }
+
+    //Kernel values sab[ibeta*nalpha+ialpha] on the given grids:
+    struct Grid {
+      NC::VectD alpha;
+      NC::VectD beta;
+      NC::VectD sab;
+      const double * column( std::size_t ibeta ) const { return &sab[ibeta*alpha.size()]; }
+    };
+
+    //Integral over alpha of each beta column, and of its first moment in alpha:
+    void columnIntegrals( const Grid& g, NC::VectD& i0, NC::VectD& i1 )
+    {
+      const std::size_t na = g.alpha.size();
+      i0.assign( g.beta.size(), 0.0 );
+      i1.assign( g.beta.size(), 0.0 );
+      for ( std::size_t ib = 0; ib < g.beta.size(); ++ib ) {
+        const double * s = g.column( ib );
+        for ( std::size_t ia = 0; ia + 1 < na; ++ia ) {
+          const double h = g.alpha[ia+1] - g.alpha[ia];
+          i0[ib] += 0.5 * h * ( s[ia] + s[ia+1] );
+          i1[ib] += 0.5 * h * ( g.alpha[ia] * s[ia] + g.alpha[ia+1] * s[ia+1] );
+        }
+      }
+    }
+
+    //Greedily keep grid points from the first one, skipping as many points as
+    //allowed by the criterion (which is called for the indices of two grid
+    //points, and decides whether the points between them can be removed):
+    template<class TCriterion>
+    std::vector<std::size_t> thinGrid( std::size_t n, const TCriterion& canRemoveBetween )
+    {
+      std::vector<std::size_t> keep;
+      keep.push_back( 0 );
+      std::size_t ilow = 0;
+      while ( ilow + 1 < n ) {
+        std::size_t ihigh = ilow + 1;
+        while ( ihigh + 1 < n && canRemoveBetween( ilow, ihigh + 1 ) )
+          ++ihigh;
+        keep.push_back( ihigh );
+        ilow = ihigh;
+      }
+      return keep;
+    }
+
+    //The deviations allowed in the removed ranges of each beta column add up to
+    //at most the tolerance times the integrals of the column (i0 and i1),
+    //since each range gets half of its own share of them plus half of the
+    //share given by its width:
+    Grid thinAlpha( const Grid& g, const NC::VectD& i0, const NC::VectD& i1, double tolerance )
+    {
+      const std::size_t na = g.alpha.size();
+      const std::size_t nb = g.beta.size();
+      const double alphaRange = g.alpha.back() - g.alpha.front();
+      auto keep = thinGrid( na, [&]( std::size_t il, std::size_t ir )
+      {
+        const double width = g.alpha[ir] - g.alpha[il];
+        for ( std::size_t ib = 0; ib < nb; ++ib ) {
+          const double * s = g.column( ib );
+          double e0 = 0.0, e1 = 0.0, l0 = 0.0, l1 = 0.0;
+          double dprev = 0.0;//deviations vanish at the kept points
+          for ( std::size_t ia = il + 1; ia <= ir; ++ia ) {
+            const double u = ( g.alpha[ia] - g.alpha[il] ) / width;
+            const double d = ( 1.0 - u ) * s[il] + u * s[ir] - s[ia];
+            const double h = g.alpha[ia] - g.alpha[ia-1];
+            const double e = absIntegral( dprev, d, h );
+            e0 += e;
+            e1 += g.alpha[ia] * e;//bounds the first moment of |d|
+            l0 += 0.5 * h * ( s[ia-1] + s[ia] );
+            l1 += 0.5 * h * ( g.alpha[ia-1] * s[ia-1] + g.alpha[ia] * s[ia] );
+            dprev = d;
+          }
+          const double share = 0.5 * width / alphaRange;
+          if ( e0 > tolerance * ( 0.5 * l0 + share * i0[ib] )
+               || e1 > tolerance * ( 0.5 * l1 + share * i1[ib] ) )
+            return false;
+        }
+        return true;
+      } );
+      Grid res;
+      res.beta = g.beta;
+      for ( auto ia : keep )
+        res.alpha.push_back( g.alpha[ia] );
+      res.sab.reserve( keep.size() * nb );
+      for ( std::size_t ib = 0; ib < nb; ++ib )
+        for ( auto ia : keep )
+          res.sab.push_back( g.column( ib )[ia] );
+      return res;
+    }
+
+    //With i0 and i1 the integrals of the columns of the original kernel (rather
+    //than those of g), so the bound does not depend on the earlier stages:
+    Grid thinBeta( const Grid& g, const NC::VectD& i0, const NC::VectD& i1, double tolerance )
+    {
+      const std::size_t na = g.alpha.size();
+      auto keep = thinGrid( g.beta.size(), [&]( std::size_t jl, std::size_t jr )
+      {
+        const double * sl = g.column( jl );
+        const double * sr = g.column( jr );
+        for ( std::size_t j = jl + 1; j < jr; ++j ) {
+          const double u = ( g.beta[j] - g.beta[jl] ) / ( g.beta[jr] - g.beta[jl] );
+          const double * s = g.column( j );
+          double e0 = 0.0, e1 = 0.0;
+          double dprev = ( 1.0 - u ) * sl[0] + u * sr[0] - s[0];
+          for ( std::size_t ia = 1; ia < na; ++ia ) {
+            const double d = ( 1.0 - u ) * sl[ia] + u * sr[ia] - s[ia];
+            const double e = absIntegral( dprev, d, g.alpha[ia] - g.alpha[ia-1] );
+            e0 += e;
+            e1 += g.alpha[ia] * e;
+            dprev = d;
+          }
+          if ( e0 > tolerance * i0[j] || e1 > tolerance * i1[j] )
+            return false;
+        }
+        return true;
+      } );
+      Grid res;
+      res.alpha = g.alpha;
+      for ( auto ib : keep ) {
+        res.beta.push_back( g.beta[ib] );
+        res.sab.insert( res.sab.end(), g.column( ib ), g.column( ib ) + na );
+      }
+      return res;
+    }
+
+  }
+}
+
+NC::ScatKnlData NCP::regridKernel( const NC::ScatKnlData& data, double tolerance )
+{
+  using KnlType = NC::ScatKnlData::KnlType;
+  if ( data.knltype != KnlType::SAB && data.knltype != KnlType::SCALED_SYM_SAB )
+    NCRYSTAL_THROW2(BadInput,"Regridding only supports kernels of type SAB or SCALED_SYM_SAB");
+  if ( !( tolerance >= 0.0 ) )
+    NCRYSTAL_THROW2(BadInput,"Invalid regridding tolerance: "<<tolerance);
+
+  Grid g{ data.alphaGrid, data.betaGrid, data.sab };
+  NC::VectD i0, i1;
+  columnIntegrals( g, i0, i1 );
+  g = thinAlpha( g, i0, i1, 0.5 * tolerance );
+  g = thinBeta( g, i0, i1, 0.5 * tolerance );
+
+  NC::ScatKnlData res = data;
+  res.alphaGrid = std::move( g.alpha );
+  res.betaGrid = std::move( g.beta );
+  res.sab = std::move( g.sab );
+  return res;
+}
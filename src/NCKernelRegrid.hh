@@ -0,0 +1,36 @@
+#ifndef NCPlugin_KernelRegrid_hh
+#define NCPlugin_KernelRegrid_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+
+namespace NCPluginNamespace {
+
+  //Reduction of the alpha and beta grids of a kernel (of type SAB or
+  //SCALED_SYM_SAB) at load time. The BzScope kernels come on fine uniform
+  //grids, with large smooth or empty regions in which grid points can be
+  //dropped without changing the kernel much (all tables built from the kernel
+  //get smaller and faster as well).
+  //
+  //Grid points are removed greedily, wherever the kernel linearly
+  //interpolated between the remaining points stays close to the original
+  //values. Closeness is measured on the integral of S over alpha (the cross
+  //section contribution of each beta point) and on its first moment in alpha,
+  //with the first moment in beta following from the former. The alpha grid is
+  //thinned first: the integrated absolute deviation in each removed range of
+  //alpha must stay below half the tolerance times the average of the integral
+  //of the beta column over that range and its share (by width) of the full
+  //integral. These allowances add up to at most half the tolerance times the
+  //integral of the column. Beta grid points are then removed when the
+  //integrated absolute deviation of the interpolated column from the (alpha
+  //thinned) column stays below half the tolerance times the integral of the
+  //original column. The relative change of the integral and first moment of
+  //every beta column is therefore bounded by the tolerance. The end points of
+  //both grids are always kept.
+
+  NC::ScatKnlData regridKernel( const NC::ScatKnlData&, double tolerance );
+
+}
+
+#endif
@@ -0,0 +1,354 @@
+#include "NCKernelScatter.hh"
+#include "NCInstrumentation.hh"
+#include "NCParallel.hh"
+#include "NCXSTable.hh"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+
+namespace NCPluginNamespace {
+  namespace {
+
+    //Energy grid of the tables:
+    constexpr double tableEmin = 1e-5;//eV
+
+    //Energy and cross section, and the beta CDF (in the precision of the
+    //kernel values), at each grid point:
+    std::size_t bytesPerGridPoint( const SparseKernel& kernel )
+    {
+      return 2 * sizeof(double) + kernel.betaGrid().size()
+        * ( kernel.singlePrecision() ? sizeof(float) : sizeof(double) );
+    }
+
+    std::size_t gridSize( double emax, double pointsPerDecade )
+    {
+      return static_cast<std::size_t>( std::ceil( std::log10( emax / tableEmin )
+                                                  * pointsPerDecade ) ) + 1;
+    }
+
+    //Give up sampling from the tables (and compute the exact table at the
+    //neutron energy instead) after this many rejected attempts:
+    constexpr unsigned maxSampleAttempts = 100;
+
+    //See KernelScatter::calcBetaCDF:
+    double betaCDF( const SparseKernel& kernel, double kT, double massAMU,
+                    double ekin, double * cdf )
+    {
+      const double ekin_div_kT = ekin / kT;
+      const NC::VectD& bgrid = kernel.betaGrid();
+      const std::size_t nbeta = bgrid.size();
+      double prevI = 0.0;
+      double total = 0.0;
+      for ( std::size_t j = 0; j < nbeta; ++j ) {
+        const double beta = bgrid[j];
+        double I = 0.0;
+        if ( beta > -ekin_div_kT ) {
+          double alow, ahigh;
+          alphaLimits( ekin_div_kT, beta, massAMU, alow, ahigh );
+          I = kernel.integrateAlpha( j, alow, ahigh );
+          if ( j > 0 ) {
+            //Trapezoidal integration in beta, with the integrand vanishing at
+            //the lower kinematic limit beta=-ekin/kT:
+            const double beta0 = NC::ncmax( bgrid[j-1], -ekin_div_kT );
+            total += 0.5 * ( prevI + I ) * ( beta - beta0 );
+          }
+        }
+        cdf[j] = total;
+        prevI = I;
+      }
+      return total;
+    }
+
+  }
+}
+
+NCP::KernelScatter::KernelScatter( NC::shared_obj<const SparseKernel> kernel, double emax,
+                                   unsigned nthreads, double pointsPerDecade,
+                                   double accuracy, std::size_t max_memory )
+  : m_kernel( std::move(kernel) ),
+    m_kT( NC::constant_boltzmann * m_kernel->temperature() ),
+    m_massAMU( m_kernel->elementMassAMU() ),
+    m_xsFactor( m_kernel->boundXS() * m_kernel->elementMassAMU() * 0.25 ),
+    m_logEmin( std::log( tableEmin ) )
+{
+  if ( !( emax > tableEmin * 1.0001 ) )
+    NCRYSTAL_THROW2(BadInput,"KernelScatter: invalid emax value: "<<emax);
+  if ( !( pointsPerDecade >= minPointsPerDecade ) )
+    NCRYSTAL_THROW2(BadInput,"KernelScatter: energy grid density of "<<pointsPerDecade
+                    <<" points per decade is too low (must be at least "<<minPointsPerDecade<<")");
+
+  const std::size_t nbins = gridSize( emax, pointsPerDecade ) - 1;
+  std::size_t maxbins = gridSize( emax, XSTable::maxPointsPerDecade ) - 1;
+  if ( max_memory )
+    maxbins = NC::ncmin( maxbins, gridSize( emax, maxPointsPerDecade( *m_kernel, emax, max_memory ) ) - 1 );
+
+  //The cross section at each energy is the total of its beta CDF, so the CDFs
+  //are kept as they are computed during the refinement (the points of the
+  //grid are the exact energy values passed to exact_xs):
+  const std::size_t nbeta = m_kernel->betaGrid().size();
+  std::mutex mutex;
+  std::map<double,NC::VectD> cdfs;
+  auto exact_xs = [this,nbeta,&mutex,&cdfs]( double ekin )
+  {
+    NC::VectD cdf( nbeta );
+    const double total = calcBetaCDF( ekin, cdf.data() );
+    std::lock_guard<std::mutex> lock( mutex );
+    cdfs[ekin] = std::move( cdf );
+    return m_xsFactor * m_kT / ekin * total;
+  };
+  auto grid = refineLogGrid( exact_xs, tableEmin, emax, accuracy, nbins, maxbins, nthreads );
+  m_egrid = std::move( grid.egrid );
+  m_xs = std::move( grid.xs );
+  const std::size_t ne = m_egrid.size();
+  m_invDLogE = ( ne - 1 ) / ( std::log( emax ) - m_logEmin );
+
+  m_betaCDF = ValueTable( ne * nbeta, m_kernel->singlePrecision() );
+  for ( std::size_t i = 0; i < ne; ++i ) {
+    const NC::VectD& cdf = cdfs.at( m_egrid[i] );
+    for ( std::size_t j = 0; j < nbeta; ++j )
+      m_betaCDF.set( i * nbeta + j, cdf[j] );
+  }
+}
+
+NCP::KernelScatter::KernelScatter( NC::shared_obj<const SparseKernel> kernel, TableReader& r )
+  : m_kernel( std::move(kernel) ),
+    m_kT( r.get<double>() ),
+    m_massAMU( r.get<double>() ),
+    m_xsFactor( r.get<double>() ),
+    m_logEmin( r.get<double>() ),
+    m_invDLogE( r.get<double>() ),
+    m_egrid( r.getVector<double>() ),
+    m_xs( r.getVector<double>() ),
+    m_betaCDF( r.getTable() )
+{
+  if ( m_egrid.size() < 2 || m_xs.size() != m_egrid.size()
+       || m_betaCDF.size() != m_egrid.size() * m_kernel->betaGrid().size()
+       || m_betaCDF.singlePrecision() != m_kernel->singlePrecision() )
+    NCRYSTAL_THROW(DataLoadError,"KernelScatter: inconsistent tables");
+}
+
+void NCP::KernelScatter::writeTables( TableWriter& w ) const
+{
+  w.put( m_kT );
+  w.put( m_massAMU );
+  w.put( m_xsFactor );
+  w.put( m_logEmin );
+  w.put( m_invDLogE );
+  w.putArray( m_egrid );
+  w.putArray( m_xs );
+  w.putTable( m_betaCDF );
+}
+
+std::size_t NCP::KernelScatter::estimateMemoryUsage( const SparseKernel& kernel, double emax,
+                                                     double pointsPerDecade )
+{
+  return sizeof(KernelScatter) + gridSize( emax, pointsPerDecade ) * bytesPerGridPoint( kernel );
+}
+
+double NCP::KernelScatter::maxPointsPerDecade( const SparseKernel& kernel, double emax,
+                                               std::size_t bytes )
+{
+  const std::size_t perpoint = bytesPerGridPoint( kernel );
+  if ( bytes < sizeof(KernelScatter) + 2 * perpoint )
+    return 0.0;
+  const std::size_t ne = ( bytes - sizeof(KernelScatter) ) / perpoint;
+  //(slightly reduced, so rounding errors can not give an extra grid point):
+  return ( ne - 1 ) / std::log10( emax / tableEmin ) * ( 1.0 - 1e-12 );
+}
+
+double NCP::KernelScatter::calcBetaCDF( double ekin, double * cdf ) const
+{
+  return betaCDF( *m_kernel, m_kT, m_massAMU, ekin, cdf );
+}
+
+double NCP::KernelScatter::exactCrossSection( const SparseKernel& kernel, double ekin )
+{
+  const double kT = NC::constant_boltzmann * kernel.temperature();
+  NC::VectD cdf( kernel.betaGrid().size() );
+  return kernel.boundXS() * kernel.elementMassAMU() * 0.25 * kT / ekin
+    * betaCDF( kernel, kT, kernel.elementMassAMU(), ekin, cdf.data() );
+}
+
+std::size_t NCP::KernelScatter::gridBin( double ekin ) const
+{
+  //Index i of the grid bin [E_i,E_i+1] containing ekin (which must be inside
+  //the grid). Rounding errors might give the neighbouring bin for energies
+  //right at a grid point, which is harmless for the linear interpolation:
+  const double x = ( std::log( ekin ) - m_logEmin ) * m_invDLogE;
+  const double xmax = static_cast<double>( m_egrid.size() - 2 );
+  return static_cast<std::size_t>( NC::ncclamp( x, 0.0, xmax ) );
+}
+
+NCP::KernelScatter::GridLookup NCP::KernelScatter::lookup( double ekin ) const
+{
+  //Outside the grid, the tables at the grid edges still give reasonable
+  //proposals for the beta bins:
+  GridLookup res{ ekin, 0.0, 0, 0, 1.0, 0.0 };
+  if ( !( ekin > 0.0 ) )
+    return res;
+  if ( ekin <= m_egrid.front() ) {
+    res.xs = m_xs.front() * std::sqrt( m_egrid.front() / ekin );
+    return res;
+  }
+  if ( ekin >= m_egrid.back() ) {
+    res.ilow = res.ihigh = m_egrid.size() - 1;
+    res.xs = m_xs.back() * m_egrid.back() / ekin;
+    return res;
+  }
+  const std::size_t i = gridBin( ekin );
+  const double t = ( ekin - m_egrid[i] ) / ( m_egrid[i+1] - m_egrid[i] );
+  res.xs = m_xs[i] + t * ( m_xs[i+1] - m_xs[i] );
+  res.ilow = i;
+  res.ihigh = i + 1;
+  const double tclamped = NC::ncclamp( t, 0.0, 1.0 );
+  res.wlow = ( 1.0 - tclamped ) * m_xs[i];
+  res.whigh = tclamped * m_xs[i+1];
+  return res;
+}
+
+void NCP::KernelScatter::crossSections( const double * ekin, std::size_t n, double * out ) const
+{
+  //Same as crossSection, but written without early returns in the loop body,
+  //so the compiler can vectorise it:
+  const double * egrid = m_egrid.data();
+  const double * xs = m_xs.data();
+  const double emin = m_egrid.front();
+  const double emax = m_egrid.back();
+  const double xsmin = m_xs.front();
+  const double xsmax = m_xs.back();
+  const double xmax = static_cast<double>( m_egrid.size() - 2 );
+  for ( std::size_t k = 0; k < n; ++k ) {
+    const double e = ekin[k];
+    const double esafe = NC::ncclamp( e, emin, emax );
+    const double x = ( std::log( esafe ) - m_logEmin ) * m_invDLogE;
+    const std::size_t i = static_cast<std::size_t>( NC::ncclamp( x, 0.0, xmax ) );
+    const double t = ( esafe - egrid[i] ) / ( egrid[i+1] - egrid[i] );
+    const double xs_inside = xs[i] + t * ( xs[i+1] - xs[i] );
+    const double xs_below = ( e > 0.0 ? xsmin * std::sqrt( emin / e ) : 0.0 );
+    const double xs_above = xsmax * emax / e;
+    out[k] = ( e <= emin ? xs_below : ( e >= emax ? xs_above : xs_inside ) );
+  }
+}
+
+template<class TValue>
+bool NCP::KernelScatter::trySample( const TValue * cdf, double ekin,
+                                    NC::RNG& rng, Outcome& outcome ) const
+{
+  const SparseKernel& knl = *m_kernel;
+  const NC::VectD& bgrid = knl.betaGrid();
+  const std::size_t nbeta = bgrid.size();
+  const double ekin_div_kT = ekin / m_kT;
+
+  //Beta bin from the table:
+  const double total = cdf[nbeta-1];
+  std::size_t j = std::upper_bound( cdf, cdf + nbeta, static_cast<TValue>( rng.generate() * total ) ) - cdf;
+  j = NC::ncmin<std::size_t>( NC::ncmax<std::size_t>( j, 1 ), nbeta - 1 ) - 1;
+  const double bA = bgrid[j];
+  const double bB = bgrid[j+1];
+  if ( !( bB > -ekin_div_kT ) )
+    return false;
+
+  //Beta within the bin, from the kernel at the actual energy:
+  const double blow = NC::ncmax( bA, -ekin_div_kT );
+  double alow, ahigh;
+  double IA = 0.0;
+  if ( bA > -ekin_div_kT ) {
+    alphaLimits( ekin_div_kT, bA, m_massAMU, alow, ahigh );
+    IA = knl.integrateAlpha( j, alow, ahigh );
+  }
+  alphaLimits( ekin_div_kT, bB, m_massAMU, alow, ahigh );
+  const double IB = knl.integrateAlpha( j+1, alow, ahigh );
+  if ( !( IA + IB > 0.0 ) )
+    return false;
+  const double beta = sampleLinear( blow, bB, IA, IB, rng.generate() );
+
+  //Alpha from one of the two bracketing columns, in proportion to their
+  //interpolation weights:
+  const double u = ( beta - bA ) / ( bB - bA );
+  const double wA = ( 1.0 - u ) * IA;
+  const double wB = u * IB;
+  const std::size_t jcol = ( rng.generate() * ( wA + wB ) < wA ? j : j + 1 );
+  alphaLimits( ekin_div_kT, beta, m_massAMU, alow, ahigh );
+  const double W = knl.integrateAlpha( jcol, alow, ahigh );
+  if ( !( W > 0.0 ) )
+    return false;
+  const double alpha = knl.sampleAlpha( jcol, alow, ahigh, W, rng.generate() );
+
+  const double ekin_final = ekin + beta * m_kT;
+  if ( !( ekin_final > 0.0 ) )
+    return false;
+  const double mu = ( ekin + ekin_final - alpha * m_massAMU * m_kT )
+    / ( 2.0 * std::sqrt( ekin * ekin_final ) );
+  outcome.ekin_final = ekin_final;
+  outcome.mu = NC::ncclamp( mu, -1.0, 1.0 );
+  return true;
+}
+
+NCP::KernelScatter::Outcome NCP::KernelScatter::sampleScatteringEvent( NC::RNG& rng,
+                                                                       double ekin ) const
+{
+  return sampleScatteringEvent( rng, lookup( ekin ) );
+}
+
+NCP::KernelScatter::Outcome NCP::KernelScatter::sampleScatteringEvent( NC::RNG& rng,
+                                                                       const GridLookup& gl ) const
+{
+  const double ekin = gl.ekin;
+  Outcome outcome{ ekin, 1.0 };
+  const std::size_t nbeta = m_kernel->betaGrid().size();
+  const std::size_t ilow = gl.ilow;
+  const std::size_t ihigh = gl.ihigh;
+  const double wlow = gl.wlow;
+  const double whigh = gl.whigh;
+  if ( wlow + whigh > 0.0 ) {
+    for ( unsigned attempt = 0; attempt < maxSampleAttempts; ++attempt ) {
+      const std::size_t ie = ( rng.generate() * ( wlow + whigh ) < wlow ? ilow : ihigh );
+      const bool ok = visitBetaCDF( ie, [&]( auto cdf )
+      {
+        return trySample( cdf, ekin, rng, outcome );
+      } );
+      if ( ok ) {
+        if ( attempt && instrumentationEnabled() )
+          addCount( Counter::RejectedSamples, attempt );
+        return outcome;
+      }
+    }
+  }
+
+  //After too many rejections, use the exact table at this energy:
+  if ( instrumentationEnabled() ) {
+    addCount( Counter::RejectedSamples, wlow + whigh > 0.0 ? maxSampleAttempts : 0 );
+    addCount( Counter::ExactSampleFallbacks );
+  }
+  NC::VectD cdf( nbeta );
+  if ( calcBetaCDF( ekin, cdf.data() ) > 0.0 ) {
+    for ( unsigned attempt = 0; attempt < maxSampleAttempts; ++attempt ) {
+      if ( trySample( cdf.data(), ekin, rng, outcome ) ) {
+        if ( attempt && instrumentationEnabled() )
+          addCount( Counter::RejectedSamples, attempt );
+        return outcome;
+      }
+    }
+    if ( instrumentationEnabled() )
+      addCount( Counter::RejectedSamples, maxSampleAttempts );
+  }
+
+  //No kinematically allowed scattering at all, leave neutron unchanged:
+  outcome.ekin_final = ekin;
+  outcome.mu = 1.0;
+  return outcome;
+}
+
+double NCP::KernelScatter::selfCheck( unsigned nthreads, std::size_t npoints ) const
+{
+  return maxRelativeDeviation( [this]( double e ) { return crossSection( e ); },
+                               [this]( double e ) { return exactCrossSection( *m_kernel, e ); },
+                               m_egrid.front(), m_egrid.back(), npoints, nthreads );
+}
+
+std::size_t NCP::KernelScatter::memoryUsage() const
+{
+  return sizeof(*this)
+    + sizeof(double) * ( m_egrid.capacity() + m_xs.capacity() ) + m_betaCDF.memoryUsage();
+}
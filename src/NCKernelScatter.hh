@@ -0,0 +1,148 @@
+#ifndef NCPlugin_KernelScatter_hh
+#define NCPlugin_KernelScatter_hh
+
+#include "NCSparseKernel.hh"
+#include <cmath>
+
+namespace NCPluginNamespace {
+
+  //Cross sections and sampling of scattering events, computed directly from a
+  //SparseKernel rather than via the SAB integration classes of NCrystal.
+  //
+  //At construction, the kernel is integrated over the kinematically accessible
+  //region at each point of a log-uniform energy grid up to emax, which is
+  //refined by doubling until the interpolated cross sections reach a target
+  //accuracy (see refineLogGrid in NCXSTable.hh). For each such
+  //energy point, the cumulative integral over beta of the alpha-integrated
+  //kernel is kept as a sampling table, and its total gives the cross section:
+  //
+  //   sigma(E) = sigma_bound * A*kT/(4E) * int dbeta int dalpha S(alpha,beta)
+  //
+  //Cross sections at other energies are interpolated linearly, with 1/v and
+  //1/E extrapolations below and above the grid respectively. Since the grid is
+  //log-uniform, the grid bin is found by index arithmetic rather than search.
+  //Sampling picks one of the two neighbouring energy points and its beta bin,
+  //while the beta value within the bin and the alpha value are sampled from
+  //the kernel at the actual neutron energy (rejecting kinematically forbidden
+  //outcomes). Should this fail repeatedly, the sampling table is computed on
+  //the fly at that energy.
+  //
+  //The sampling tables are always built up front: they are the cumulative
+  //integrals from which the cross sections are computed anyway, so building
+  //them lazily would save little memory at the cost of computing them twice.
+
+  //Kinematic limits in alpha for a given beta and ekin/kT:
+  inline void alphaLimits( double ekin_div_kT, double beta, double massAMU,
+                           double& alow, double& ahigh )
+  {
+    const double s0 = std::sqrt( ekin_div_kT );
+    const double s1 = std::sqrt( NC::ncmax( 0.0, ekin_div_kT + beta ) );
+    alow = ( s1 - s0 ) * ( s1 - s0 ) / massAMU;
+    ahigh = ( s1 + s0 ) * ( s1 + s0 ) / massAMU;
+  }
+
+  //Sample x in [x0,x1] from the linear density going from y0 to y1:
+  inline double sampleLinear( double x0, double x1, double y0, double y1, double rand )
+  {
+    const double w = x1 - x0;
+    const double target = rand * 0.5 * ( y0 + y1 ) * w;
+    const double slope = ( y1 - y0 ) / w;
+    const double disc = NC::ncmax( 0.0, y0 * y0 + 2.0 * slope * target );
+    const double denom = y0 + std::sqrt( disc );
+    const double d = ( denom > 0.0 ? 2.0 * target / denom : rand * w );
+    return NC::ncclamp( x0 + d, x0, x1 );
+  }
+
+  class KernelScatter final : public NC::MoveOnly {
+  public:
+
+    //The tables are computed with nthreads threads (with identical results
+    //for any number of threads), on an energy grid with the given number of
+    //points per decade. Unless accuracy is 0, the grid is then refined until
+    //the cross sections are interpolated to within that relative accuracy, or
+    //until the next refinement would make memoryUsage() exceed max_memory (if
+    //non-zero) or the grid exceed XSTable::maxPointsPerDecade:
+    static constexpr double defaultPointsPerDecade = 40.0;
+    static constexpr double minPointsPerDecade = 5.0;
+    KernelScatter( NC::shared_obj<const SparseKernel>, double emax, unsigned nthreads = 1,
+                   double pointsPerDecade = defaultPointsPerDecade,
+                   double accuracy = 0.0, std::size_t max_memory = 0 );
+
+    //Tables written with writeTables (see SharedTables):
+    KernelScatter( NC::shared_obj<const SparseKernel>, TableReader& );
+    void writeTables( TableWriter& ) const;//excluding the kernel
+
+    //Memory usage (as reported by memoryUsage()) of the tables for a given
+    //kernel, emax and grid density, and the densest grid fitting in the given
+    //number of bytes (or 0 if not even a grid with two points fits):
+    static std::size_t estimateMemoryUsage( const SparseKernel&, double emax, double pointsPerDecade );
+    static double maxPointsPerDecade( const SparseKernel&, double emax, std::size_t bytes );
+
+    double crossSection( double neutron_ekin ) const { return lookup( neutron_ekin ).xs; }
+
+    //Cross section of a kernel at a single energy (the value the tables would
+    //hold at a grid point there), without building any tables:
+    static double exactCrossSection( const SparseKernel&, double neutron_ekin );
+    void crossSections( const double * neutron_ekin, std::size_t n, double * out_xs ) const;
+
+    struct Outcome { double ekin_final, mu; };
+    Outcome sampleScatteringEvent( NC::RNG& rng, double neutron_ekin ) const;
+
+    //Energy grid lookup at a given energy, giving the interpolated cross
+    //section and the grid points (ilow, ihigh) to use for sampling, with
+    //weights in proportion to their contributions to the cross section.
+    //Callers can keep the result (e.g. in their NC::CachePtr) to skip the
+    //lookup in later calls at the same energy:
+    struct GridLookup {
+      double ekin, xs;
+      std::size_t ilow, ihigh;
+      double wlow, whigh;
+    };
+    GridLookup lookup( double neutron_ekin ) const;
+    Outcome sampleScatteringEvent( NC::RNG& rng, const GridLookup& ) const;
+
+    const SparseKernel& kernel() const { return *m_kernel; }
+    const NC::VectD& energyGrid() const { return m_egrid; }
+    double kT() const { return m_kT; }
+    double pointsPerDecade() const { return m_invDLogE * std::log( 10.0 ); }
+
+    //Calls fct with the cumulative integrals over beta at the ie'th point of
+    //the energy grid, i.e. a pointer to the values at each point of the beta
+    //grid (the last value is the total). They are stored in single precision
+    //if the kernel is:
+    template<class TFct>
+    auto visitBetaCDF( std::size_t ie, TFct&& fct ) const
+    {
+      const std::size_t offset = ie * m_kernel->betaGrid().size();
+      return m_betaCDF.visit( [&fct,offset]( auto cdfs ) { return fct( cdfs + offset ); } );
+    }
+
+    std::size_t memoryUsage() const;//excluding the kernel
+
+    //Largest relative deviation between the interpolated and the exact cross
+    //sections (see maxRelativeDeviation in NCXSTable.hh), at points which
+    //unlike those checked during construction are not aligned with the grid:
+    double selfCheck( unsigned nthreads = 1, std::size_t npoints = 2000 ) const;
+
+  private:
+    NC::shared_obj<const SparseKernel> m_kernel;
+    double m_kT;
+    double m_massAMU;
+    double m_xsFactor;
+    double m_logEmin;
+    double m_invDLogE;
+    NC::VectD m_egrid;
+    NC::VectD m_xs;
+    ValueTable m_betaCDF;//m_egrid.size() rows, each of length nbeta
+
+    //Fill cdf with cumulative integrals at each beta grid point and return
+    //the total:
+    double calcBetaCDF( double ekin, double * cdf ) const;
+    std::size_t gridBin( double ekin ) const;
+    template<class TValue>
+    bool trySample( const TValue * cdf, double ekin, NC::RNG&, Outcome& ) const;
+  };
+
+}
+
+#endif
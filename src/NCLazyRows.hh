@@ -0,0 +1,75 @@
+#ifndef NCPlugin_LazyRows_hh
+#define NCPlugin_LazyRows_hh
+
+#include "NCInstrumentation.hh"
+#include <memory>
+
+namespace NCPluginNamespace {
+
+  //Rows of a table (e.g. the sampling tables at each energy grid point) which
+  //are only built when first needed, so runs using a narrow band of energies
+  //never pay for the others. Rows are published lock-free through an atomic
+  //pointer per row, and are immutable once published: the first thread
+  //needing a row builds it and installs it with a compare-and-swap. Threads
+  //racing to build the same row might each build a copy, but exactly one of
+  //them is published and used by all threads (the others are discarded), so
+  //results do not depend on which thread built the row. Default constructed
+  //instances hold no rows (enabled() is false).
+
+  template<class TRow>
+  class LazyRows final : public NC::MoveOnly {
+  public:
+    LazyRows() = default;
+    explicit LazyRows( std::size_t nrows ) : m_state( std::make_unique<State>( nrows ) ) {}
+
+    bool enabled() const { return m_state != nullptr; }
+    std::size_t size() const { return m_state ? m_state->nrows : 0; }
+
+    //Number of rows published so far:
+    std::size_t nBuilt() const
+    {
+      return m_state ? m_state->nbuilt.load( std::memory_order_relaxed ) : 0;
+    }
+
+    //Row i, built by build() (returning a TRow) if not yet published:
+    template<class TBuild>
+    const TRow& get( std::size_t i, TBuild&& build ) const
+    {
+      nc_assert( i < size() );
+      std::atomic<const TRow*>& slot = m_state->rows[i];
+      const TRow * row = slot.load( std::memory_order_acquire );
+      if ( row )
+        return *row;
+      auto built = std::make_unique<const TRow>( build() );
+      if ( slot.compare_exchange_strong( row, built.get(), std::memory_order_acq_rel,
+                                         std::memory_order_acquire ) ) {
+        m_state->nbuilt.fetch_add( 1, std::memory_order_relaxed );
+        if ( instrumentationEnabled() )
+          addCount( Counter::LazyRowsBuilt );
+        return *built.release();
+      }
+      return *row;//published by another thread in the meantime
+    }
+
+  private:
+    struct State {
+      std::size_t nrows;
+      std::unique_ptr<std::atomic<const TRow*>[]> rows;
+      std::atomic<std::size_t> nbuilt{ 0 };
+      explicit State( std::size_t n ) : nrows(n), rows( new std::atomic<const TRow*>[n] )
+      {
+        for ( std::size_t i = 0; i < n; ++i )
+          rows[i].store( nullptr, std::memory_order_relaxed );
+      }
+      ~State()
+      {
+        for ( std::size_t i = 0; i < nrows; ++i )
+          delete rows[i].load( std::memory_order_relaxed );
+      }
+    };
+    std::unique_ptr<State> m_state;
+  };
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+#include "NCModelCache.hh"
+#include "NCKernelCache.hh"
+#include "NCMultiPhonon.hh"
+#include <future>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+namespace NCPluginNamespace {
+  namespace {
+
+    using ModelPtr = std::shared_ptr<const KernelModel>;
+    using Key = std::tuple<std::uint64_t,int,double,double,double,double,bool,double,bool,std::uint64_t>;//content+temperature, options, terms
+
+    struct Entry {
+      std::weak_ptr<const KernelModel> model;
+      std::shared_future<ModelPtr> pending;//valid while being built
+    };
+
+    struct ModelCache {
+      std::mutex mutex;
+      std::map<Key,Entry> entries;
+    };
+
+    ModelCache& modelCache()
+    {
+      static ModelCache cache;
+      return cache;
+    }
+
+  }
+}
+
+std::shared_ptr<const NCP::KernelModel>
+NCP::getSharedKernelModel( const NC::Info::CustomSectionData& raw,
+                           const KernelFile * kernelfile,
+                           double section_temperature,
+                           const PhysicsModel::Options& opts,
+                           const MultiPhononTerms * terms )
+{
+  KernelCache diskcache( raw, NC::Temperature{ section_temperature }, kernelfile );
+  const Key key{ diskcache.key(), static_cast<int>( opts.kernelMode ), opts.xsTableAccuracy,
+                 opts.fastSampling ? opts.fastSamplingMemoryMB : 0.0,
+                 opts.gridDensity, opts.memoryBudgetMB, opts.singlePrecision, opts.regridTolerance,
+                 opts.lazyTables && opts.fastSampling, terms ? terms->key() : 0 };
+
+  auto& cache = modelCache();
+  std::promise<ModelPtr> promise;
+  {
+    std::unique_lock<std::mutex> lock( cache.mutex );
+    auto it = cache.entries.find( key );
+    if ( it != cache.entries.end() ) {
+      if ( auto model = it->second.model.lock() )
+        return model;
+      if ( it->second.pending.valid() ) {
+        //Being built by another thread, wait for it (outside the lock):
+        auto pending = it->second.pending;
+        lock.unlock();
+        return pending.get();
+      }
+    } else {
+      //Forget expired entries while we are at it:
+      for ( auto itE = cache.entries.begin(); itE != cache.entries.end(); ) {
+        if ( itE->second.model.expired() && !itE->second.pending.valid() )
+          itE = cache.entries.erase( itE );
+        else
+          ++itE;
+      }
+      it = cache.entries.emplace( key, Entry() ).first;
+    }
+    it->second.pending = promise.get_future().share();
+  }
+
+  //We are responsible for building the model:
+  ModelPtr model;
+  try {
+    model = std::make_shared<const KernelModel>( raw, kernelfile, diskcache, opts, terms );
+  } catch (...) {
+    {
+      std::lock_guard<std::mutex> lock( cache.mutex );
+      cache.entries.erase( key );
+    }
+    promise.set_exception( std::current_exception() );
+    throw;
+  }
+  {
+    std::lock_guard<std::mutex> lock( cache.mutex );
+    auto& entry = cache.entries[key];
+    entry.model = model;
+    entry.pending = std::shared_future<ModelPtr>();
+  }
+  promise.set_value( model );
+  return model;
+}
@@ -0,0 +1,32 @@
+#ifndef NCPlugin_ModelCache_hh
+#define NCPlugin_ModelCache_hh
+
+#include "NCKernelModel.hh"
+
+namespace NCPluginNamespace {
+
+  //Process-wide cache of KernelModel instances, letting all PhysicsModels
+  //using the same @CUSTOM_BZSCOPE section share the (expensive) model built
+  //from it. This covers both different scatter requests for the same material
+  //(e.g. cfg strings which only differ in parameters which are irrelevant to
+  //the plugin, like packfact or dcutoff), and requests at different
+  //temperatures which are interpolated between the same sections. Entries are
+  //keyed by a hash of the section content, the section temperature, the build
+  //options and any multi-phonon terms added to the kernel.
+  //
+  //The cache only holds weak references, so models are released once no
+  //longer in use. It is thread-safe, and when several threads request the
+  //same (not yet available) model concurrently, only one of them builds it
+  //while the others wait for the result. The KernelFile is the one of the
+  //section, if any (see KernelFile::open).
+
+  std::shared_ptr<const KernelModel>
+  getSharedKernelModel( const NC::Info::CustomSectionData&,
+                        const KernelFile*,
+                        double section_temperature,
+                        const PhysicsModel::Options&,
+                        const MultiPhononTerms* = nullptr );
+
+}
+
+#endif
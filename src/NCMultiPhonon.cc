@@ -0,0 +1,196 @@
+#include "NCMultiPhonon.hh"
+#include "NCHash.hh"
+#include "NCParallel.hh"
+#include "NCSparseKernel.hh"
+#include "NCrystal/internal/vdos/NCVDOSToScatKnl.hh"
+#include <algorithm>
+
+namespace NCPluginNamespace {
+  namespace {
+
+    //Sorted union of grid points, with points closer than a tiny relative
+    //distance counted as the same:
+    NC::VectD mergedGrid( NC::VectD v )
+    {
+      std::sort( v.begin(), v.end() );
+      NC::VectD res;
+      res.reserve( v.size() );
+      for ( double x : v )
+        if ( res.empty() || x - res.back() > 1e-12 * NC::ncmax( NC::ncabs( x ), NC::ncabs( res.back() ) ) )
+          res.push_back( x );
+      return res;
+    }
+
+    //A kernel converted to the variables of the merged kernel, in which
+    //S(alpha,beta) = factor * S_own(alpha/alphaScale,beta/betaScale):
+    struct Term {
+      SparseKernel kernel;
+      double alphaScale;
+      double betaScale;
+      double factor;
+    };
+
+    //Bracketing beta grid points of a kernel, and the interpolation weight of
+    //the upper one (returns false outside the grid):
+    bool betaBin( const SparseKernel& kernel, double beta, std::size_t& j, double& u )
+    {
+      const NC::VectD& bgrid = kernel.betaGrid();
+      if ( !( beta >= bgrid.front() && beta <= bgrid.back() ) )
+        return false;
+      j = std::upper_bound( bgrid.begin(), bgrid.end(), beta ) - bgrid.begin();
+      j = NC::ncmin( NC::ncmax<std::size_t>( j, 1 ), bgrid.size() - 1 ) - 1;
+      u = ( beta - bgrid[j] ) / ( bgrid[j+1] - bgrid[j] );
+      return true;
+    }
+
+  }
+}
+
+NC::ScatKnlData NCP::mergeKernels( const NC::ScatKnlData& base,
+                                   const std::vector<WeightedKernel>& terms,
+                                   unsigned nthreads )
+{
+  //All kernels (including the base one, with unit scales) in the standard
+  //format of SparseKernel. Since alpha*A*kT and beta*kT do not depend on the
+  //element mass A and temperature T, the grids of the other kernels are
+  //converted to the variables of the base kernel by scaling, and the kernel
+  //values by the Jacobian of the conversion (for the cross section to be
+  //preserved) and the ratio of the bound cross sections:
+  std::vector<Term> kernels;
+  kernels.push_back( { SparseKernel( base ), 1.0, 1.0, 1.0 } );
+  const double T0 = base.temperature.dbl();
+  const double A0 = base.elementMassAMU.dbl();
+  const double sigma0 = base.boundXS.dbl();
+  for ( const auto& t : terms ) {
+    if ( !( t.weight >= 0.0 ) )
+      NCRYSTAL_THROW2(BadInput,"Invalid kernel weight: "<<t.weight);
+    if ( t.weight == 0.0 )
+      continue;
+    const double betaScale = t.kernel.temperature.dbl() / T0;
+    const double alphaScale = betaScale * t.kernel.elementMassAMU.dbl() / A0;
+    const double factor = t.weight * t.kernel.boundXS.dbl() / ( sigma0 * betaScale );
+    kernels.push_back( { SparseKernel( t.kernel ), alphaScale, betaScale, factor } );
+  }
+
+  NC::VectD alphas, betas;
+  for ( const auto& k : kernels ) {
+    for ( double a : k.kernel.alphaGrid() )
+      alphas.push_back( a * k.alphaScale );
+    for ( double b : k.kernel.betaGrid() )
+      betas.push_back( b * k.betaScale );
+  }
+  NC::ScatKnlData res;
+  res.alphaGrid = mergedGrid( std::move(alphas) );
+  res.betaGrid = mergedGrid( std::move(betas) );
+  const std::size_t na = res.alphaGrid.size();
+  const std::size_t nb = res.betaGrid.size();
+  res.sab.resize( na * nb );
+  parallelFor( nthreads, nb, [&]( std::size_t ib )
+  {
+    double * col = &res.sab[ib*na];
+    for ( const auto& k : kernels ) {
+      std::size_t j;
+      double u;
+      if ( !betaBin( k.kernel, res.betaGrid[ib] / k.betaScale, j, u ) )
+        continue;
+      for ( std::size_t ia = 0; ia < na; ++ia ) {
+        const double alpha = res.alphaGrid[ia] / k.alphaScale;
+        col[ia] += k.factor * ( ( 1.0 - u ) * k.kernel.evaluate( j, alpha )
+                                + u * k.kernel.evaluate( j + 1, alpha ) );
+      }
+    }
+  } );
+
+  res.knltype = NC::ScatKnlData::KnlType::SAB;
+  res.temperature = base.temperature;
+  res.elementMassAMU = base.elementMassAMU;
+  res.boundXS = base.boundXS;
+  res.suggestedEmax = base.suggestedEmax;
+  res.betaGridOptimised = base.betaGridOptimised;
+  return res;
+}
+
+NCP::MultiPhononTerms::MultiPhononTerms( const NC::Info& info, unsigned vdoslux )
+  : m_vdoslux(vdoslux), m_key(fnvOffset)
+{
+  for ( const auto& di : info.getDynamicInfoList() ) {
+    auto di_vdos = dynamic_cast<const NC::DI_VDOS*>( di.get() );
+    if ( !di_vdos )
+      NCRYSTAL_THROW2(BadInput,"Merging the multi-phonon contributions into the kernel requires"
+                      " all @DYNINFO sections to be of type vdos");
+    const double scatxs = di_vdos->atomData().scatteringXS().dbl();
+    if ( !( scatxs > 0.0 ) )
+      continue;
+    m_elements.push_back( { &di_vdos->vdosData(), di->fraction(),
+                            di_vdos->atomData().incoherentXS().dbl() / scatxs } );
+  }
+
+  //Contributions left out (the other lines of the sections concern NCrystal
+  //only):
+  const unsigned nhacks = info.countCustomSections( "UNOFFICIALHACKS" );
+  for ( unsigned i = 0; i < nhacks; ++i ) {
+    for ( const auto& line : info.getCustomSection( "UNOFFICIALHACKS", i ) ) {
+      if ( line.empty() || line.front() != "vdos2sab_ignorecontrib" )
+        continue;
+      int low = 0;
+      int high = 0;
+      bool ok = ( line.size() >= 2 && line.size() <= 4 && NC::safe_str2int( line[1], low ) && low >= 1 );
+      std::size_t ipart = 2;
+      if ( ok && line.size() >= 3 && NC::safe_str2int( line[2], high ) )
+        ipart = 3;
+      else
+        high = low;
+      IgnoredContrib ic{ static_cast<unsigned>( low ), static_cast<unsigned>( high ), true, true };
+      if ( ok && ipart < line.size() ) {
+        ic.coherent = ( line[ipart] == "coherent" );
+        ic.incoherent = ( line[ipart] == "incoherent" );
+        ok = ( ipart + 1 == line.size() && ic.coherent != ic.incoherent );
+      }
+      if ( !ok || high < low )
+        NCRYSTAL_THROW2(BadInput,"Invalid vdos2sab_ignorecontrib line in @CUSTOM_UNOFFICIALHACKS"
+                        " section (expected \"vdos2sab_ignorecontrib low [high] [coherent|incoherent]\")");
+      m_ignored.push_back( ic );
+    }
+  }
+
+  const double lux = static_cast<double>( vdoslux );
+  m_key = fnv1a( m_key, &lux, sizeof(lux) );
+  for ( const auto& e : m_elements ) {
+    const double scalars[] = { e.fraction, e.incoherentFraction,
+                               e.vdos->vdos_egrid().first, e.vdos->vdos_egrid().second,
+                               e.vdos->temperature().dbl(), e.vdos->boundXS().dbl(),
+                               e.vdos->elementMassAMU().dbl() };
+    m_key = fnv1a( m_key, scalars, sizeof(scalars) );
+    const NC::VectD& density = e.vdos->vdos_density();
+    m_key = fnv1a( m_key, density.data(), density.size() * sizeof(double) );
+  }
+  for ( const auto& ic : m_ignored ) {
+    const double scalars[] = { double( ic.low ), double( ic.high ),
+                               ic.coherent ? 1.0 : 0.0, ic.incoherent ? 1.0 : 0.0 };
+    m_key = fnv1a( m_key, scalars, sizeof(scalars) );
+  }
+}
+
+std::vector<NCP::WeightedKernel> NCP::MultiPhononTerms::kernels() const
+{
+  std::vector<WeightedKernel> res;
+  for ( const auto& e : m_elements ) {
+    //Fraction of each order of the expansion which is kept:
+    auto keptFraction = [this,&e]( unsigned n )
+    {
+      bool coherent = true;
+      bool incoherent = true;
+      for ( const auto& ic : m_ignored ) {
+        if ( n >= ic.low && n <= ic.high ) {
+          coherent = coherent && !ic.coherent;
+          incoherent = incoherent && !ic.incoherent;
+        }
+      }
+      return ( coherent ? 1.0 - e.incoherentFraction : 0.0 ) + ( incoherent ? e.incoherentFraction : 0.0 );
+    };
+    res.push_back( { e.fraction, NC::createScatteringKernel( *e.vdos, m_vdoslux, 0.0,
+                                                             NC::VDOSGn::TruncAndThinningChoices::Default,
+                                                             keptFraction ) } );
+  }
+  return res;
+}
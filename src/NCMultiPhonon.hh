@@ -0,0 +1,82 @@
+#ifndef NCPlugin_MultiPhonon_hh
+#define NCPlugin_MultiPhonon_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+
+namespace NCPluginNamespace {
+
+  //The @CUSTOM_BZSCOPE kernels only describe coherent one-phonon scattering.
+  //Normally, NCrystal adds the remaining inelastic scattering (the incoherent
+  //one-phonon and all multi-phonon contributions, derived from the VDOS of
+  //each element) as separate processes, which are combined with the plugin
+  //by the factory. With the mergeMultiPhonon option (see NCPhysicsModel.hh),
+  //those contributions are instead added to the kernel when the model is
+  //built, so a single kernel (and a single cross section lookup and sampler)
+  //covers all inelastic scattering.
+  //
+  //Kernels are merged on the union of their grids, expressed in the alpha and
+  //beta variables of the first kernel (the other kernels are converted from
+  //their own temperature and element mass). Each kernel is interpolated
+  //linearly in alpha and beta, and the sum is kept in the standard
+  //(non-symmetric) S(alpha,beta) format. The cross section of the merged
+  //kernel is then the sum of the cross sections of the kernels, each weighted
+  //by the given factor (e.g. the fraction of the element), up to the
+  //interpolation onto the merged grid. Only the energy range (suggested Emax)
+  //of the first kernel is kept.
+
+  struct WeightedKernel {
+    double weight;
+    NC::ScatKnlData kernel;
+  };
+
+  NC::ScatKnlData mergeKernels( const NC::ScatKnlData& base,
+                                const std::vector<WeightedKernel>& terms,
+                                unsigned nthreads = 1 );
+
+  //Contributions derived from the VDOS of each element in the material, which
+  //NCrystal would otherwise add as separate processes. As for those, the parts
+  //requested by "vdos2sab_ignorecontrib low [high] [coherent|incoherent]"
+  //lines in @CUSTOM_UNOFFICIALHACKS sections of the material are left out
+  //(orders low to high of the expansion, or only their coherent or incoherent
+  //part). The data files use this to leave out the coherent one-phonon part,
+  //which is the @CUSTOM_BZSCOPE kernel. Raises BadInput unless all dynamic info
+  //of the material is of the vdos type. The vdoslux parameter is the luxury
+  //level of the VDOS expansion (as the vdoslux cfg parameter of NCrystal).
+  //
+  //Construction is cheap, since the VDOS are only expanded into kernels by
+  //kernels(), when a model is actually built. The object refers to the dynamic
+  //info of the Info, which must outlive it:
+  class MultiPhononTerms final : public NC::MoveOnly {
+  public:
+    MultiPhononTerms( const NC::Info&, unsigned vdoslux );
+
+    //Hash of the VDOS data and of all parameters of the expansion:
+    std::uint64_t key() const { return m_key; }
+
+    //The contributions of each element, weighted by its fraction (for
+    //mergeKernels):
+    std::vector<WeightedKernel> kernels() const;
+
+  private:
+    struct Element {
+      const NC::VDOSData * vdos;
+      double fraction;
+      double incoherentFraction;//of the scattering cross section
+    };
+    struct IgnoredContrib {
+      unsigned low;
+      unsigned high;
+      bool coherent;
+      bool incoherent;
+    };
+    std::vector<Element> m_elements;
+    std::vector<IgnoredContrib> m_ignored;
+    unsigned m_vdoslux;
+    std::uint64_t m_key;
+  };
+
+}
+
+#endif
@@ -0,0 +1,50 @@
+#include "NCParallel.hh"
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+unsigned NCP::resolveThreadCount( unsigned nthreads )
+{
+  if ( nthreads > 0 )
+    return nthreads;
+  return NC::ncmax( 1u, std::thread::hardware_concurrency() );
+}
+
+void NCP::parallelFor( unsigned nthreads, std::size_t n,
+                       const std::function<void(std::size_t)>& fct )
+{
+  nthreads = static_cast<unsigned>( NC::ncmin<std::size_t>( nthreads, n ) );
+  if ( nthreads <= 1 ) {
+    for ( std::size_t i = 0; i < n; ++i )
+      fct( i );
+    return;
+  }
+
+  //Indices are handed out dynamically, since the cost per index often varies
+  //a lot (e.g. with the neutron energy):
+  std::atomic<std::size_t> next( 0 );
+  std::exception_ptr error;
+  std::mutex errorMutex;
+  auto worker = [&]()
+  {
+    try {
+      for ( std::size_t i = next++; i < n; i = next++ )
+        fct( i );
+    } catch (...) {
+      std::lock_guard<std::mutex> lock( errorMutex );
+      if ( !error )
+        error = std::current_exception();
+      next = n;//make the other threads stop early
+    }
+  };
+  std::vector<std::thread> threads;
+  threads.reserve( nthreads - 1 );
+  for ( unsigned i = 1; i < nthreads; ++i )
+    threads.emplace_back( worker );
+  worker();
+  for ( auto& t : threads )
+    t.join();
+  if ( error )
+    std::rethrow_exception( error );
+}
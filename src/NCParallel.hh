@@ -0,0 +1,26 @@
+#ifndef NCPlugin_Parallel_hh
+#define NCPlugin_Parallel_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+#include <functional>
+
+namespace NCPluginNamespace {
+
+  //Calls fct(i) for all i in [0,n), distributed over nthreads threads (with
+  //nthreads<=1 simply meaning a serial loop in the calling thread). Each index
+  //is handled by exactly one call, so results are independent of the number
+  //of threads as long as fct(i) only writes to memory owned by index i. The
+  //first exception thrown by any of the calls is rethrown in the calling
+  //thread, once all threads are done.
+  void parallelFor( unsigned nthreads, std::size_t n,
+                    const std::function<void(std::size_t)>& fct );
+
+  //Number of threads to use when the user requested nthreads (0 means one per
+  //hardware thread):
+  unsigned resolveThreadCount( unsigned nthreads );
+
+}
+
+#endif
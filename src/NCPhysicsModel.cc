@@ -1,4 +1,11 @@
 #include "NCPhysicsModel.hh"
+#include "NCCounterRNG.hh"
+#include "NCInstrumentation.hh"
+#include "NCKernelFile.hh"
+#include "NCKernelParser.hh"
+#include "NCModelCache.hh"
+#include "NCMultiPhonon.hh"
+#include "NCPluginOptions.hh"
 
 #include "NCrystal/interfaces/NCProcImpl.hh"
 #include "NCrystal/core/NCException.hh"
@@ -6,12 +13,9 @@
 #include "NCrystal/internal/utils/NCString.hh"
 #include "NCrystal/internal/utils/NCRandUtils.hh"
 #include "NCrystal/internal/vdos/NCVDOSToScatKnl.hh"
-#include "NCrystal/internal/sabscatter/NCSABScatter.hh"
-#include "NCrystal/internal/sab/NCSABFactory.hh"
-#include "NCrystal/internal/sab/NCSABExtender.hh"
-#include "NCrystal/internal/sab/NCSABIntegrator.hh"
-#include "NCrystal/internal/sab/NCSABUtils.hh"
 #include "NCrystal/internal/utils/NCMsg.hh"
+#include <algorithm>
+#include <cmath>
 
 
 bool NCP::PhysicsModel::isApplicable( const NC::Info& info )
@@ -24,154 +28,274 @@ bool NCP::PhysicsModel::isApplicable( const NC::Info& info )
 
 }
 
-NCP::PhysicsModel NCP::PhysicsModel::createFromInfo( const NC::Info& info )
+NCP::PhysicsModel::Options NCP::PhysicsModel::Options::fromEnvironment()
 {
-  return PhysicsModel(info);
+  Options opts;
+  const std::string mode = getOptionStr( "KERNELMODE", "dense" );
+  if ( mode == "sparse" )
+    opts.kernelMode = KernelMode::Sparse;
+  else if ( mode != "dense" )
+    NCRYSTAL_THROW2(BadInput,"Invalid kernel mode \""<<mode<<"\" requested"
+                    " (must be \"dense\" or \"sparse\")");
+  opts.xsTableAccuracy = getOptionDbl( "XSACCURACY", opts.xsTableAccuracy );
+  if ( !( opts.xsTableAccuracy >= 0.0 ) )
+    NCRYSTAL_THROW2(BadInput,"Invalid cross section table accuracy requested: "
+                    <<opts.xsTableAccuracy);
+  const std::string fast = getOptionStr( "FASTSAMPLING", "0" );
+  if ( fast != "0" && fast != "1" )
+    NCRYSTAL_THROW2(BadInput,"Invalid fast sampling flag \""<<fast<<"\" requested"
+                    " (must be \"0\" or \"1\")");
+  opts.fastSampling = ( fast == "1" );
+  const std::string single = getOptionStr( "SINGLEPRECISION", "0" );
+  if ( single != "0" && single != "1" )
+    NCRYSTAL_THROW2(BadInput,"Invalid single precision flag \""<<single<<"\" requested"
+                    " (must be \"0\" or \"1\")");
+  opts.singlePrecision = ( single == "1" );
+  opts.regridTolerance = getOptionDbl( "REGRIDTOLERANCE", opts.regridTolerance );
+  if ( !( opts.regridTolerance >= 0.0 && opts.regridTolerance < 1.0 ) )
+    NCRYSTAL_THROW2(BadInput,"Invalid regridding tolerance requested: "<<opts.regridTolerance
+                    <<" (must be in [0,1))");
+  const std::string lazy = getOptionStr( "LAZYTABLES", "0" );
+  if ( lazy != "0" && lazy != "1" )
+    NCRYSTAL_THROW2(BadInput,"Invalid lazy tables flag \""<<lazy<<"\" requested"
+                    " (must be \"0\" or \"1\")");
+  opts.lazyTables = ( lazy == "1" );
+  if ( opts.lazyTables && !opts.fastSampling )
+    NCPLUGIN_WARN("NCPLUGIN_BZSCOPE_LAZYTABLES=1 has no effect without"
+                  " NCPLUGIN_BZSCOPE_FASTSAMPLING=1");
+  const std::string merge = getOptionStr( "MERGEMULTIPHONON", "0" );
+  if ( merge != "0" && merge != "1" )
+    NCRYSTAL_THROW2(BadInput,"Invalid multi-phonon merging flag \""<<merge<<"\" requested"
+                    " (must be \"0\" or \"1\")");
+  opts.mergeMultiPhonon = ( merge == "1" );
+  opts.fastSamplingMemoryMB = getOptionDbl( "FASTSAMPLINGMB", opts.fastSamplingMemoryMB );
+  if ( !( opts.fastSamplingMemoryMB > 0.0 ) )
+    NCRYSTAL_THROW2(BadInput,"Invalid fast sampling memory budget requested: "
+                    <<opts.fastSamplingMemoryMB<<" MB");
+  opts.gridDensity = getOptionDbl( "GRIDDENSITY", opts.gridDensity );
+  if ( !( opts.gridDensity >= 0.125 && opts.gridDensity <= 64.0 ) )
+    NCRYSTAL_THROW2(BadInput,"Invalid energy grid density requested: "<<opts.gridDensity
+                    <<" (must be in [0.125,64])");
+  opts.memoryBudgetMB = getOptionDbl( "MEMORYMB", opts.memoryBudgetMB );
+  if ( !( opts.memoryBudgetMB >= 0.0 ) )
+    NCRYSTAL_THROW2(BadInput,"Invalid memory budget requested: "<<opts.memoryBudgetMB<<" MB");
+  const double nthreads = getOptionDbl( "NTHREADS", opts.nThreads );
+  if ( !( nthreads >= 0.0 && nthreads <= 4096.0 ) || nthreads != std::floor( nthreads ) )
+    NCRYSTAL_THROW2(BadInput,"Invalid number of threads requested: "<<nthreads);
+  opts.nThreads = static_cast<unsigned>( nthreads );
+  return opts;
 }
 
-NCP::PhysicsModel::PhysicsModel(const NC::Info& info)
-  : m_proc(nullptr)
+NCP::PhysicsModel NCP::PhysicsModel::createFromInfo( const NC::Info& info,
+                                                     const Options& opts )
 {
-  if ( info.countCustomSections( pluginNameUpperCase() ) != 1 )
-    NCRYSTAL_THROW2(BadInput,"Multiple @CUSTOM_"<<pluginNameUpperCase()<<" sections are not allowed");
-  auto raw = info.getCustomSection( pluginNameUpperCase() );
-
-  NC::ScatKnlData phononSab;
-  phononSab.betaGridOptimised = true;
-
+  return PhysicsModel(info,opts);
+}
 
-  phononSab.temperature = NC::Temperature{-1};
-  // AtomMass should not have any impact to the result, as SABNullExtender
-  // is used for the energy range beyond the range of the single phonon sab
-  phononSab.elementMassAMU = NC::AtomMass{0.1};
-  // The incoherent model in NCrystal is going to scale sab by ScatKnlData.SigmaBound.
-  // However the bound scatting lengths are already included in the sab, so it should be unity.
-  phononSab.boundXS = NC::SigmaBound{1};
+NCP::PhysicsModel::PhysicsModel(const NC::Info& info, const Options& opts)
+{
+  PhaseTimer timer( "PhysicsModel construction (total)" );
+  const unsigned nsections = info.countCustomSections( pluginNameUpperCase() );
+  if ( nsections == 0 )
+    NCRYSTAL_THROW2(BadInput,"Missing @CUSTOM_"<<pluginNameUpperCase()<<" section");
+  std::unique_ptr<const MultiPhononTerms> terms;
+  if ( opts.mergeMultiPhonon )
+    terms = std::make_unique<const MultiPhononTerms>( info, opts.vdosLux );//expanded only when needed
+  //Kernel files are found relative to the NCMAT file referencing them:
+  bool anyKernelFile = false;
+  for ( unsigned i = 0; i < nsections; ++i )
+    anyKernelFile = anyKernelFile
+      || !KernelFile::referencedName( info.getCustomSection( pluginNameUpperCase(), i ) ).empty();
+  const std::string materialDir = ( anyKernelFile ? KernelFile::materialDirectory( info ) : std::string() );
+  if ( nsections == 1 ) {
+    const auto& raw = info.getCustomSection( pluginNameUpperCase() );
+    const auto kernelfile = KernelFile::open( raw, materialDir );
+    m_kernelLow = getSharedKernelModel( raw, kernelfile.get(), parseSectionTemperature( raw, kernelfile.get() ),
+                                        opts, terms.get() );
+    return;
+  }
 
+  //Several sections, pick the one(s) needed for the requested temperature:
+  struct Section { double temperature; unsigned idx; std::shared_ptr<const KernelFile> kernelfile; };
+  std::vector<Section> sections;
+  for ( unsigned i = 0; i < nsections; ++i ) {
+    const auto& raw = info.getCustomSection( pluginNameUpperCase(), i );
+    auto kernelfile = KernelFile::open( raw, materialDir );
+    sections.push_back( { parseSectionTemperature( raw, kernelfile.get() ), i, std::move( kernelfile ) } );
+  }
+  std::sort( sections.begin(), sections.end(),
+             []( const Section& a, const Section& b ) { return a.temperature < b.temperature; } );
+  for ( std::size_t i = 1; i < sections.size(); ++i )
+    if ( sections[i].temperature == sections[i-1].temperature )
+      NCRYSTAL_THROW2(BadInput,"Multiple @CUSTOM_"<<pluginNameUpperCase()
+                      <<" sections with temperature "<<sections[i].temperature<<"K");
 
-  NC::VectD *curField(nullptr);
-  double num(0.);
-  for(const auto& line : raw)
+  const double temperature = info.getTemperature().dbl();
+  const double tolerance = 1e-6 * temperature;
+  if ( temperature < sections.front().temperature - tolerance
+       || temperature > sections.back().temperature + tolerance )
+    NCRYSTAL_THROW2(BadInput,"Requested temperature of "<<temperature<<"K is outside the range ["
+                    <<sections.front().temperature<<"K, "<<sections.back().temperature
+                    <<"K] of the @CUSTOM_"<<pluginNameUpperCase()<<" sections");
+  std::size_t ilow = 0;
+  while ( ilow + 1 < sections.size() && sections[ilow+1].temperature <= temperature + tolerance )
+    ++ilow;
+  auto getKernel = [&info,&opts,&terms]( const Section& s )
   {
-    for(const auto& word : line)
-    {
-      if(NC::safe_str2dbl( word, num))
-      {
-        curField->push_back(num);
-      }
-      else
+    return getSharedKernelModel( info.getCustomSection( pluginNameUpperCase(), s.idx ),
+                                 s.kernelfile.get(), s.temperature, opts, terms.get() );
+  };
+  m_kernelLow = getKernel( sections[ilow] );
+  if ( NC::ncabs( sections[ilow].temperature - temperature ) <= tolerance )
+    return;//exact match
+  m_kernelHigh = getKernel( sections[ilow+1] );
+  m_weightHigh = ( temperature - sections[ilow].temperature )
+    / ( sections[ilow+1].temperature - sections[ilow].temperature );
+}
+
+namespace NCPluginNamespace {
+  namespace {
+    //With two kernels, each needs its own cache:
+    struct TwoKernelCache final : public NC::CacheBase {
+      NC::CachePtr low, high;
+      void invalidateCache() override
       {
-        if(word=="alphagrid") {
-          curField = &phononSab.alphaGrid;
-        }
-        else if(word=="betagrid") {
-          curField = &phononSab.betaGrid;
-        }
-        else if(word=="sab_scaled") {
-          curField = &phononSab.sab;
-          phononSab.knltype = NC::ScatKnlData::KnlType::SCALED_SYM_SAB;
-        }
-        else if(word=="sab") {
-          curField = &phononSab.sab;
-          phononSab.knltype = NC::ScatKnlData::KnlType::SAB;
-        }
-        else if(word=="temperature")
-        {
-          double t(0);
-          NC::safe_str2dbl(line[1], t);
-          phononSab.temperature.set(t);
-          NCPLUGIN_MSG("temp " << t);
-          break;
-        }
-        else
-        {
-          auto pos = word.find('r');
-          if(pos==word.npos) {
-            NCRYSTAL_THROW2(BadInput, "field name " << word << " is unknow ");
-          }
-          else
-          {
-            std::string digit = word.substr(0, pos);
-            if(!NC::safe_str2dbl(digit, num))
-              NCRYSTAL_THROW2(BadInput, "can not parse " << digit << " in " << word << " as double");
-
-            std::string times = word.substr(pos+1, word.size()-1);
-            int rep(0);
-            NC::safe_str2int(times, rep);
-            for(unsigned i=0;i<rep;i++)
-            {
-              curField->push_back(num);
-            }
-          }
-        }
+        if ( low )
+          low->invalidateCache();
+        if ( high )
+          high->invalidateCache();
       }
+    };
+    TwoKernelCache& twoKernelCache( NC::CachePtr& cache )
+    {
+      if ( !cache )
+        cache = std::make_unique<TwoKernelCache>();
+      return static_cast<TwoKernelCache&>( *cache );
     }
   }
+}
 
-  // The code for calculating EmaxUpperBound is copied from the NC::validateScatKnlData function in NCScatKnlData.cc
-  const double bmin = phononSab.betaGrid.front();
-  const double amax = phononSab.alphaGrid.back();
-  const double EmaxUpperBound = NC::constant_boltzmann*phononSab.temperature.get()*(bmin-amax)*(bmin-amax)/(4*amax);
-
-  phononSab.suggestedEmax = NC::ncmin(EmaxUpperBound, 100.0);
-
-
-  if(phononSab.alphaGrid.size()*phononSab.betaGrid.size()!=phononSab.sab.size())
-    NCRYSTAL_THROW(BadInput, "data size error");
-
-  NC::SABData sglphdata = NC::SABUtils::transformKernelToStdFormat(std::move(phononSab));
-
-  auto sglphsab = NC::makeSO<NC::SABData>(std::move(sglphdata));
-  auto sglphintegrator = NC::makeSO<NC::SAB::SABIntegrator>(std::move(sglphsab), nullptr, std::move(NC::makeSO<NC::SAB::SABNullExtender>()));
-  auto sglphhelper = NC::makeSO<const NC::SAB::SABScatterHelper>(std::move(sglphintegrator->createScatterHelper()));
-  auto sglphscatter = NC::makeSO<NC::SABScatter>(sglphhelper);
-  NC::ProcImpl::ProcComposition::ComponentList components;
-  components.push_back({1., sglphscatter});
+double NCP::PhysicsModel::calcCrossSection( NC::CachePtr& cache, double neutron_ekin ) const
+{
+  if ( instrumentationEnabled() )
+    addCount( Counter::XSCalls );
+  if ( !m_kernelHigh )
+    return m_kernelLow->crossSection( cache, neutron_ekin );
+  auto& c = twoKernelCache( cache );
+  return ( 1.0 - m_weightHigh ) * m_kernelLow->crossSection( c.low, neutron_ekin )
+    + m_weightHigh * m_kernelHigh->crossSection( c.high, neutron_ekin );
+}
 
-  // if the line "auto sc_std = globalCreateScatter( cfg );"" in the NCPlugin Factory changes to
-  // "auto sc_std = globalCreateScatter( cfg.modified("inelas=0") );", the lines followed show how we can create all the elastic
-  // scattering processes from scratch. This method is potentially useful but may not be friendly for the final integration into the main repo.
-  // for ( auto& di : info.getDynamicInfoList() )
-  // {
-  //   auto di_vdos = dynamic_cast<const NC::DI_VDOS*>(di.get());
-  //   if (di_vdos)
-  //   {
-  //     double incohxs = di_vdos->atomData().incoherentXS().dbl();
-  //     double scatteringxs = di_vdos->atomData().scatteringXS().dbl();
-  //     double factor = incohxs/scatteringxs;
+NCP::PhysicsModel::ScatEvent NCP::PhysicsModel::sampleScatteringEvent( NC::CachePtr& cache,
+                                                                       NC::RNG& rng,
+                                                                       double neutron_ekin ) const
+{
+  if ( instrumentationEnabled() )
+    addCount( Counter::SampleCalls );
+  if ( !m_kernelHigh )
+    return m_kernelLow->sampleScatteringEvent( cache, rng, neutron_ekin );
+  auto& c = twoKernelCache( cache );
+  const double xslow = ( 1.0 - m_weightHigh ) * m_kernelLow->crossSection( c.low, neutron_ekin );
+  const double xshigh = m_weightHigh * m_kernelHigh->crossSection( c.high, neutron_ekin );
+  if ( rng.generate() * ( xslow + xshigh ) < xshigh )
+    return m_kernelHigh->sampleScatteringEvent( c.high, rng, neutron_ekin );
+  return m_kernelLow->sampleScatteringEvent( c.low, rng, neutron_ekin );
+}
 
-  //     NC::ScatKnlData skd = NC::createScatteringKernel(di_vdos->vdosData(), 3,  0, NC::VDOSGn::TruncAndThinningChoices::Default,
-  //                                 [factor](unsigned n) {
-  //                                   if(n>1) return 1.;
-  //                                   else return factor; } );
+void NCP::PhysicsModel::calcCrossSections( NC::CachePtr& cache, const double * neutron_ekin,
+                                           std::size_t n, double * out_xs ) const
+{
+  if ( instrumentationEnabled() )
+    addCount( Counter::XSCalls, n );
+  if ( !m_kernelHigh ) {
+    m_kernelLow->crossSections( cache, neutron_ekin, n, out_xs );
+    return;
+  }
+  auto& c = twoKernelCache( cache );
+  m_kernelLow->crossSections( c.low, neutron_ekin, n, out_xs );
+  constexpr std::size_t chunksize = 256;
+  double xshigh[chunksize];
+  for ( std::size_t i0 = 0; i0 < n; i0 += chunksize ) {
+    const std::size_t nchunk = NC::ncmin( chunksize, n - i0 );
+    m_kernelHigh->crossSections( c.high, neutron_ekin + i0, nchunk, xshigh );
+    for ( std::size_t i = 0; i < nchunk; ++i )
+      out_xs[i0+i] = ( 1.0 - m_weightHigh ) * out_xs[i0+i] + m_weightHigh * xshigh[i];
+  }
+}
 
-  //     NC::SABData sabdata = NC::SABUtils::transformKernelToStdFormat(std::move(skd));
-  //     components.push_back({di->fraction(), NC::makeSO<NC::SABScatter>(std::move(sabdata))});
+void NCP::PhysicsModel::sampleScatteringEvents( NC::CachePtr& cache, NC::RNG& rng,
+                                                const double * neutron_ekin,
+                                                std::size_t n, ScatEvent * out ) const
+{
+  //Sampling involves rejection loops of varying length, so there is nothing
+  //to gain from interleaving the neutrons. Simply avoid the per-call overhead:
+  if ( !m_kernelHigh ) {
+    if ( instrumentationEnabled() )
+      addCount( Counter::SampleCalls, n );
+    for ( std::size_t i = 0; i < n; ++i )
+      out[i] = m_kernelLow->sampleScatteringEvent( cache, rng, neutron_ekin[i] );
+    return;
+  }
+  for ( std::size_t i = 0; i < n; ++i )
+    out[i] = sampleScatteringEvent( cache, rng, neutron_ekin[i] );
+}
 
-  //   }
-  //   else
-  //     NCRYSTAL_THROW(CalcError, "Not implemented error");
-  // }
+NCP::PhysicsModel::ScatEvent NCP::PhysicsModel::sampleScatteringEvent( NC::CachePtr& cache,
+                                                                       std::uint64_t seed,
+                                                                       std::uint64_t event_id,
+                                                                       double neutron_ekin ) const
+{
+  PhiloxRNG rng( seed, event_id );
+  return sampleScatteringEvent( cache, rng, neutron_ekin );
+}
 
-  NC::ProcImpl::ProcPtr procptr = NC::ProcImpl::ProcComposition::consumeAndCombine( std::move(components), NC::ProcessType::Scatter );
+void NCP::PhysicsModel::sampleScatteringEvents( NC::CachePtr& cache, std::uint64_t seed,
+                                                std::uint64_t first_event_id,
+                                                const double * neutron_ekin,
+                                                std::size_t n, ScatEvent * out ) const
+{
+  if ( !m_kernelHigh ) {
+    if ( instrumentationEnabled() )
+      addCount( Counter::SampleCalls, n );
+    for ( std::size_t i = 0; i < n; ++i ) {
+      PhiloxRNG rng( seed, first_event_id + i );
+      out[i] = m_kernelLow->sampleScatteringEvent( cache, rng, neutron_ekin[i] );
+    }
+    return;
+  }
+  for ( std::size_t i = 0; i < n; ++i )
+    out[i] = sampleScatteringEvent( cache, seed, first_event_id + i, neutron_ekin[i] );
+}
 
-  auto rngproducer = NC::getDefaultRNGProducer();
-  auto rng = rngproducer->produce();
+double NCP::PhysicsModel::calcCrossSection( double neutron_ekin ) const
+{
+  NC::CachePtr cache;
+  return calcCrossSection( cache, neutron_ekin );
+}
 
-  m_proc = std::make_shared<NC::Scatter>( std::move(rngproducer), std::move(rng), std::move(procptr));
+NCP::PhysicsModel::ScatEvent NCP::PhysicsModel::sampleScatteringEvent( NC::RNG& rng, double neutron_ekin ) const
+{
+  NC::CachePtr cache;
+  return sampleScatteringEvent( cache, rng, neutron_ekin );
+}
 
+std::size_t NCP::PhysicsModel::memoryUsage() const
+{
+  return m_kernelLow->memoryUsage() + ( m_kernelHigh ? m_kernelHigh->memoryUsage() : 0 );
 }
 
-double NCP::PhysicsModel::calcCrossSection( double neutron_ekin ) const
+double NCP::PhysicsModel::separateMultiPhononFraction( double neutron_ekin ) const
 {
-  return m_proc->crossSectionIsotropic(NC::NeutronEnergy{neutron_ekin}).dbl();
+  double res = ( m_kernelLow->lacksTermsAt( neutron_ekin ) ? 1.0 - m_weightHigh : 0.0 );
+  if ( m_kernelHigh && m_kernelHigh->lacksTermsAt( neutron_ekin ) )
+    res += m_weightHigh;
+  return res;
 }
 
-NCP::PhysicsModel::ScatEvent NCP::PhysicsModel::sampleScatteringEvent( NC::RNG& rng, double neutron_ekin ) const
+std::vector<std::shared_ptr<const NCP::KernelModel>> NCP::PhysicsModel::kernelModels() const
 {
-  ScatEvent result;
-  auto res = m_proc->sampleScatterIsotropic(NC::NeutronEnergy{neutron_ekin});
-  result.ekin_final = res.ekin.dbl();
-  result.mu = res.mu.dbl();
-  return result;
+  std::vector<std::shared_ptr<const KernelModel>> res{ m_kernelLow };
+  if ( m_kernelHigh )
+    res.push_back( m_kernelHigh );
+  return res;
 }
@@ -7,6 +7,8 @@
 
 namespace NCPluginNamespace {
 
+  class KernelModel;
+
   //We implement the actual physics model in this completely custom C++ helper
   //class. That decouples it from NCrystal interfaces (which is nice in case the
   //NCrystal API changes at some point), and it makes it easy to directly
@@ -14,31 +16,168 @@ namespace NCPluginNamespace {
   //
   //We mark the class as MoveOnly, to make sure it doesn't get copied around by
   //accident (since it could easily end up having large data members).
+  //
+  //The model is immutable after construction, so all const methods can be used
+  //concurrently from multiple threads. Any per-thread state lives in the
+  //NC::CachePtr objects and random streams passed in by the caller (one of
+  //each per thread).
+  //
+  //Input files can contain several @CUSTOM_BZSCOPE sections, each for a
+  //different temperature. Only the kernels needed for the temperature of the
+  //NC::Info object are built (and shared with other PhysicsModel instances, see
+  //NCModelCache.hh). For temperatures between those of two sections, cross
+  //sections are interpolated linearly in temperature, and scattering events
+  //are sampled from either of the two kernels in proportion to their
+  //contribution to the interpolated cross section. Temperatures outside the
+  //range of the sections are not supported (unless the file only contains a
+  //single section, which is then used for all temperatures).
 
   class PhysicsModel final : public NC::MoveOnly {
   public:
 
+    //Options controlling how the model is built. The defaults are taken from
+    //environment variables (see NCPluginOptions.hh), e.g.
+    //NCPLUGIN_BZSCOPE_KERNELMODE=sparse:
+    struct Options {
+      //Dense: kernel integrated and sampled via NCrystal's SAB classes.
+      //Sparse: only non-zero spans of the kernel are kept, and integrated and
+      //        sampled directly by the plugin (see NCKernelScatter.hh).
+      enum class KernelMode { Dense, Sparse };
+      KernelMode kernelMode = KernelMode::Dense;
+
+      //Target relative accuracy of the cross section table used in dense mode
+      //(see NCXSTable.hh) for neutron energies up to the suggested Emax of the
+      //kernel. A value of 0 disables the table, so all cross sections are
+      //computed by the SAB classes of NCrystal. In sparse mode, the energy grid
+      //of the tables is refined to the same accuracy (and kept at the density
+      //of gridDensity below if 0):
+      double xsTableAccuracy = 1e-3;
+
+      //Sample scattering events with the table-based sampler of
+      //NCFastSampler.hh (in either kernel mode), with the tables limited to the
+      //given memory budget. The sampled distributions are the same, only
+      //faster to sample at the cost of the memory of the tables:
+      bool fastSampling = false;
+      double fastSamplingMemoryMB = 64.0;
+
+      //Density of the energy grids, relative to the default. This applies to
+      //the initial grid of the sparse mode tables (40 points per decade by
+      //default, before any refinement for xsTableAccuracy) and to the energy
+      //grid of NCrystal's SAB integration in dense mode (which gets the same
+      //number of points as that initial grid, when not 1):
+      double gridDensity = 1.0;
+
+      //If non-zero, the budget in MB for the memory reported by memoryUsage(),
+      //excluding any fast sampling tables (which have their own budget above).
+      //In sparse mode, the energy grid density is then reduced as needed to
+      //fit the kernel and tables, and in dense mode the cross section table
+      //is not refined beyond the budget (at the cost of its accuracy).
+      //Whenever gridDensity or memoryBudgetMB are not the defaults, the
+      //resulting grid sizes, memory usage and accuracy of the tables are
+      //reported with NCPLUGIN_MSG:
+      double memoryBudgetMB = 0.0;
+
+      //Store the sparse kernel and all tables derived from it (including the
+      //fast sampling tables) in single precision, roughly halving their
+      //memory. All arithmetic is still done in double precision. In dense
+      //mode, this only affects the fast sampling tables:
+      bool singlePrecision = false;
+
+      //If non-zero, the alpha and beta grids of the kernel are thinned when it
+      //is loaded, keeping the integral and first moment of each beta column
+      //within this relative tolerance (see NCKernelRegrid.hh). The reduction
+      //achieved is reported with NCPLUGIN_MSG:
+      double regridTolerance = 0.0;
+
+      //Build the fast sampling tables of each energy grid point and kernel
+      //column only when first needed (see NCLazyRows.hh), rather than all of
+      //them up front. Runs using a narrow band of energies then only build and
+      //keep the tables of that band. Only affects the fastSampling mode (the
+      //other tables are the cumulative integrals giving the cross sections,
+      //which are always tabulated in full), and lazy tables are not shared
+      //between processes through SharedTables:
+      bool lazyTables = false;
+
+      //Number of threads used to build the tables of the plugin (0 means one
+      //per hardware thread). The results do not depend on this number. In
+      //dense mode, the SAB integration by NCrystal (the bulk of the build) is
+      //always serial, and only the tables of the plugin are built in parallel:
+      unsigned nThreads = 1;
+
+      //Add the contributions derived from the vdos @DYNINFO sections (except
+      //those left out through @CUSTOM_UNOFFICIALHACKS, usually the coherent
+      //one-phonon part) to the kernel itself, rather than leaving them to
+      //separate NCrystal processes (see NCMultiPhonon.hh).
+      //The vdosLux is the luxury level of their VDOS expansion (set from the
+      //vdoslux cfg parameter by the factory):
+      bool mergeMultiPhonon = false;
+      unsigned vdosLux = 3;
+
+      static Options fromEnvironment();
+    };
+
     //A few static helper functions which can extract relevant data from NCInfo
     //objects (the createFromInfo function will raise BadInput exceptions in
     //case of syntax errors in the @CUSTOM_ section data):
 
     static bool isApplicable( const NC::Info& );
-    static PhysicsModel createFromInfo( const NC::Info& );//will raise BadInput
-                                                          //in case of syntax
-                                                          //errors
+    static PhysicsModel createFromInfo( const NC::Info&,
+                                        const Options& = Options::fromEnvironment() );
 
-    PhysicsModel( const NC::Info& );
+    PhysicsModel( const NC::Info&, const Options& = Options::fromEnvironment() );
 
     //Provide cross sections for a given neutron:
-    double calcCrossSection( double neutron_ekin ) const;
+    double calcCrossSection( NC::CachePtr&, double neutron_ekin ) const;
 
     //Sample scattering event (rng is random number stream). Results are given
     //as the final ekin of the neutron and scat_mu which is cos(scattering_angle).
     struct ScatEvent { double ekin_final, mu; };
+    ScatEvent sampleScatteringEvent( NC::CachePtr&, NC::RNG& rng, double neutron_ekin ) const;
+
+    //Batch versions of the above, for n neutrons with energies in
+    //neutron_ekin[0..n-1] and results written to out[0..n-1]:
+    void calcCrossSections( NC::CachePtr&, const double * neutron_ekin,
+                            std::size_t n, double * out_xs ) const;
+    void sampleScatteringEvents( NC::CachePtr&, NC::RNG& rng, const double * neutron_ekin,
+                                 std::size_t n, ScatEvent * out ) const;
+
+    //Reproducible versions of the above, with the random numbers of each event
+    //taken from its own counter-based stream (see NCCounterRNG.hh), identified
+    //by the seed and an event ID chosen by the caller. Each event then only
+    //depends on the seed, its ID and its energy, so results are bitwise
+    //identical whatever the number of threads and the order of the calls. In
+    //the batch version, event i gets the ID first_event_id+i:
+    ScatEvent sampleScatteringEvent( NC::CachePtr&, std::uint64_t seed, std::uint64_t event_id,
+                                     double neutron_ekin ) const;
+    void sampleScatteringEvents( NC::CachePtr&, std::uint64_t seed, std::uint64_t first_event_id,
+                                 const double * neutron_ekin, std::size_t n, ScatEvent * out ) const;
+
+    //Convenience versions using a temporary cache (slower in dense mode, where
+    //the cache keeps the sampling setup of the last neutron energy):
+    double calcCrossSection( double neutron_ekin ) const;
     ScatEvent sampleScatteringEvent( NC::RNG& rng, double neutron_ekin ) const;
 
+    //Memory used by the kernel and derived tables (in dense mode, the kernel
+    //and tables held by NCrystal's SAB classes are not included, and neither
+    //are tables shared between processes, see NCSharedTables.hh):
+    std::size_t memoryUsage() const;
+
+    //With the mergeMultiPhonon option, the fraction of the multi-phonon
+    //contributions missing from the model at the given energy (from the
+    //kernels used above their Emax, see KernelModel::lacksTermsAt), which must
+    //then be provided by the separate processes of NCrystal (always 0 without
+    //the option):
+    double separateMultiPhononFraction( double neutron_ekin ) const;
+
+    //The kernel models in use (one or two):
+    std::vector<std::shared_ptr<const KernelModel>> kernelModels() const;
+
   private:
-    std::shared_ptr<NC::Scatter> m_proc;
+    //With two kernels, results are interpolated with weight m_weightHigh for
+    //m_kernelHigh:
+    std::shared_ptr<const KernelModel> m_kernelLow;
+    std::shared_ptr<const KernelModel> m_kernelHigh;
+    double m_weightHigh = 0.0;
   };
 
 }
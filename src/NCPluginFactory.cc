@@ -17,26 +17,80 @@ namespace NCPluginNamespace {
     PluginScatter( PhysicsModel && pm ) : m_pm(std::move(pm)) {}
 
     NC::CrossSect
-    crossSectionIsotropic( NC::CachePtr&,
+    crossSectionIsotropic( NC::CachePtr& cache,
                            NC::NeutronEnergy ekin ) const override
     {
-      return NC::CrossSect{ m_pm.calcCrossSection(ekin.dbl()) };
+      return NC::CrossSect{ m_pm.calcCrossSection( cache, ekin.dbl() ) };
+    }
+
+    void evalManyXSIsotropic( NC::CachePtr& cache,
+                              const double* ekin, std::size_t n,
+                              double* out_xs ) const override
+    {
+      m_pm.calcCrossSections( cache, ekin, n, out_xs );
     }
 
     NC::ScatterOutcomeIsotropic
-    sampleScatterIsotropic( NC::CachePtr&,
+    sampleScatterIsotropic( NC::CachePtr& cache,
                             NC::RNG& rng,
                             NC::NeutronEnergy ekin ) const override
     {
-      auto outcome = m_pm.sampleScatteringEvent( rng, ekin.dbl() );
+      auto outcome = m_pm.sampleScatteringEvent( cache, rng, ekin.dbl() );
       return { NC::NeutronEnergy{outcome.ekin_final},
                NC::CosineScatAngle{outcome.mu} };
     }
 
+    const PhysicsModel& model() const { return m_pm; }
+
   private:
     PhysicsModel m_pm;
   };
 
+  class SeparateTermsScatter final : public NC::ProcImpl::ScatterIsotropicMat {
+  public:
+
+    //With merged multi-phonon terms, the standard NCrystal processes for them
+    //are still needed where the model lacks them (above the Emax of its
+    //kernels), so they are kept, scaled by the fraction missing from the model.
+    //Below Emax, the processes are not even consulted.
+
+    const char * name() const noexcept override
+    {
+      return NCPLUGIN_NAME_CSTR "SeparateTerms";
+    }
+
+    SeparateTermsScatter( NC::ProcImpl::ProcPtr terms, NC::shared_obj<const PluginScatter> model )
+      : m_terms( std::move(terms) ),
+        m_termsScatter( dynamic_cast<const NC::ProcImpl::Scatter*>( &*m_terms ) ),
+        m_model( std::move(model) )
+    {
+      nc_assert_always( m_termsScatter != nullptr );
+    }
+
+    NC::CrossSect
+    crossSectionIsotropic( NC::CachePtr& cache,
+                           NC::NeutronEnergy ekin ) const override
+    {
+      const double fraction = m_model->model().separateMultiPhononFraction( ekin.dbl() );
+      if ( !( fraction > 0.0 ) )
+        return NC::CrossSect{ 0.0 };
+      return NC::CrossSect{ fraction * m_termsScatter->crossSectionIsotropic( cache, ekin ).dbl() };
+    }
+
+    NC::ScatterOutcomeIsotropic
+    sampleScatterIsotropic( NC::CachePtr& cache,
+                            NC::RNG& rng,
+                            NC::NeutronEnergy ekin ) const override
+    {
+      return m_termsScatter->sampleScatterIsotropic( cache, rng, ekin );
+    }
+
+  private:
+    NC::ProcImpl::ProcPtr m_terms;
+    const NC::ProcImpl::Scatter * m_termsScatter;
+    NC::shared_obj<const PluginScatter> m_model;
+  };
+
 }
 
 const char * NCP::PluginFactory::name() const noexcept
@@ -76,8 +130,22 @@ NCP::PluginFactory::query( const NC::FactImpl::ScatterRequest& cfg ) const
 NC::ProcImpl::ProcPtr
 NCP::PluginFactory::produce( const NC::FactImpl::ScatterRequest& cfg ) const
 {
-  auto sc_ourmodel = NC::makeSO<PluginScatter>( PhysicsModel::createFromInfo( cfg.info() ) );
-  auto sc_std = globalCreateScatter( cfg );
+  auto opts = PhysicsModel::Options::fromEnvironment();
+  if ( !opts.mergeMultiPhonon ) {
+    auto sc_ourmodel = NC::makeSO<PluginScatter>( PhysicsModel::createFromInfo( cfg.info(), opts ) );
+    auto sc_std = globalCreateScatter( cfg );
+    //Combine and return:
+    return combineProcs( sc_std, sc_ourmodel );
+  }
+
+  //The remaining inelastic contributions are part of our model, so the
+  //standard factory must only provide the elastic processes, and the inelastic
+  //ones where our model lacks them:
+  opts.vdosLux = static_cast<unsigned>( cfg.get_vdoslux() );
+  auto sc_ourmodel = NC::makeSO<const PluginScatter>( PhysicsModel::createFromInfo( cfg.info(), opts ) );
+  auto sc_terms = NC::makeSO<SeparateTermsScatter>( globalCreateScatter( cfg.modified("coh_elas=0;incoh_elas=0") ),
+                                                    sc_ourmodel );
+  auto sc_std = globalCreateScatter( cfg.modified("inelas=0") );
   //Combine and return:
-  return combineProcs( sc_std, sc_ourmodel );
+  return combineProcs( combineProcs( sc_std, sc_terms ), sc_ourmodel );
 }
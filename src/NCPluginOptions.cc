@@ -0,0 +1,25 @@
+#include "NCPluginOptions.hh"
+#include "NCrystal/internal/utils/NCString.hh"
+#include <cstdlib>
+
+std::string NCP::getOptionStr( const char * name, const char * defval )
+{
+  std::string envname("NCPLUGIN_");
+  envname += pluginNameUpperCase();
+  envname += '_';
+  envname += name;
+  const char * val = std::getenv( envname.c_str() );
+  return ( val && *val ) ? std::string(val) : std::string(defval);
+}
+
+double NCP::getOptionDbl( const char * name, double defval )
+{
+  const std::string val = getOptionStr( name );
+  if ( val.empty() )
+    return defval;
+  double res;
+  if ( !NC::safe_str2dbl( val, res ) )
+    NCRYSTAL_THROW2(BadInput,"Invalid value \""<<val<<"\" for option NCPLUGIN_"
+                    <<pluginNameUpperCase()<<"_"<<name<<" (expected a number)");
+  return res;
+}
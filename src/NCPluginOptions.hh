@@ -0,0 +1,22 @@
+#ifndef NCPlugin_PluginOptions_hh
+#define NCPlugin_PluginOptions_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+
+namespace NCPluginNamespace {
+
+  //Run-time options of the plugin are controlled through environment variables
+  //named NCPLUGIN_<PLUGINNAME>_<OPTION>, e.g. NCPLUGIN_BZSCOPE_CACHEDIR. The
+  //name passed here is just the <OPTION> part. Unset and empty variables both
+  //result in the default value being returned.
+
+  std::string getOptionStr( const char * name, const char * defval = "" );
+
+  //Numerical options (raises BadInput for values which can not be parsed):
+  double getOptionDbl( const char * name, double defval );
+
+}
+
+#endif
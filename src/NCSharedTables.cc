@@ -0,0 +1,262 @@
+#include "NCSharedTables.hh"
+#include "NCFastSampler.hh"
+#include "NCHash.hh"
+#include "NCInstrumentation.hh"
+#include "NCPluginOptions.hh"
+#include "NCrystal/internal/utils/NCMsg.hh"
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/file.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+namespace NCPluginNamespace {
+  namespace {
+
+    //Bump whenever the layout of the files (or of the tables in them) changes:
+    constexpr std::uint32_t tablesFormatVersion = 3;
+    constexpr char tablesMagic[8] = { 'N','C','B','Z','S','S','T','\0' };
+    constexpr std::uint32_t endianMarker = 0x01020304;
+
+    struct Header {
+      char magic[8];
+      std::uint32_t version;
+      std::uint32_t endian;
+      std::uint64_t key;
+      std::uint64_t payloadSize;
+      std::uint64_t checksum;
+    };
+
+    inline std::size_t padded( std::size_t n )
+    {
+      return ( n + 7 ) & ~std::size_t(7);
+    }
+
+#ifndef _WIN32
+    class Mapping final : public NC::MoveOnly {
+    public:
+      Mapping( void * addr, std::size_t size ) : m_addr(addr), m_size(size) {}
+      ~Mapping() { ::munmap( m_addr, m_size ); }
+      const char * data() const { return static_cast<const char*>( m_addr ); }
+    private:
+      void * m_addr;
+      std::size_t m_size;
+    };
+
+    //Exclusive lock on a file, held until destruction (or until the process
+    //dies). Without a lock (e.g. on file systems not supporting it), several
+    //processes might end up building the same entry, which is harmless:
+    class FileLock final : public NC::MoveOnly {
+    public:
+      FileLock( const std::string& path )
+        : m_fd( ::open( path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666 ) )
+      {
+        if ( m_fd >= 0 && ::flock( m_fd, LOCK_EX ) != 0 ) {
+          ::close( m_fd );
+          m_fd = -1;
+        }
+      }
+      ~FileLock()
+      {
+        if ( m_fd >= 0 )
+          ::close( m_fd );//also releases the lock
+      }
+    private:
+      int m_fd;
+    };
+#endif
+
+  }
+}
+
+void NCP::TableWriter::putRaw( const void * data, std::size_t n )
+{
+  auto p = static_cast<const char*>(data);
+  m_buf.insert( m_buf.end(), p, p + n );
+  m_buf.resize( padded( m_buf.size() ), 0 );
+}
+
+void NCP::TableWriter::putTable( const ValueTable& table )
+{
+  put<std::uint32_t>( table.singlePrecision() ? 1 : 0 );
+  table.visit( [&]( auto values ) { putArray( values, table.size() ); } );
+}
+
+const char * NCP::TableReader::getRaw( std::size_t n )
+{
+  if ( std::size_t( m_end - m_it ) < padded( n ) )
+    NCRYSTAL_THROW(DataLoadError,"Shared tables: unexpected end of data");
+  const char * res = m_it;
+  m_it += padded( n );
+  return res;
+}
+
+std::size_t NCP::TableReader::getArraySize( std::size_t elemsize )
+{
+  const auto n = get<std::uint64_t>();
+  if ( n > std::uint64_t( m_end - m_it ) / elemsize )
+    NCRYSTAL_THROW(DataLoadError,"Shared tables: invalid array size");
+  return static_cast<std::size_t>( n );
+}
+
+NCP::ValueTable NCP::TableReader::getTable()
+{
+  if ( get<std::uint32_t>() )
+    return ValueTable( getArray<float>() );
+  return ValueTable( getArray<double>() );
+}
+
+NCP::SharedTables::SharedTables( std::uint64_t kernel_key, const NC::VectD& parameters )
+  : m_key(fnvOffset)
+{
+  m_key = fnv1a( m_key, &kernel_key, sizeof(kernel_key) );
+  m_key = fnv1a( m_key, &tablesFormatVersion, sizeof(tablesFormatVersion) );
+  m_key = fnv1a( m_key, parameters.data(), parameters.size() * sizeof(double) );
+
+  std::string dir = getOptionStr("SHAREDDIR");
+  if ( dir.empty() )
+    return;
+#ifdef _WIN32
+  //Needs POSIX file locks and memory mappings:
+  NCPLUGIN_WARN("Ignoring NCPLUGIN_BZSCOPE_SHAREDDIR, which is not supported on Windows");
+  return;
+#endif
+  if ( dir.back() != '/' )
+    dir += '/';
+  char keystr[17];
+  std::snprintf( keystr, sizeof(keystr), "%016llx",
+                 static_cast<unsigned long long>(m_key) );
+  m_path = dir + pluginName() + "_" + keystr + ".bzst";
+}
+
+NCP::SharedTables::Tables
+NCP::SharedTables::getOrBuild( const std::function<Tables()>& build ) const
+{
+  if ( !enabled() )
+    return build();
+#ifdef _WIN32
+  return build();//not enabled
+#else
+  FileLock lock( m_path + ".lock" );
+  Tables tables;
+  if ( load( tables, false ) )
+    return tables;
+  tables = build();
+  store( tables );
+  //Use the published entry in this process as well, so the built tables can
+  //be released. This is the only time its checksum is verified:
+  Tables mapped;
+  if ( load( mapped, true ) )
+    return mapped;
+  std::remove( m_path.c_str() );
+  return tables;
+#endif
+}
+
+bool NCP::SharedTables::load( Tables& out, bool verify_checksum ) const
+{
+#ifdef _WIN32
+  (void)out;
+  (void)verify_checksum;
+  return false;
+#else
+  PhaseTimer timer( "map shared tables" );
+  const int fd = ::open( m_path.c_str(), O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 )
+    return false;
+  struct stat st;
+  if ( ::fstat( fd, &st ) != 0 || std::size_t( st.st_size ) < sizeof(Header) ) {
+    ::close( fd );
+    return false;
+  }
+  const std::size_t fsize = static_cast<std::size_t>( st.st_size );
+  void * addr = ::mmap( nullptr, fsize, PROT_READ, MAP_SHARED, fd, 0 );
+  ::close( fd );//the mapping stays valid
+  if ( addr == MAP_FAILED )
+    return false;
+  auto mapping = std::make_shared<const Mapping>( addr, fsize );
+
+  Header h;
+  std::memcpy( &h, mapping->data(), sizeof(h) );
+  const char * payload = mapping->data() + sizeof(h);
+  const std::size_t npayload = fsize - sizeof(h);
+  if ( std::memcmp( h.magic, tablesMagic, sizeof(h.magic) ) != 0
+       || h.version != tablesFormatVersion || h.endian != endianMarker
+       || h.key != m_key || h.payloadSize != npayload || npayload % 8 != 0
+       || ( verify_checksum && h.checksum != fnv1aWords( payload, npayload ) ) ) {
+    NCPLUGIN_WARN("Ignoring invalid shared tables file "<<m_path);
+    return false;
+  }
+
+  try {
+    TableReader r( payload, npayload, mapping );
+    auto kernel = NC::makeSO<const SparseKernel>( r );
+    auto scatter = std::make_shared<const KernelScatter>( std::move(kernel), r );
+    Tables res;
+    if ( r.get<std::uint32_t>() )
+      res.fast = std::make_shared<const FastSampler>( scatter, r );
+    res.sectionXSAtEmax = r.get<double>();
+    if ( !r.atEnd() )
+      NCRYSTAL_THROW(DataLoadError,"Shared tables: unexpected data at end");
+    res.scatter = std::move(scatter);
+    out = std::move(res);
+  } catch ( NC::Error::DataLoadError& e ) {
+    NCPLUGIN_WARN("Ignoring invalid shared tables file "<<m_path<<" ("<<e.what()<<")");
+    return false;
+  }
+  return true;
+#endif
+}
+
+void NCP::SharedTables::store( const Tables& tables ) const
+{
+#ifdef _WIN32
+  (void)tables;
+#else
+  PhaseTimer timer( "publish shared tables" );
+  const KernelScatter& scatter = ( tables.scatter ? *tables.scatter : tables.fast->scatter() );
+  TableWriter w;
+  scatter.kernel().writeTables( w );
+  scatter.writeTables( w );
+  w.put<std::uint32_t>( tables.fast ? 1 : 0 );
+  if ( tables.fast )
+    tables.fast->writeTables( w );
+  w.put( tables.sectionXSAtEmax );
+  const auto& buf = w.buffer();
+
+  Header h;
+  std::memcpy( h.magic, tablesMagic, sizeof(h.magic) );
+  h.version = tablesFormatVersion;
+  h.endian = endianMarker;
+  h.key = m_key;
+  h.payloadSize = buf.size();
+  h.checksum = fnv1aWords( buf.data(), buf.size() );
+
+  //Write to a unique temporary file and rename it into place, so other
+  //processes never see partially written entries (and published files are
+  //never modified, which would break the mappings of other processes):
+  static std::atomic<unsigned> counter{ 0 };
+  const std::string tmppath = m_path + ".tmp" + std::to_string( ::getpid() )
+    + "_" + std::to_string( counter++ );
+  {
+    std::ofstream fh( tmppath, std::ios::binary | std::ios::trunc );
+    fh.write( reinterpret_cast<const char*>(&h), sizeof(h) );
+    fh.write( buf.data(), buf.size() );
+    if ( !fh.good() ) {
+      fh.close();
+      std::remove( tmppath.c_str() );
+      NCPLUGIN_WARN("Could not write shared tables file "<<tmppath);
+      return;
+    }
+  }
+  if ( std::rename( tmppath.c_str(), m_path.c_str() ) != 0 ) {
+    std::remove( tmppath.c_str() );
+    NCPLUGIN_WARN("Could not create shared tables file "<<m_path);
+  }
+#endif
+}
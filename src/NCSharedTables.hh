@@ -0,0 +1,131 @@
+#ifndef NCPlugin_SharedTables_hh
+#define NCPlugin_SharedTables_hh
+
+#include "NCValueTable.hh"
+#include <cstring>
+#include <functional>
+
+namespace NCPluginNamespace {
+
+  class FastSampler;
+  class KernelScatter;
+
+  //Sharing of the tables built in sparse mode (the SparseKernel, the
+  //KernelScatter tables and the optional FastSampler tables) between processes
+  //on the same node. This is only active when the NCPLUGIN_BZSCOPE_SHAREDDIR
+  //environment variable is set to a writable directory (and never on Windows,
+  //where the variable is ignored with a warning). Using a directory
+  //under /dev/shm keeps the tables in POSIX shared memory rather than in files
+  //on disk.
+  //
+  //The first process needing a given set of tables builds them and publishes
+  //them as a file in that directory. Other processes (and the first one as
+  //well) then map the file read-only into memory, and the large tables are used
+  //directly from the mapping, so the operating system keeps a single copy of
+  //them per node. While an entry is being built, an exclusive lock on a
+  //separate lock file makes other processes wait for it rather than building
+  //their own copy (the lock is released by the operating system if the
+  //process dies).
+  //
+  //Entries are keyed by a hash of the kernel (see KernelCache), of all
+  //parameters affecting the tables and of the file format version (so
+  //entries written by other versions of the plugin are never picked up, and
+  //the version is checked in the header as well). Files are written under a
+  //temporary name and renamed into place, and are never modified afterwards,
+  //so processes never see partial entries, and entries can be deleted at any
+  //time (processes having them mapped keep using them). The checksum of the
+  //payload is only verified by the publishing process, after writing the file
+  //(a file failing the check is removed again), so the large tables are not
+  //read in full when other processes map them. Entries with a bad header or
+  //size are ignored and replaced. Any failure to use the
+  //directory only results in a warning, with the tables then built by each
+  //process in the usual way. Memory in mapped tables is not included in the
+  //memoryUsage() of the classes using them.
+
+  class SharedTables final : public NC::MoveOnly {
+  public:
+
+    //The parameters are the options (and other values) from which the tables
+    //are built, in addition to the kernel:
+    SharedTables( std::uint64_t kernel_key, const NC::VectD& parameters );
+
+    bool enabled() const { return !m_path.empty(); }
+    const std::string& path() const { return m_path; }
+
+    //Tables either built by the given function, or (when enabled) mapped from
+    //the shared entry, which is first published if it does not exist. The
+    //scatter is needed in sparse mode only, and can be left out of the result
+    //of the function in dense mode (the fast sampler refers to its own):
+    struct Tables {
+      std::shared_ptr<const KernelScatter> scatter;
+      std::shared_ptr<const FastSampler> fast;
+      double sectionXSAtEmax = 0.0;//with multi-phonon terms (see KernelModel)
+    };
+    Tables getOrBuild( const std::function<Tables()>& build ) const;
+
+  private:
+    std::string m_path;
+    std::uint64_t m_key;
+    bool load( Tables&, bool verify_checksum ) const;
+    void store( const Tables& ) const;
+  };
+
+  //Serialisation of the tables, used by the classes owning them. All entries
+  //are padded to multiples of 8 bytes, so arrays in mapped files are suitably
+  //aligned for all types stored. Arrays read with getArray() refer directly to
+  //the mapped file, while getVector() copies them (for small arrays). Reading
+  //beyond the data raises DataLoadError:
+
+  class TableWriter final : public NC::MoveOnly {
+  public:
+    template<class T>
+    void put( const T& t ) { putRaw( &t, sizeof(T) ); }
+    template<class T>
+    void putArray( const T * data, std::size_t n )
+    {
+      put<std::uint64_t>( n );
+      putRaw( data, n * sizeof(T) );
+    }
+    template<class T>
+    void putArray( const std::vector<T>& v ) { putArray( v.data(), v.size() ); }
+    template<class T>
+    void putArray( const TableArray<T>& v ) { putArray( v.data(), v.size() ); }
+    void putTable( const ValueTable& );
+
+    void putRaw( const void * data, std::size_t n );
+    const std::vector<char>& buffer() const { return m_buf; }
+  private:
+    std::vector<char> m_buf;
+  };
+
+  class TableReader final : public NC::MoveOnly {
+  public:
+    TableReader( const char * data, std::size_t n, std::shared_ptr<const void> owner )
+      : m_it(data), m_end(data+n), m_owner(std::move(owner)) {}
+    template<class T>
+    T get() { T t; std::memcpy( &t, getRaw( sizeof(T) ), sizeof(T) ); return t; }
+    template<class T>
+    TableArray<T> getArray()
+    {
+      const std::size_t n = getArraySize( sizeof(T) );
+      return TableArray<T>( reinterpret_cast<const T*>( getRaw( n * sizeof(T) ) ), n, m_owner );
+    }
+    template<class T>
+    std::vector<T> getVector()
+    {
+      auto a = getArray<T>();
+      return std::vector<T>( a.data(), a.data() + a.size() );
+    }
+    ValueTable getTable();
+    bool atEnd() const { return m_it == m_end; }
+  private:
+    const char * m_it;
+    const char * m_end;
+    std::shared_ptr<const void> m_owner;
+    const char * getRaw( std::size_t n );
+    std::size_t getArraySize( std::size_t elemsize );
+  };
+
+}
+
+#endif
@@ -0,0 +1,285 @@
+#include "NCSparseKernel.hh"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+NCP::SparseKernel::SparseKernel( const NC::ScatKnlData& data, bool single_precision )
+  : m_alpha( data.alphaGrid ),
+    m_temperature( data.temperature.dbl() ),
+    m_massAMU( data.elementMassAMU.dbl() ),
+    m_boundXS( data.boundXS.dbl() )
+{
+  using KnlType = NC::ScatKnlData::KnlType;
+  const bool symmetric = ( data.knltype == KnlType::SCALED_SYM_SAB );
+  if ( !symmetric && data.knltype != KnlType::SAB )
+    NCRYSTAL_THROW(BadInput,"SparseKernel only supports kernels of type SAB or SCALED_SYM_SAB");
+
+  const NC::VectD& bgrid = data.betaGrid;
+  const std::size_t na = m_alpha.size();
+  const std::size_t nb = bgrid.size();
+  if ( na < 2 || nb < 2 || data.sab.size() != na * nb )
+    NCRYSTAL_THROW(BadInput,"SparseKernel: invalid grid or kernel sizes");
+  if ( na * nb >= std::numeric_limits<std::uint32_t>::max() )
+    NCRYSTAL_THROW(BadInput,"SparseKernel: kernel too large");
+  if ( !(m_temperature > 0.0) || !(m_massAMU > 0.0) || !(m_boundXS > 0.0) )
+    NCRYSTAL_THROW(BadInput,"SparseKernel: invalid temperature, mass or bound cross section");
+  for ( std::size_t i = 1; i < na; ++i )
+    if ( !( m_alpha[i] > m_alpha[i-1] ) )
+      NCRYSTAL_THROW(BadInput,"SparseKernel: alpha grid is not strictly increasing");
+  if ( !( m_alpha.front() >= 0.0 ) )
+    NCRYSTAL_THROW(BadInput,"SparseKernel: alpha grid has negative values");
+  for ( std::size_t i = 1; i < nb; ++i )
+    if ( !( bgrid[i] > bgrid[i-1] ) )
+      NCRYSTAL_THROW(BadInput,"SparseKernel: beta grid is not strictly increasing");
+  if ( symmetric && bgrid.front() != 0.0 )
+    NCRYSTAL_THROW(BadInput,"SparseKernel: beta grid of symmetric kernels must start at 0");
+
+  //Collect non-zero spans of each column, padded with the neighbouring zero
+  //values. Spans separated by a single zero share that point and are merged:
+  NC::VectD values;
+  std::vector<Span> spans;
+  m_columnSpans.reserve( nb + 1 );
+  m_columnSpans.push_back( 0 );
+  for ( std::size_t ib = 0; ib < nb; ++ib ) {
+    const double * col = &data.sab[ib*na];
+    const std::size_t firstSpan = spans.size();
+    std::size_t i = 0;
+    while ( i < na ) {
+      if ( !( col[i] > 0.0 ) ) {
+        if ( col[i] != 0.0 )
+          NCRYSTAL_THROW(BadInput,"SparseKernel: kernel contains negative or NaN values");
+        ++i;
+        continue;
+      }
+      std::size_t j = i;
+      while ( j < na && col[j] != 0.0 )
+        ++j;
+      const std::size_t b = ( i > 0 ? i - 1 : i );
+      const std::size_t e = ( j < na ? j + 1 : j );
+      if ( spans.size() > firstSpan && b < spans.back().ialpha_end ) {
+        for ( std::size_t k = spans.back().ialpha_end; k < e; ++k )
+          values.push_back( col[k] );
+        spans.back().ialpha_end = static_cast<std::uint32_t>( e );
+      } else {
+        spans.push_back( { static_cast<std::uint32_t>( b ),
+                             static_cast<std::uint32_t>( e ),
+                             static_cast<std::uint32_t>( values.size() ), 0 } );
+        for ( std::size_t k = b; k < e; ++k )
+          values.push_back( col[k] );
+      }
+      i = j;
+    }
+    m_columnSpans.push_back( static_cast<std::uint32_t>( spans.size() ) );
+  }
+  spans.shrink_to_fit();
+
+  //Block integrals of each span (from the values as stored, so integrals and
+  //sampling stay consistent with the interpolated kernel):
+  values.shrink_to_fit();
+  m_values = ValueTable( std::move(values), single_precision );
+  NC::VectD blockIntegrals;
+  for ( auto& span : spans ) {
+    span.iblock = static_cast<std::uint32_t>( blockIntegrals.size() );
+    const double * a = m_alpha.data() + span.ialpha_begin;
+    const std::size_t ncells = span.ialpha_end - span.ialpha_begin - 1;
+    m_values.visit( [&]( auto values )
+    {
+      const auto * v = values + span.ivalue;
+      double sum = 0.0;
+      for ( std::size_t i = 0; i < ncells; ++i ) {
+        if ( i % blockSize == 0 )
+          blockIntegrals.push_back( sum );
+        sum += 0.5 * ( double( v[i] ) + v[i+1] ) * ( a[i+1] - a[i] );
+      }
+      blockIntegrals.push_back( sum );
+    } );
+  }
+  blockIntegrals.shrink_to_fit();
+  m_spans = TableArray<Span>( std::move(spans) );
+  m_blockIntegrals = TableArray<double>( std::move(blockIntegrals) );
+
+  //Full beta grid, mapped onto the stored columns:
+  if ( symmetric ) {
+    const std::size_t nfull = 2 * nb - 1;
+    m_beta.resize( nfull );
+    m_betaToColumn.resize( nfull );
+    m_betaScale.resize( nfull );
+    for ( std::size_t k = 0; k < nfull; ++k ) {
+      const std::size_t icol = ( k < nb - 1 ? nb - 1 - k : k - ( nb - 1 ) );
+      const double beta = ( k < nb - 1 ? -bgrid[icol] : bgrid[icol] );
+      m_beta[k] = beta;
+      m_betaToColumn[k] = static_cast<std::uint32_t>( icol );
+      m_betaScale[k] = std::exp( -0.5 * beta );
+    }
+  } else {
+    m_beta = bgrid;
+    m_betaToColumn.resize( nb );
+    for ( std::size_t k = 0; k < nb; ++k )
+      m_betaToColumn[k] = static_cast<std::uint32_t>( k );
+    m_betaScale.assign( nb, 1.0 );
+  }
+}
+
+NCP::SparseKernel::SparseKernel( TableReader& r )
+  : m_alpha( r.getVector<double>() ),
+    m_beta( r.getVector<double>() ),
+    m_betaToColumn( r.getVector<std::uint32_t>() ),
+    m_betaScale( r.getVector<double>() ),
+    m_columnSpans( r.getVector<std::uint32_t>() ),
+    m_spans( r.getArray<Span>() ),
+    m_values( r.getTable() ),
+    m_blockIntegrals( r.getArray<double>() ),
+    m_temperature( r.get<double>() ),
+    m_massAMU( r.get<double>() ),
+    m_boundXS( r.get<double>() )
+{
+  if ( m_alpha.size() < 2 || m_beta.size() < 2 || m_betaToColumn.size() != m_beta.size()
+       || m_betaScale.size() != m_beta.size() || m_columnSpans.empty()
+       || m_columnSpans.back() != m_spans.size() )
+    NCRYSTAL_THROW(DataLoadError,"SparseKernel: inconsistent tables");
+}
+
+void NCP::SparseKernel::writeTables( TableWriter& w ) const
+{
+  //Same order as the members (and as in the constructor above):
+  w.putArray( m_alpha );
+  w.putArray( m_beta );
+  w.putArray( m_betaToColumn );
+  w.putArray( m_betaScale );
+  w.putArray( m_columnSpans );
+  w.putArray( m_spans );
+  w.putTable( m_values );
+  w.putArray( m_blockIntegrals );
+  w.put( m_temperature );
+  w.put( m_massAMU );
+  w.put( m_boundXS );
+}
+
+double NCP::SparseKernel::spanTotal( const Span& s ) const
+{
+  const std::size_t ncells = s.ialpha_end - s.ialpha_begin - 1;
+  return m_blockIntegrals[ s.iblock + ( ncells + blockSize - 1 ) / blockSize ];
+}
+
+template<class TValue>
+double NCP::SparseKernel::spanPrimitive( const TValue * values, const Span& s, double alpha ) const
+{
+  //Integral from the start of the span up to alpha (which must be inside it):
+  const double * a = m_alpha.data() + s.ialpha_begin;
+  const TValue * v = values + s.ivalue;
+  const std::size_t ncells = s.ialpha_end - s.ialpha_begin - 1;
+  std::size_t icell = std::upper_bound( a, a + ncells + 1, alpha ) - a;
+  icell = NC::ncmin( NC::ncmax<std::size_t>( icell, 1 ), ncells ) - 1;
+  std::size_t i = ( icell / blockSize ) * blockSize;
+  double sum = 0.0;
+  for ( ; i < icell; ++i )
+    sum += ( double( v[i] ) + v[i+1] ) * ( a[i+1] - a[i] );
+  const double d = alpha - a[icell];
+  const double v0 = v[icell];
+  const double slope = ( v[icell+1] - v0 ) / ( a[icell+1] - a[icell] );
+  return m_blockIntegrals[ s.iblock + icell / blockSize ] + 0.5 * sum
+    + d * ( v0 + 0.5 * slope * d );
+}
+
+template<class TValue>
+double NCP::SparseKernel::columnPrimitive( const TValue * values, std::uint32_t icol,
+                                           double alpha ) const
+{
+  double sum = 0.0;
+  const Span * itSpan = m_spans.data() + m_columnSpans[icol];
+  const Span * itSpanE = m_spans.data() + m_columnSpans[icol+1];
+  for ( ; itSpan != itSpanE; ++itSpan ) {
+    if ( alpha <= m_alpha[itSpan->ialpha_begin] )
+      return sum;
+    if ( alpha < m_alpha[itSpan->ialpha_end - 1] )
+      return sum + spanPrimitive( values, *itSpan, alpha );
+    sum += spanTotal( *itSpan );
+  }
+  return sum;
+}
+
+double NCP::SparseKernel::evaluate( std::size_t ibeta, double alpha ) const
+{
+  const std::uint32_t icol = m_betaToColumn[ibeta];
+  const Span * itSpan = m_spans.data() + m_columnSpans[icol];
+  const Span * itSpanE = m_spans.data() + m_columnSpans[icol+1];
+  for ( ; itSpan != itSpanE; ++itSpan ) {
+    if ( alpha < m_alpha[itSpan->ialpha_begin] )
+      return 0.0;
+    if ( alpha <= m_alpha[itSpan->ialpha_end - 1] ) {
+      const double * a = m_alpha.data() + itSpan->ialpha_begin;
+      const std::size_t ncells = itSpan->ialpha_end - itSpan->ialpha_begin - 1;
+      std::size_t i = std::upper_bound( a, a + ncells + 1, alpha ) - a;
+      i = NC::ncmin( NC::ncmax<std::size_t>( i, 1 ), ncells ) - 1;
+      const double t = ( alpha - a[i] ) / ( a[i+1] - a[i] );
+      const double v0 = m_values.get( itSpan->ivalue + i );
+      const double v1 = m_values.get( itSpan->ivalue + i + 1 );
+      return ( v0 + t * ( v1 - v0 ) ) * m_betaScale[ibeta];
+    }
+  }
+  return 0.0;
+}
+
+double NCP::SparseKernel::integrateAlpha( std::size_t ibeta, double alow, double ahigh ) const
+{
+  if ( !( ahigh > alow ) )
+    return 0.0;
+  const std::uint32_t icol = m_betaToColumn[ibeta];
+  const double res = m_values.visit( [&]( auto values )
+  {
+    return columnPrimitive( values, icol, ahigh ) - columnPrimitive( values, icol, alow );
+  } );
+  return NC::ncmax( 0.0, res ) * m_betaScale[ibeta];
+}
+
+double NCP::SparseKernel::sampleAlpha( std::size_t ibeta, double alow, double ahigh,
+                                       double integral, double rand ) const
+{
+  const std::uint32_t icol = m_betaToColumn[ibeta];
+  return m_values.visit( [&]( auto values )
+  {
+    double target = columnPrimitive( values, icol, alow ) + rand * integral / m_betaScale[ibeta];
+    const Span * itSpan = m_spans.data() + m_columnSpans[icol];
+    const Span * itSpanE = m_spans.data() + m_columnSpans[icol+1];
+    for ( ; itSpan != itSpanE; ++itSpan ) {
+      const double total = spanTotal( *itSpan );
+      if ( target > total && itSpan + 1 != itSpanE ) {
+        target -= total;
+        continue;
+      }
+      //Find the block, and then the cell, containing the target:
+      const double * a = m_alpha.data() + itSpan->ialpha_begin;
+      const auto * v = values + itSpan->ivalue;
+      const double * blocks = m_blockIntegrals.data() + itSpan->iblock;
+      const std::size_t ncells = itSpan->ialpha_end - itSpan->ialpha_begin - 1;
+      const std::size_t nblocks = ( ncells + blockSize - 1 ) / blockSize;
+      std::size_t iblock = std::upper_bound( blocks, blocks + nblocks, target ) - blocks;
+      iblock = NC::ncmax<std::size_t>( iblock, 1 ) - 1;
+      target -= blocks[iblock];
+      std::size_t i = iblock * blockSize;
+      for ( ; i + 1 < ncells; ++i ) {
+        const double area = 0.5 * ( double( v[i] ) + v[i+1] ) * ( a[i+1] - a[i] );
+        if ( target <= area )
+          break;
+        target -= area;
+      }
+      //Invert the linear density within the cell:
+      const double v0 = v[i];
+      const double slope = ( v[i+1] - v0 ) / ( a[i+1] - a[i] );
+      target = NC::ncmax( 0.0, target );
+      const double disc = NC::ncmax( 0.0, v0 * v0 + 2.0 * slope * target );
+      const double denom = v0 + std::sqrt( disc );
+      const double d = ( denom > 0.0 ? 2.0 * target / denom : 0.0 );
+      return NC::ncclamp( a[i] + d, NC::ncmax( alow, a[i] ), NC::ncmin( ahigh, a[i+1] ) );
+    }
+    return ahigh;
+  } );
+}
+
+std::size_t NCP::SparseKernel::memoryUsage() const
+{
+  return sizeof(*this)
+    + sizeof(double) * ( m_alpha.capacity() + m_beta.capacity() + m_betaScale.capacity() )
+    + m_values.memoryUsage() + m_blockIntegrals.memoryUsage() + m_spans.memoryUsage()
+    + sizeof(std::uint32_t) * ( m_betaToColumn.capacity() + m_columnSpans.capacity() );
+}
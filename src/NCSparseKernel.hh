@@ -0,0 +1,97 @@
+#ifndef NCPlugin_SparseKernel_hh
+#define NCPlugin_SparseKernel_hh
+
+#include "NCSharedTables.hh"
+
+namespace NCPluginNamespace {
+
+  //Sparse in-memory representation of an S(alpha,beta) kernel. For each beta
+  //column, only the spans of non-zero values along the alpha grid are kept
+  //(each padded with the neighbouring zero-valued grid points, so the
+  //piecewise-linear interpolation in alpha is reproduced exactly). Kernels in
+  //the symmetric scaled format (sab_scaled) are furthermore stored only for
+  //beta>=0, with values at beta<0 being recovered through detailed balance:
+  //
+  //   S(alpha,beta) = exp(-beta/2) * S_scaled(alpha,|beta|)
+  //
+  //The public interface always presents the full beta grid of the standard
+  //(unscaled, non-symmetric) kernel format. The kernel values can optionally
+  //be stored in single precision (the input data rarely has more than about
+  //six significant digits), while the grids and the integrals derived from the
+  //values are always kept in double precision.
+
+  class SparseKernel final : public NC::MoveOnly {
+  public:
+
+    //Accepts kernels of type SAB or SCALED_SYM_SAB (raises BadInput otherwise):
+    SparseKernel( const NC::ScatKnlData&, bool single_precision = false );
+
+    //Kernel written with writeTables, with the large tables used directly from
+    //the memory of the reader (see SharedTables):
+    SparseKernel( TableReader& );
+    void writeTables( TableWriter& ) const;
+
+    const NC::VectD& alphaGrid() const { return m_alpha; }
+    const NC::VectD& betaGrid() const { return m_beta; }//full grid
+    double temperature() const { return m_temperature; }
+    double elementMassAMU() const { return m_massAMU; }
+    double boundXS() const { return m_boundXS; }
+
+    //Value of S(alpha,beta_i), where beta_i is the i'th point in the beta grid:
+    double evaluate( std::size_t ibeta, double alpha ) const;
+
+    //Integral of S(alpha,beta_i) over alpha in [alow,ahigh], where beta_i is
+    //the i'th point in the beta grid:
+    double integrateAlpha( std::size_t ibeta, double alow, double ahigh ) const;
+
+    //Sample alpha from S(alpha,beta_i) restricted to [alow,ahigh]. The
+    //integral argument must be the value returned by integrateAlpha for the
+    //same range, and rand a uniformly distributed number in [0,1):
+    double sampleAlpha( std::size_t ibeta, double alow, double ahigh,
+                        double integral, double rand ) const;
+
+    //Number of stored values and values in the equivalent dense standard
+    //format, as well as the total memory footprint in bytes:
+    std::size_t nStoredValues() const { return m_values.size(); }
+    bool singlePrecision() const { return m_values.singlePrecision(); }
+    std::size_t nDenseValues() const { return m_alpha.size() * m_beta.size(); }
+    std::size_t memoryUsage() const;
+
+  private:
+    //Each span covers alpha grid points [ialpha_begin,ialpha_end), with values
+    //at m_values[ivalue...]. To keep integrals and sampling fast without
+    //storing a full cumulative table, the integrals from the start of the span
+    //up to every blockSize'th grid point (and up to the end of the span) are
+    //kept at m_blockIntegrals[iblock...]:
+    static constexpr std::size_t blockSize = 16;
+    struct Span {
+      std::uint32_t ialpha_begin;
+      std::uint32_t ialpha_end;
+      std::uint32_t ivalue;
+      std::uint32_t iblock;
+    };
+    NC::VectD m_alpha;
+    NC::VectD m_beta;
+    std::vector<std::uint32_t> m_betaToColumn;//stored column for each beta
+    NC::VectD m_betaScale;//value scale factor for each beta
+    std::vector<std::uint32_t> m_columnSpans;//spans of column i are at
+                                             //m_columnSpans[i]..[i+1]
+    TableArray<Span> m_spans;
+    ValueTable m_values;
+    TableArray<double> m_blockIntegrals;
+    double m_temperature;
+    double m_massAMU;
+    double m_boundXS;
+
+    //Helpers taking the stored values as the first argument (see ValueTable):
+    double spanTotal( const Span& s ) const;
+    template<class TValue>
+    double spanPrimitive( const TValue * values, const Span& s, double alpha ) const;
+    //Integral of the stored (unscaled) column from alpha=-inf to alpha:
+    template<class TValue>
+    double columnPrimitive( const TValue * values, std::uint32_t icol, double alpha ) const;
+  };
+
+}
+
+#endif
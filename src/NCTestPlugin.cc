@@ -20,9 +20,100 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "NCTestPlugin.hh"
+#include "NCCounterRNG.hh"
+#include "NCInstrumentation.hh"
+#include "NCKernelFile.hh"
+#include "NCKernelModel.hh"
+#include "NCKernelParser.hh"
+#include "NCKernelScatter.hh"
+#include "NCMultiPhonon.hh"
+#include "NCParallel.hh"
+#include "NCValueTable.hh"
 #include "NCrystal/internal/utils/NCMsg.hh"
+#include "NCrystal/internal/utils/NCRandUtils.hh"
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <thread>
 //#include "NCrystal/internal/utils/NCMath.hh"
 
+namespace NCPluginNamespace {
+  namespace {
+
+    //Two-sample chi-square test (per degree of freedom) of the distributions
+    //of mu and ekin_final sampled by two models, with n events from each:
+    std::pair<double,double> compareSampling( const PhysicsModel& pm1, const PhysicsModel& pm2,
+                                              NC::RNG& rng, double ekin, double kT, unsigned n )
+    {
+      constexpr unsigned nbins = 40;
+      std::vector<unsigned> hmu[2], hef[2];
+      for ( unsigned k = 0; k < 2; ++k ) {
+        hmu[k].resize( nbins, 0 );
+        hef[k].resize( nbins, 0 );
+        NC::CachePtr cache;
+        for ( unsigned i = 0; i < n; ++i ) {
+          auto evt = ( k ? pm2 : pm1 ).sampleScatteringEvent( cache, rng, ekin );
+          nc_assert_always( evt.ekin_final > 0.0 && NC::ncabs( evt.mu ) <= 1.0 );
+          const double ef = evt.ekin_final / ( ekin + 20.0 * kT );
+          ++hmu[k][ NC::ncmin<unsigned>( nbins - 1, unsigned( ( evt.mu + 1.0 ) * 0.5 * nbins ) ) ];
+          ++hef[k][ NC::ncmin<unsigned>( nbins - 1, unsigned( ef * nbins ) ) ];
+        }
+      }
+      auto chi2PerBin = []( const std::vector<unsigned>& a, const std::vector<unsigned>& b )
+      {
+        double chi2 = 0.0;
+        unsigned ndf = 0;
+        for ( unsigned i = 0; i < a.size(); ++i ) {
+          if ( a[i] + b[i] == 0 )
+            continue;
+          const double d = double( a[i] ) - double( b[i] );
+          chi2 += d * d / ( a[i] + b[i] );
+          ++ndf;
+        }
+        return ndf ? chi2 / ndf : 0.0;
+      };
+      return { chi2PerBin( hmu[0], hmu[1] ), chi2PerBin( hef[0], hef[1] ) };
+    }
+
+    //Calls fct, which must throw an exception of type TErr (any other type of
+    //exception propagates). Returns the message of the exception:
+    template<class TErr, class TFct>
+    std::string expectThrows( TFct&& fct )
+    {
+      try {
+        fct();
+      } catch ( TErr& e ) {
+        return e.what();
+      }
+      nc_assert_always( false && "expected exception not thrown" );
+      return {};
+    }
+
+    //Content of the shipped BeO data file, with each line replaced by the
+    //result of lineTransform (which can also give several lines, or none, each
+    //terminated by a newline):
+    using LineTransform = std::function<std::string(const std::string&)>;
+    std::string modifiedShippedFile( const LineTransform& lineTransform )
+    {
+      auto textData = NC::createTextData( NC::TextDataPath( "plugins::BzScope/bzscope_beo_c1_300K.ncmat" ) );
+      std::string content;
+      for ( const auto& line : *textData )
+        content += lineTransform( line );
+      return content;
+    }
+
+    //Same, registered as in-memory data with the given name (and returned):
+    std::string registerModifiedShippedFile( const std::string& name, const LineTransform& lineTransform )
+    {
+      std::string content = modifiedShippedFile( lineTransform );
+      NC::registerInMemoryFileData( name, std::string( content ) );
+      return content;
+    }
+
+  }
+}
+
 void NCP::customPluginTest()
 {
   //This function is called by NCrystal after the plugin is loaded, but only if
@@ -36,10 +127,642 @@ void NCP::customPluginTest()
 
   NCPLUGIN_MSG("Testing plugin");
 
-  //TODO!!!
+  auto info = NC::createInfo("plugins::BzScope/bzscope_beo_c1_300K.ncmat");
+  nc_assert_always( PhysicsModel::isApplicable( *info ) );
+
+  //The sparse kernel mode must reproduce the dense mode (with the cross
+  //sections of both within the target accuracy of their exact values):
+  const PhysicsModel::Options opts_dflt;
+  PhysicsModel::Options opts;
+  opts.kernelMode = PhysicsModel::Options::KernelMode::Dense;
+  auto pm_dense = PhysicsModel::createFromInfo( *info, opts );
+  opts.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+  auto pm_sparse = PhysicsModel::createFromInfo( *info, opts );
+  NCPLUGIN_MSG("Sparse kernel mode memory usage: "<<pm_sparse.memoryUsage()*1e-6<<" MB");
+
+  for ( double ekin : { 0.001, 0.01, 0.0253, 0.1, 0.5, 1.0 } ) {
+    const double xs_dense = pm_dense.calcCrossSection( ekin );
+    const double xs_sparse = pm_sparse.calcCrossSection( ekin );
+    NCPLUGIN_MSG("xs("<<ekin<<" eV): dense="<<xs_dense<<" barn, sparse="<<xs_sparse<<" barn");
+    nc_assert_always( NC::ncabs( xs_sparse - xs_dense ) <= 2.0 * opts_dflt.xsTableAccuracy * xs_dense + 1e-6 );
+  }
+
+  //The energy grid of the sparse tables is refined until the cross sections
+  //are interpolated to within the target accuracy, also between the points
+  //checked during the refinement:
+  {
+    auto knl = parseCustomSection( info->getCustomSection( pluginNameUpperCase() ) );
+    const double emax = knl.suggestedEmax;
+    auto sparse = NC::makeSO<const SparseKernel>( std::move( knl ) );
+    KernelScatter sc_fixed( sparse, emax, 2 );
+    KernelScatter sc_refined( sparse, emax, 2, KernelScatter::defaultPointsPerDecade,
+                              opts_dflt.xsTableAccuracy );
+    const double dev_fixed = sc_fixed.selfCheck( 2 );
+    const double dev_refined = sc_refined.selfCheck( 2 );
+    NCPLUGIN_MSG("Sparse tables interpolated to within "<<dev_fixed<<" with "<<sc_fixed.energyGrid().size()
+                 <<" grid points, and within "<<dev_refined<<" with "<<sc_refined.energyGrid().size()
+                 <<" refined grid points");
+    nc_assert_always( dev_refined <= opts_dflt.xsTableAccuracy );
+    nc_assert_always( sc_refined.energyGrid().size() >= sc_fixed.energyGrid().size() );
+  }
+
+  //The cross section table of the dense mode must agree with the exact values
+  //to within the requested accuracy:
+  {
+    PhysicsModel::Options opts_exact;
+    opts_exact.xsTableAccuracy = 0.0;
+    auto pm_exact = PhysicsModel::createFromInfo( *info, opts_exact );
+    double worst = 0.0;
+    for ( double ekin = 1.1e-5; ekin < 1.8; ekin *= 1.0173 ) {
+      const double xs_exact = pm_exact.calcCrossSection( ekin );
+      worst = NC::ncmax( worst, NC::ncabs( pm_dense.calcCrossSection( ekin ) - xs_exact ) / xs_exact );
+    }
+    NCPLUGIN_MSG("Largest relative deviation of tabulated cross sections: "<<worst);
+    nc_assert_always( worst < 10.0 * PhysicsModel::Options().xsTableAccuracy );
+  }
+
+  //Batch evaluation must agree with single evaluations:
+  {
+    const NC::VectD energies = { 1e-6, 0.001, 0.0253, 0.1, 1.0, 10.0 };
+    NC::VectD xs( energies.size() );
+    for ( const PhysicsModel* pm : { &pm_dense, &pm_sparse } ) {
+      NC::CachePtr cache;
+      pm->calcCrossSections( cache, energies.data(), energies.size(), xs.data() );
+      for ( std::size_t i = 0; i < energies.size(); ++i )
+        nc_assert_always( NC::ncabs( xs[i] - pm->calcCrossSection( energies[i] ) ) <= 1e-12 * xs[i] );
+    }
+  }
+
+  auto rngproducer = NC::getDefaultRNGProducer();
+  auto rng = rngproducer->produce();
+  NC::CachePtr cache_dense, cache_sparse;
+  const unsigned nsample = 20000;
+  for ( double ekin : { 0.0253, 0.1 } ) {
+    double sum_dense_ef(0.0), sum_dense_mu(0.0), sum_sparse_ef(0.0), sum_sparse_mu(0.0);
+    for ( unsigned i = 0; i < nsample; ++i ) {
+      auto evt_dense = pm_dense.sampleScatteringEvent( cache_dense, *rng, ekin );
+      auto evt_sparse = pm_sparse.sampleScatteringEvent( cache_sparse, *rng, ekin );
+      nc_assert_always( evt_sparse.ekin_final > 0.0 && NC::ncabs( evt_sparse.mu ) <= 1.0 );
+      sum_dense_ef += evt_dense.ekin_final;
+      sum_dense_mu += evt_dense.mu;
+      sum_sparse_ef += evt_sparse.ekin_final;
+      sum_sparse_mu += evt_sparse.mu;
+    }
+    NCPLUGIN_MSG("<ekin_final>("<<ekin<<" eV): dense="<<sum_dense_ef/nsample
+                 <<" eV, sparse="<<sum_sparse_ef/nsample<<" eV");
+    NCPLUGIN_MSG("<mu>("<<ekin<<" eV): dense="<<sum_dense_mu/nsample
+                 <<", sparse="<<sum_sparse_mu/nsample);
+    nc_assert_always( NC::ncabs( sum_sparse_ef - sum_dense_ef ) / nsample < 0.002 );
+    nc_assert_always( NC::ncabs( sum_sparse_mu - sum_dense_mu ) / nsample < 0.05 );
+  }
+
+  //The fast sampling tables must reproduce the distributions of the standard
+  //sampling (compared with a two-sample chi-square test of the histograms of
+  //mu and of the final energy), and must respect the memory budget:
+  {
+    PhysicsModel::Options opts_fast;
+    opts_fast.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+    opts_fast.fastSampling = true;
+    auto pm_fast = PhysicsModel::createFromInfo( *info, opts_fast );
+    NCPLUGIN_MSG("Sparse kernel mode memory usage with fast sampling: "
+                 <<pm_fast.memoryUsage()*1e-6<<" MB");
+    nc_assert_always( pm_fast.memoryUsage() > pm_sparse.memoryUsage() );
+    nc_assert_always( pm_fast.memoryUsage() - pm_sparse.memoryUsage()
+                      <= opts_fast.fastSamplingMemoryMB * 1e6 );
+    const double kT = NC::constant_boltzmann * info->getTemperature().dbl();
+    for ( double ekin : { 0.001, 0.0253, 0.5 } ) {
+      auto chi2 = compareSampling( pm_sparse, pm_fast, *rng, ekin, kT, 2 * nsample );
+      NCPLUGIN_MSG("Fast vs. standard sampling at "<<ekin<<" eV: chi2/ndf="<<chi2.first
+                   <<" (mu), "<<chi2.second<<" (ekin_final)");
+      nc_assert_always( chi2.first < 2.0 && chi2.second < 2.0 );
+    }
+    opts_fast.fastSamplingMemoryMB = 0.01;
+    expectThrows<NC::Error::BadInput>( [&]() { PhysicsModel( *info, opts_fast ); } );
+  }
+
+  //The energy grid follows the requested density, but is made coarser when
+  //needed to fit the memory budget:
+  {
+    PhysicsModel::Options opts_grid;
+    opts_grid.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+    opts_grid.gridDensity = 2.0;
+    auto pm_fine = PhysicsModel::createFromInfo( *info, opts_grid );
+    nc_assert_always( pm_fine.memoryUsage() > pm_sparse.memoryUsage() );
+    opts_grid.memoryBudgetMB = 0.8e-6 * pm_sparse.memoryUsage();
+    auto pm_budget = PhysicsModel::createFromInfo( *info, opts_grid );
+    NCPLUGIN_MSG("Sparse kernel mode memory usage with a budget of "<<opts_grid.memoryBudgetMB
+                 <<" MB: "<<pm_budget.memoryUsage()*1e-6<<" MB");
+    nc_assert_always( pm_budget.memoryUsage() <= opts_grid.memoryBudgetMB * 1e6 );
+    for ( double ekin : { 0.001, 0.0253, 0.1 } )
+      nc_assert_always( NC::ncabs( pm_budget.calcCrossSection( ekin ) - pm_sparse.calcCrossSection( ekin ) )
+                        <= 0.1 * pm_sparse.calcCrossSection( ekin ) );
+    opts_grid.memoryBudgetMB = 0.1;
+    expectThrows<NC::Error::BadInput>( [&]() { PhysicsModel( *info, opts_grid ); } );
+  }
+
+  //The storage type of value tables must not depend on their content:
+  nc_assert_always( ValueTable( 0, true ).singlePrecision() );
+  nc_assert_always( ValueTable( NC::VectD(), true ).singlePrecision() );
+  nc_assert_always( !ValueTable( 0, false ).singlePrecision() );
+
+  //Single precision storage must halve the memory of the kernel and the
+  //standard tables, with results agreeing with double precision (compared for
+  //all the shipped data files, in both the standard and fast sampling modes):
+  const auto datafiles = pluginDataFiles();
+  nc_assert_always( !datafiles.empty() );
+  for ( const std::string& fn : datafiles ) {
+    auto info_sp = NC::createInfo( fn );
+    const double kT = NC::constant_boltzmann * info_sp->getTemperature().dbl();
+    for ( bool fast : { false, true } ) {
+      PhysicsModel::Options opts_sp;
+      opts_sp.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+      opts_sp.fastSampling = fast;
+      auto pm_double = PhysicsModel::createFromInfo( *info_sp, opts_sp );
+      opts_sp.singlePrecision = true;
+      auto pm_single = PhysicsModel::createFromInfo( *info_sp, opts_sp );
+      double worst = 0.0;
+      for ( double ekin = 1e-5; ekin < 10.0; ekin *= 1.05 ) {
+        const double xs = pm_double.calcCrossSection( ekin );
+        worst = NC::ncmax( worst, NC::ncabs( pm_single.calcCrossSection( ekin ) - xs ) / xs );
+      }
+      NCPLUGIN_MSG(fn<<( fast ? " (fast sampling)" : "" )<<": memory usage "
+                   <<pm_double.memoryUsage()*1e-6<<" MB (double), "
+                   <<pm_single.memoryUsage()*1e-6<<" MB (single), largest relative cross"
+                   " section deviation "<<worst);
+      if ( !fast )
+        nc_assert_always( pm_single.memoryUsage() < 0.6 * pm_double.memoryUsage() );
+      nc_assert_always( worst < 1e-5 );
+      for ( double ekin : { 0.001, 0.0253, 0.5 } ) {
+        auto chi2 = compareSampling( pm_double, pm_single, *rng, ekin, kT, nsample );
+        NCPLUGIN_MSG("  sampling at "<<ekin<<" eV: chi2/ndf="<<chi2.first<<" (mu), "
+                     <<chi2.second<<" (ekin_final)");
+        nc_assert_always( chi2.first < 2.0 && chi2.second < 2.0 );
+      }
+    }
+  }
+
+  //Regridding must reduce the kernels of all the shipped data files, with
+  //cross sections staying well within the tolerance of the regridding:
+  for ( const std::string& fn : datafiles ) {
+    auto info_rg = NC::createInfo( fn );
+    PhysicsModel::Options opts_rg;
+    opts_rg.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+    auto pm_ref = PhysicsModel::createFromInfo( *info_rg, opts_rg );
+    opts_rg.regridTolerance = 0.05;
+    auto pm_regrid = PhysicsModel::createFromInfo( *info_rg, opts_rg );
+    double worst = 0.0;
+    for ( double ekin = 1e-5; ekin < 10.0; ekin *= 1.05 ) {
+      const double xs = pm_ref.calcCrossSection( ekin );
+      worst = NC::ncmax( worst, NC::ncabs( pm_regrid.calcCrossSection( ekin ) - xs ) / xs );
+    }
+    NCPLUGIN_MSG(fn<<": memory usage "<<pm_ref.memoryUsage()*1e-6<<" MB, "
+                 <<pm_regrid.memoryUsage()*1e-6<<" MB regridded, largest relative cross"
+                 " section deviation "<<worst);
+    nc_assert_always( pm_regrid.memoryUsage() < pm_ref.memoryUsage() );
+    nc_assert_always( worst < 0.01 );
+  }
+
+  //Tables shared through NCPLUGIN_BZSCOPE_SHAREDDIR must be published by the
+  //first model built, and then used from the mapped file (without private
+  //copies) with the same results as tables built normally. The grid density is
+  //chosen to avoid reusing an existing model:
+  {
+    PhysicsModel::Options opts_shared;
+    opts_shared.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+    opts_shared.fastSampling = true;
+    opts_shared.gridDensity = 0.75;
+    const double kT = NC::constant_boltzmann * info->getTemperature().dbl();
+    const double energies[] = { 1e-4, 0.001, 0.0253, 0.1, 0.5 };
+    double xs_ref[5];
+    std::size_t mem_ref;
+    {
+      auto pm_ref = PhysicsModel::createFromInfo( *info, opts_shared );
+      for ( unsigned i = 0; i < 5; ++i )
+        xs_ref[i] = pm_ref.calcCrossSection( energies[i] );
+      mem_ref = pm_ref.memoryUsage();
+    }
+    char dirtemplate[] = "/tmp/ncplugin_bzscope_sharedXXXXXX";
+    nc_assert_always( ::mkdtemp( dirtemplate ) != nullptr );
+    const std::string dir = dirtemplate;
+    const char * prevdir = std::getenv( "NCPLUGIN_BZSCOPE_SHAREDDIR" );
+    const std::string prevdir_str = ( prevdir ? prevdir : "" );
+    ::setenv( "NCPLUGIN_BZSCOPE_SHAREDDIR", dir.c_str(), 1 );
+    for ( unsigned k = 0; k < 2; ++k ) {
+      //First publishing and then only mapping the file:
+      auto pm_shared = PhysicsModel::createFromInfo( *info, opts_shared );
+      NCPLUGIN_MSG("Shared tables: memory usage "<<pm_shared.memoryUsage()*1e-6
+                   <<" MB (vs. "<<mem_ref*1e-6<<" MB when built privately)");
+      nc_assert_always( pm_shared.memoryUsage() < 0.1 * mem_ref );
+      for ( unsigned i = 0; i < 5; ++i )
+        nc_assert_always( pm_shared.calcCrossSection( energies[i] ) == xs_ref[i] );
+      auto chi2 = compareSampling( pm_shared, pm_sparse, *rng, 0.0253, kT, nsample );
+      nc_assert_always( chi2.first < 2.0 && chi2.second < 2.0 );
+    }
+    unsigned nfiles = 0;
+    for ( const auto& entry : std::filesystem::directory_iterator( dir ) )
+      if ( entry.path().extension() == ".bzst" )
+        ++nfiles;
+    nc_assert_always( nfiles == 1 );
+    std::filesystem::remove_all( dir );
+    if ( prevdir )
+      ::setenv( "NCPLUGIN_BZSCOPE_SHAREDDIR", prevdir_str.c_str(), 1 );
+    else
+      ::unsetenv( "NCPLUGIN_BZSCOPE_SHAREDDIR" );
+  }
+
+  //Merged kernels must give the weighted sum of the cross sections of the
+  //kernels merged. For the test, merge the kernel with a copy at another
+  //temperature and element mass:
+  {
+    auto base = parseCustomSection( info->getCustomSection( pluginNameUpperCase() ) );
+    auto other = base;
+    other.temperature = NC::Temperature{ 1.3 * base.temperature.dbl() };
+    other.elementMassAMU = NC::AtomMass{ 2.0 * base.elementMassAMU.dbl() };
+    other.boundXS = NC::SigmaBound{ 3.0 * base.boundXS.dbl() };
+    auto merged = mergeKernels( base, { { 0.5, other } }, 2 );
+    const double emax = base.suggestedEmax;
+    auto scatter = [emax]( const NC::ScatKnlData& knl )
+    {
+      return KernelScatter( NC::makeSO<const SparseKernel>( knl ), emax, 2 );
+    };
+    auto sc_base = scatter( base );
+    auto sc_other = scatter( other );
+    auto sc_merged = scatter( merged );
+    double worst = 0.0;
+    for ( double ekin = 1e-4; ekin < emax; ekin *= 1.1 ) {
+      const double xs = sc_base.crossSection( ekin ) + 0.5 * sc_other.crossSection( ekin );
+      worst = NC::ncmax( worst, NC::ncabs( sc_merged.crossSection( ekin ) - xs ) / xs );
+    }
+    NCPLUGIN_MSG("Largest relative cross section deviation of merged kernel: "<<worst);
+    nc_assert_always( worst < 1e-3 );
+
+    //The multi-phonon contributions of the material only add to the cross
+    //sections, and the merged model must sample valid scattering events:
+    PhysicsModel::Options opts_merge;
+    opts_merge.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+    opts_merge.mergeMultiPhonon = true;
+    auto pm_merged = PhysicsModel::createFromInfo( *info, opts_merge );
+    for ( double ekin : { 0.001, 0.0253, 0.1, 0.5 } ) {
+      const double xs_merged = pm_merged.calcCrossSection( ekin );
+      const double xs = pm_sparse.calcCrossSection( ekin );
+      NCPLUGIN_MSG("xs("<<ekin<<" eV): "<<xs_merged<<" barn with multi-phonon terms, "
+                   <<xs<<" barn without");
+      nc_assert_always( xs_merged >= xs * ( 1.0 - 1e-6 ) );
+    }
+    NC::CachePtr cache;
+    for ( unsigned i = 0; i < 1000; ++i ) {
+      auto evt = pm_merged.sampleScatteringEvent( cache, *rng, 0.0253 );
+      nc_assert_always( evt.ekin_final > 0.0 && NC::ncabs( evt.mu ) <= 1.0 );
+    }
+
+    //The merged model replaces the separate VDOS processes of NCrystal, so the
+    //factory must give the same inelastic cross sections with and without
+    //merging, also above the Emax of the kernel, where the separate processes
+    //take over again. The cfg strings differ in a parameter irrelevant here,
+    //so NCrystal does not reuse the first scatter for the second:
+    for ( double ekin : { 0.0253, 0.5 * emax, 1.5 * emax, 10.0 * emax } )
+      nc_assert_always( pm_merged.separateMultiPhononFraction( ekin ) == ( ekin > emax ? 1.0 : 0.0 ) );
+    const char * prevmerge = std::getenv( "NCPLUGIN_BZSCOPE_MERGEMULTIPHONON" );
+    const std::string prevmerge_str = ( prevmerge ? prevmerge : "" );
+    const std::string cfg_inelas = "plugins::BzScope/bzscope_beo_c1_300K.ncmat;coh_elas=0;incoh_elas=0";
+    ::setenv( "NCPLUGIN_BZSCOPE_MERGEMULTIPHONON", "0", 1 );
+    auto sc_separate = NC::createScatter( cfg_inelas );
+    ::setenv( "NCPLUGIN_BZSCOPE_MERGEMULTIPHONON", "1", 1 );
+    auto sc_factmerged = NC::createScatter( cfg_inelas + ";dcutoff=0.5" );
+    if ( prevmerge )
+      ::setenv( "NCPLUGIN_BZSCOPE_MERGEMULTIPHONON", prevmerge_str.c_str(), 1 );
+    else
+      ::unsetenv( "NCPLUGIN_BZSCOPE_MERGEMULTIPHONON" );
+    for ( double ekin : { 0.001, 0.0253, 0.1, 0.5 * emax, 0.9 * emax, 1.1 * emax,
+                          2.0 * emax, 5.0 * emax, 20.0 * emax } ) {
+      const double xs = sc_separate.crossSectionIsotropic( NC::NeutronEnergy{ ekin } ).dbl();
+      const double xs_merged = sc_factmerged.crossSectionIsotropic( NC::NeutronEnergy{ ekin } ).dbl();
+      NCPLUGIN_MSG("xs("<<ekin<<" eV): "<<xs_merged<<" barn merged, "<<xs
+                   <<" barn with separate VDOS processes (Emax="<<emax<<" eV)");
+      nc_assert_always( NC::ncabs( xs_merged - xs ) <= 0.05 * xs + 1e-6 );
+    }
+
+    //Terms are expanded only when a model is built, while their key follows
+    //the VDOS data and the expansion parameters:
+    nc_assert_always( MultiPhononTerms( *info, 3 ).key() == MultiPhononTerms( *info, 3 ).key() );
+    nc_assert_always( MultiPhononTerms( *info, 3 ).key() != MultiPhononTerms( *info, 4 ).key() );
+
+    //The contributions left out follow the @CUSTOM_UNOFFICIALHACKS section:
+    auto registerWithIgnoreLine = []( const std::string& name, const std::string& replacement )
+    {
+      auto content = registerModifiedShippedFile( name, [&replacement]( const std::string& line )
+      {
+        return ( line == "  vdos2sab_ignorecontrib 1 coherent" ? replacement : line ) + '\n';
+      } );
+      nc_assert_always( content.find( replacement ) != std::string::npos );
+    };
+    registerWithIgnoreLine( "bzscope_test_ignorecontrib.ncmat", "  vdos2sab_ignorecontrib 1" );
+    registerWithIgnoreLine( "bzscope_test_badignorecontrib.ncmat", "  vdos2sab_ignorecontrib 1 both" );
+    nc_assert_always( MultiPhononTerms( *NC::createInfo( "bzscope_test_ignorecontrib.ncmat" ), 3 ).key()
+                      != MultiPhononTerms( *info, 3 ).key() );
+    expectThrows<NC::Error::BadInput>( []()
+    {
+      MultiPhononTerms( *NC::createInfo( "bzscope_test_badignorecontrib.ncmat" ), 3 );
+    } );
+  }
+
+  //Concurrent usage of the same models from several threads, each with their
+  //own cache and random stream, must give the same cross sections as above
+  //and valid scattering events:
+  for ( const PhysicsModel* pm : { &pm_dense, &pm_sparse } ) {
+    const double energies[] = { 0.001, 0.0253, 0.1, 0.5 };
+    double xs_ref[4];
+    for ( unsigned i = 0; i < 4; ++i )
+      xs_ref[i] = pm->calcCrossSection( energies[i] );
+    const unsigned nthreads = 8;
+    std::vector<decltype(rng)> rngs;
+    for ( unsigned ithr = 0; ithr < nthreads; ++ithr )
+      rngs.push_back( rngproducer->produce() );
+    std::vector<unsigned> nbad( nthreads, 0 );
+    std::vector<std::thread> threads;
+    for ( unsigned ithr = 0; ithr < nthreads; ++ithr ) {
+      threads.emplace_back( [pm,&energies,&xs_ref,&rngs,&nbad,ithr]()
+      {
+        NC::CachePtr cache;
+        for ( unsigned i = 0; i < 4000; ++i ) {
+          const unsigned ie = ( i / 10 + ithr ) % 4;
+          if ( pm->calcCrossSection( cache, energies[ie] ) != xs_ref[ie] )
+            ++nbad[ithr];
+          auto evt = pm->sampleScatteringEvent( cache, *rngs[ithr], energies[ie] );
+          if ( !( evt.ekin_final > 0.0 ) || !( NC::ncabs( evt.mu ) <= 1.0 ) )
+            ++nbad[ithr];
+        }
+      } );
+    }
+    for ( auto& t : threads )
+      t.join();
+    for ( auto n : nbad )
+      nc_assert_always( n == 0 );
+  }
+
+  //The counter-based random streams must reproduce the known answers of the
+  //Philox4x32-10 reference implementation:
+  {
+    auto block = PhiloxRNG::philox4x32( { { 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 } },
+                                        { { 0xa4093822, 0x299f31d0 } } );
+    nc_assert_always( block == PhiloxRNG::Block( { { 0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1 } } ) );
+    block = PhiloxRNG::philox4x32( { { 0, 0, 0, 0 } }, { { 0, 0 } } );
+    nc_assert_always( block == PhiloxRNG::Block( { { 0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 } } ) );
+  }
+
+  //Sampling with event IDs must give bitwise identical results for any
+  //number of threads and any split of the events into batches, and agree with
+  //the single event version:
+  for ( const PhysicsModel* pm : { &pm_dense, &pm_sparse } ) {
+    const std::uint64_t seed = 0x5eed;
+    const std::size_t nevents = 5000;
+    std::vector<double> energies;
+    for ( std::size_t i = 0; i < nevents; ++i )
+      energies.push_back( 0.01 * ( i % 7 + 1 ) );
+    std::vector<PhysicsModel::ScatEvent> ref( nevents );
+    {
+      NC::CachePtr cache;
+      pm->sampleScatteringEvents( cache, seed, 1000, energies.data(), nevents, ref.data() );
+    }
+    for ( unsigned nthreads : { 1, 3, 8 } ) {
+      const std::size_t batch = 37 * nthreads;
+      std::vector<PhysicsModel::ScatEvent> res( nevents );
+      parallelFor( nthreads, ( nevents + batch - 1 ) / batch, [&]( std::size_t ib )
+      {
+        NC::CachePtr cache;
+        const std::size_t i0 = ib * batch;
+        pm->sampleScatteringEvents( cache, seed, 1000 + i0, energies.data() + i0,
+                                    NC::ncmin( batch, nevents - i0 ), res.data() + i0 );
+      } );
+      for ( std::size_t i = 0; i < nevents; ++i )
+        nc_assert_always( res[i].ekin_final == ref[i].ekin_final && res[i].mu == ref[i].mu );
+    }
+    NC::CachePtr cache;
+    for ( std::size_t i = nevents; i-- > 0; ) {
+      auto evt = pm->sampleScatteringEvent( cache, seed, 1000 + i, energies[i] );
+      nc_assert_always( evt.ekin_final > 0.0 && NC::ncabs( evt.mu ) <= 1.0 );
+      nc_assert_always( evt.ekin_final == ref[i].ekin_final && evt.mu == ref[i].mu );
+    }
+  }
+
+  //Lazy tables must only be built for the energy band actually sampled (also
+  //when sampling from several threads at once), and give bitwise the same
+  //cross sections and scattering events as tables built up front:
+  {
+    PhysicsModel::Options opts_eager;
+    opts_eager.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+    opts_eager.fastSampling = true;
+    PhysicsModel::Options opts_lazy = opts_eager;
+    opts_lazy.lazyTables = true;
+    auto pm_eager = PhysicsModel::createFromInfo( *info, opts_eager );
+    auto pm_lazy = PhysicsModel::createFromInfo( *info, opts_lazy );
+    auto bins = pm_lazy.kernelModels().front()->samplingTableBins();
+    nc_assert_always( bins.built == 0 && bins.total > 0 );
+    const std::uint64_t seed = 0x1a2e;
+    const std::size_t nevents = 4000;
+    std::vector<double> energies;
+    for ( std::size_t i = 0; i < nevents; ++i )
+      energies.push_back( 0.001 + 0.019 * ( i % 97 ) / 96.0 );
+    std::vector<PhysicsModel::ScatEvent> ref( nevents ), res( nevents );
+    {
+      NC::CachePtr cache;
+      pm_eager.sampleScatteringEvents( cache, seed, 0, energies.data(), nevents, ref.data() );
+    }
+    const std::size_t batch = 100;
+    parallelFor( 8, nevents / batch, [&]( std::size_t ib )
+    {
+      NC::CachePtr cache;
+      pm_lazy.sampleScatteringEvents( cache, seed, ib * batch, energies.data() + ib * batch,
+                                      batch, res.data() + ib * batch );
+    } );
+    for ( std::size_t i = 0; i < nevents; ++i )
+      nc_assert_always( res[i].ekin_final == ref[i].ekin_final && res[i].mu == ref[i].mu );
+    for ( double ekin = 1e-5; ekin < 10.0; ekin *= 1.1 )
+      nc_assert_always( pm_lazy.calcCrossSection( ekin ) == pm_eager.calcCrossSection( ekin ) );
+    bins = pm_lazy.kernelModels().front()->samplingTableBins();
+    NCPLUGIN_MSG("Lazy tables: "<<bins.built<<" of "<<bins.total<<" energy grid points built, memory"
+                 " usage "<<pm_lazy.memoryUsage()*1e-6<<" MB ("<<pm_eager.memoryUsage()*1e-6
+                 <<" MB with all tables)");
+    nc_assert_always( bins.built > 0 && 2 * bins.built < bins.total );
+    nc_assert_always( pm_lazy.memoryUsage() < pm_eager.memoryUsage() );
+  }
+
+  //Kernel models must be built once and shared while in use, also when
+  //requested concurrently:
+  {
+    PhysicsModel::Options opts_sparse;
+    opts_sparse.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+    PhysicsModel pm1( *info, opts_sparse );
+    nc_assert_always( pm1.kernelModels().size() == 1 );
+    nc_assert_always( pm1.kernelModels().front() == pm_sparse.kernelModels().front() );
+    nc_assert_always( pm1.kernelModels().front() != pm_dense.kernelModels().front() );
+    opts_sparse.lazyTables = true;//no effect without fast sampling
+    nc_assert_always( PhysicsModel( *info, opts_sparse ).kernelModels().front()
+                      == pm_sparse.kernelModels().front() );
+    const unsigned nthreads = 8;
+    std::vector<std::shared_ptr<const KernelModel>> results( nthreads );
+    std::vector<std::thread> threads;
+    PhysicsModel::Options opts_other;
+    opts_other.xsTableAccuracy = 2e-3;//not yet built
+    for ( unsigned ithr = 0; ithr < nthreads; ++ithr )
+      threads.emplace_back( [&info,&opts_other,&results,ithr]()
+                            { results[ithr] = PhysicsModel( *info, opts_other ).kernelModels().front(); } );
+    for ( auto& t : threads )
+      t.join();
+    for ( auto& km : results )
+      nc_assert_always( km != nullptr && km == results.front() );
+  }
+
+  //Files with several temperatures. For the test, simply add a copy of the
+  //section with a different temperature before the original (and make the
+  //temperature of the file a default, since NCrystal otherwise rejects other
+  //temperatures):
+  {
+    const std::string sectionStart = "@CUSTOM_" + pluginNameUpperCase();
+    std::string section = sectionStart + '\n';
+    for ( const auto& words : info->getCustomSection( pluginNameUpperCase() ) ) {
+      const bool isTemperature = ( !words.empty() && words.front() == "temperature" );
+      for ( const auto& word : ( isTemperature ? NC::VectS{ "temperature", "350" } : words ) )
+        section += word + ' ';
+      section += '\n';
+    }
+    nc_assert_always( section.find( "temperature 350" ) != std::string::npos );
+    bool inTemperature = false;
+    auto content = registerModifiedShippedFile( "bzscope_test_multitemp.ncmat",
+                                                [&]( const std::string& line ) -> std::string
+    {
+      if ( !line.empty() && line.front() == '@' ) {
+        inTemperature = ( line.compare( 0, 12, "@TEMPERATURE" ) == 0 );
+        if ( line.compare( 0, sectionStart.size(), sectionStart ) == 0 )
+          return section + line + '\n';
+      } else if ( inTemperature && line.find_first_not_of( " \t" ) != std::string::npos ) {
+        nc_assert_always( line.find( "default" ) == std::string::npos );
+        return "  default " + line.substr( line.find_first_not_of( " \t" ) ) + '\n';
+      }
+      return line + '\n';
+    } );
+    nc_assert_always( content.find( "  default 300" ) != std::string::npos );
+
+    auto info300 = NC::createInfo( "bzscope_test_multitemp.ncmat;temp=300K" );
+    auto info350 = NC::createInfo( "bzscope_test_multitemp.ncmat;temp=350K" );
+    auto info325 = NC::createInfo( "bzscope_test_multitemp.ncmat;temp=325K" );
+    PhysicsModel pm300( *info300, opts_dflt );
+    PhysicsModel pm350( *info350, opts_dflt );
+    PhysicsModel pm325( *info325, opts_dflt );
+    nc_assert_always( pm300.kernelModels().size() == 1 && pm350.kernelModels().size() == 1 );
+    nc_assert_always( pm325.kernelModels().size() == 2 );
+    nc_assert_always( pm325.kernelModels().front() == pm300.kernelModels().front() );
+    nc_assert_always( pm325.kernelModels().back() == pm350.kernelModels().front() );
+    for ( double ekin : { 0.001, 0.0253, 0.1 } ) {
+      const double xs300 = pm300.calcCrossSection( ekin );
+      const double xs350 = pm350.calcCrossSection( ekin );
+      const double xs325 = pm325.calcCrossSection( ekin );
+      nc_assert_always( NC::ncabs( xs325 - 0.5 * ( xs300 + xs350 ) ) <= 1e-12 * xs325 );
+    }
+    //NCrystal accepts the temperature, while the plugin must reject it:
+    auto info400 = NC::createInfo( "bzscope_test_multitemp.ncmat;temp=400K" );
+    const auto msg = expectThrows<NC::Error::BadInput>( [&]() { PhysicsModel( *info400, opts_dflt ); } );
+    nc_assert_always( msg.find( "is outside the range" ) != std::string::npos );
+  }
 
+  //A section referring to a binary kernel file must give the same cross
+  //sections as the text section the file was written from, while the Info
+  //only keeps a single line of the section. Relative names are found next to
+  //the NCMAT file (which is not in the working directory here), and corrupt
+  //files must be rejected:
+  {
+    char dirtemplate[] = "/tmp/ncplugin_bzscope_kernelfileXXXXXX";
+    nc_assert_always( ::mkdtemp( dirtemplate ) != nullptr );
+    const std::string dir = dirtemplate;
+    const std::string kernelfile = dir + "/beo_300K.bzk";
+    KernelFile::write( kernelfile, parseCustomSection( info->getCustomSection( pluginNameUpperCase() ) ) );
+    auto withKernelFile = []( const std::string& name ) -> LineTransform
+    {
+      return [name,inSection=false]( const std::string& line ) mutable -> std::string
+      {
+        const std::string sectionStart = "@CUSTOM_" + pluginNameUpperCase();
+        if ( !line.empty() && line.front() == '@' ) {
+          inSection = ( line.compare( 0, sectionStart.size(), sectionStart ) == 0 );
+          if ( inSection )
+            return line + "\n  kernelfile " + name + '\n';
+        }
+        return inSection ? std::string() : line + '\n';
+      };
+    };
+    registerModifiedShippedFile( "bzscope_test_kernelfile.ncmat", withKernelFile( kernelfile ) );
+    auto info_kf = NC::createInfo( "bzscope_test_kernelfile.ncmat" );
+    nc_assert_always( info_kf->getCustomSection( pluginNameUpperCase() ).size() == 1 );
+    const std::string relfile = dir + "/beo_relative.ncmat";
+    {
+      std::ofstream fh( relfile );
+      fh << modifiedShippedFile( withKernelFile( "beo_300K.bzk" ) );
+    }
+    auto info_rel = NC::createInfo( relfile );
+    PhysicsModel::Options opts_kf;
+    opts_kf.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+    for ( const NC::Info * inf : { &*info_kf, &*info_rel } ) {
+      auto pm_kf = PhysicsModel::createFromInfo( *inf, opts_kf );
+      for ( double ekin : { 1e-4, 0.001, 0.0253, 0.1, 0.5 } ) {
+        const double xs = pm_sparse.calcCrossSection( ekin );
+        nc_assert_always( NC::ncabs( pm_kf.calcCrossSection( ekin ) - xs ) <= 1e-12 * xs );
+      }
+    }
+    {
+      std::fstream fh( kernelfile, std::ios::binary | std::ios::in | std::ios::out );
+      fh.seekp( -8, std::ios::end );
+      const double value = 1.0;
+      fh.write( reinterpret_cast<const char*>( &value ), sizeof(value) );
+    }
+    expectThrows<NC::Error::DataLoadError>( [&]() { PhysicsModel::createFromInfo( *info_kf, opts_kf ); } );
+    std::filesystem::remove_all( dir );
+    expectThrows<NC::Error::BadInput>( []() { KernelFile( "plugins::BzScope/bzscope_does_not_exist.bzk" ); } );
+  }
 
-  // //Note: We do not test the scattering here for this simple dummy plugin.
+  {
+    //Instrumentation counts calls and records the construction phases of new
+    //models (the accuracy is chosen to avoid reusing an existing model):
+    const bool wasEnabled = instrumentationEnabled();
+    setInstrumentationEnabled( true );
+    resetInstrumentation();
+    PhysicsModel::Options opts_instr;
+    opts_instr.kernelMode = PhysicsModel::Options::KernelMode::Sparse;
+    opts_instr.xsTableAccuracy = 4e-3;
+    PhysicsModel pm( *info, opts_instr );
+    double xs[10];
+    const double ekins[10] = { 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0 };
+    NC::CachePtr cache;
+    pm.calcCrossSections( cache, ekins, 10, xs );
+    for ( int i = 0; i < 5; ++i ) {
+      pm.calcCrossSection( 0.0253 );
+      pm.sampleScatteringEvent( *rng, 0.0253 );
+    }
+    //Sampling right after a cross section evaluation at the same energy (with
+    //the same cache) reuses the energy grid lookup:
+    for ( int i = 0; i < 5; ++i ) {
+      const double ekin = 0.02 + 0.001 * i;
+      const double xs_cached = pm.calcCrossSection( cache, ekin );
+      nc_assert_always( xs_cached == pm.calcCrossSection( ekin ) );
+      pm.sampleScatteringEvent( cache, *rng, ekin );
+    }
+    auto report = getInstrumentationReport();
+    nc_assert_always( report.count( Counter::XSCalls ) == 25 );
+    nc_assert_always( report.count( Counter::SampleCalls ) == 10 );
+    nc_assert_always( report.count( Counter::CachedLookups ) == 5 );
+    nc_assert_always( report.kernelMemory > 0 && report.tableMemory > 0 );
+    auto hasPhase = [&report]( const char * name )
+    {
+      for ( const auto& p : report.phases )
+        if ( p.name == name && p.count == 1 && p.seconds >= 0.0 )
+          return true;
+      return false;
+    };
+    nc_assert_always( hasPhase( "build sparse kernel" ) && hasPhase( "build sparse tables" ) );
+    //Nothing is recorded while disabled:
+    setInstrumentationEnabled( false );
+    pm.calcCrossSection( 0.0253 );
+    nc_assert_always( getInstrumentationReport().count( Counter::XSCalls ) == 25 );
+    setInstrumentationEnabled( wasEnabled );
+  }
 
   NCPLUGIN_MSG("All tests of plugin were successful!");
 }
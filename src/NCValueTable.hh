@@ -0,0 +1,142 @@
+#ifndef NCPlugin_ValueTable_hh
+#define NCPlugin_ValueTable_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+
+namespace NCPluginNamespace {
+
+  //Array of table entries, which either owns its entries or refers to
+  //read-only entries owned by something else (e.g. a file mapped into memory
+  //by SharedTables), with a handle keeping that owner alive. Only arrays owning
+  //their entries can be modified, and only those entries count towards the
+  //memory usage:
+  template<class T>
+  class TableArray final : public NC::MoveOnly {
+  public:
+
+    TableArray() = default;
+    explicit TableArray( std::vector<T>&& entries )
+      : m_owned( std::move(entries) ), m_data( m_owned.data() ), m_size( m_owned.size() ) {}
+    TableArray( const T * entries, std::size_t n, std::shared_ptr<const void> owner )
+      : m_owner( std::move(owner) ), m_data( entries ), m_size( n ) {}
+    TableArray( TableArray&& o ) { *this = std::move(o); }
+    TableArray& operator=( TableArray&& o )
+    {
+      m_owned = std::move( o.m_owned );
+      m_owner = std::move( o.m_owner );
+      m_data = ( m_owner ? o.m_data : m_owned.data() );
+      m_size = o.m_size;
+      o.m_data = nullptr;
+      o.m_size = 0;
+      return *this;
+    }
+
+    std::size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    bool shared() const { return m_owner != nullptr; }
+    const T * data() const { return m_data; }
+    const T& operator[]( std::size_t i ) const { return m_data[i]; }
+    T * mutableData() { nc_assert( !shared() ); return m_owned.data(); }
+
+    std::size_t memoryUsage() const { return sizeof(T) * m_owned.capacity(); }
+
+  private:
+    std::vector<T> m_owned;
+    std::shared_ptr<const void> m_owner;
+    const T * m_data = nullptr;
+    std::size_t m_size = 0;
+  };
+
+
+  //Large table of values, stored in either double or single precision (see
+  //the singlePrecision option in NCPhysicsModel.hh). Arithmetic on the values
+  //is always done in double precision. Code reading the values is written as a
+  //generic lambda taking a pointer to the stored type, and called through
+  //visit(), so the storage type is only checked once per call rather than for
+  //every value:
+  //
+  //   double sum = table.visit( [&]( auto values ) { return values[0] + values[1]; } );
+  //
+  //Values can be written concurrently from several threads, as long as each
+  //element is only written by one of them (and the table owns its values, see
+  //TableArray).
+
+  class ValueTable final : public NC::MoveOnly {
+  public:
+
+    ValueTable() = default;
+    ValueTable( std::size_t n, bool single_precision )
+      : m_singlePrecision( single_precision )
+    {
+      if ( single_precision )
+        m_single = TableArray<float>( std::vector<float>( n, 0.0f ) );
+      else
+        m_double = TableArray<double>( NC::VectD( n, 0.0 ) );
+    }
+    ValueTable( NC::VectD&& values, bool single_precision )
+      : m_singlePrecision( single_precision )
+    {
+      if ( single_precision )
+        m_single = TableArray<float>( std::vector<float>( values.begin(), values.end() ) );
+      else
+        m_double = TableArray<double>( std::move(values) );
+    }
+    explicit ValueTable( TableArray<double>&& values ) : m_double( std::move(values) ) {}
+    explicit ValueTable( TableArray<float>&& values )
+      : m_single( std::move(values) ), m_singlePrecision( true ) {}
+
+    bool singlePrecision() const { return m_singlePrecision; }
+    std::size_t size() const { return m_singlePrecision ? m_single.size() : m_double.size(); }
+    bool empty() const { return size() == 0; }
+
+    void set( std::size_t i, double value )
+    {
+      if ( m_singlePrecision )
+        m_single.mutableData()[i] = static_cast<float>( value );
+      else
+        m_double.mutableData()[i] = value;
+    }
+    double get( std::size_t i ) const
+    {
+      return m_singlePrecision ? static_cast<double>( m_single[i] ) : m_double[i];
+    }
+
+    template<class TFct>
+    auto visit( TFct&& fct ) const
+    {
+      return m_singlePrecision ? fct( m_single.data() ) : fct( m_double.data() );
+    }
+
+    //Direct access, for code already specialised for the storage type (e.g.
+    //inside a visit() of another table with the same precision). TValue must
+    //be the stored type:
+    template<class TValue> const TValue * data() const;
+
+    std::size_t memoryUsage() const//excluding sizeof(ValueTable)
+    {
+      return m_double.memoryUsage() + m_single.memoryUsage();
+    }
+
+  private:
+    TableArray<double> m_double;
+    TableArray<float> m_single;
+    bool m_singlePrecision = false;
+  };
+
+  template<> inline const double * ValueTable::data<double>() const
+  {
+    nc_assert( !singlePrecision() );
+    return m_double.data();
+  }
+
+  template<> inline const float * ValueTable::data<float>() const
+  {
+    nc_assert( singlePrecision() );
+    return m_single.data();
+  }
+
+}
+
+#endif
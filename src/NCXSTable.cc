@@ -0,0 +1,156 @@
+#include "NCXSTable.hh"
+#include "NCParallel.hh"
+#include <cmath>
+
+namespace NCPluginNamespace {
+  namespace {
+
+    constexpr double initialPointsPerDecade = 20.0;
+
+    //Relative deviation, with an absolute floor (relative to the largest cross
+    //section) to avoid spurious failures where the cross section vanishes:
+    inline double relDev( double xs, double xs_exact, double xs_floor )
+    {
+      return NC::ncabs( xs - xs_exact ) / NC::ncmax( NC::ncabs( xs_exact ), xs_floor );
+    }
+
+  }
+}
+
+NCP::RefinedGrid NCP::refineLogGrid( const XSFct& exact_xs, double emin, double emax,
+                                     double accuracy, std::size_t nbins, std::size_t maxbins,
+                                     unsigned nthreads )
+{
+  nc_assert_always( emin > 0.0 && emax > emin && nbins > 0 );
+  const double logemin = std::log( emin );
+  const double logrange = std::log( emax ) - logemin;
+
+  //Initial grid:
+  RefinedGrid res;
+  res.egrid.resize( nbins + 1 );
+  res.xs.resize( nbins + 1 );
+  res.accuracy = 0.0;
+  parallelFor( nthreads, nbins + 1, [&]( std::size_t i )
+  {
+    res.egrid[i] = ( i == 0 ? emin : ( i == nbins ? emax : std::exp( logemin + logrange * i / nbins ) ) );
+    res.xs[i] = exact_xs( res.egrid[i] );
+  } );
+  if ( !( accuracy > 0.0 ) )
+    return res;
+
+  //Refine by inserting the bin midpoints (in log(E)), which are then also the
+  //points at which the interpolation of the previous grid is checked:
+  while ( true ) {
+    NC::VectD egrid( 2 * nbins + 1 );
+    NC::VectD xs( 2 * nbins + 1 );
+    double xsmax = 0.0;
+    for ( auto x : res.xs )
+      xsmax = NC::ncmax( xsmax, x );
+    const double xs_floor = 1e-9 * xsmax;
+    parallelFor( nthreads, nbins, [&]( std::size_t i )
+    {
+      egrid[2*i+1] = std::exp( logemin + logrange * ( 2 * i + 1 ) / ( 2 * nbins ) );
+      xs[2*i+1] = exact_xs( egrid[2*i+1] );
+    } );
+    double worst = 0.0;
+    for ( std::size_t i = 0; i < nbins; ++i ) {
+      const double emid = egrid[2*i+1];
+      const double t = ( emid - res.egrid[i] ) / ( res.egrid[i+1] - res.egrid[i] );
+      worst = NC::ncmax( worst, relDev( res.xs[i] + t * ( res.xs[i+1] - res.xs[i] ), xs[2*i+1], xs_floor ) );
+      egrid[2*i] = res.egrid[i];
+      xs[2*i] = res.xs[i];
+    }
+    egrid.back() = res.egrid.back();
+    xs.back() = res.xs.back();
+    res.accuracy = worst;
+    if ( worst <= accuracy || 2 * nbins > maxbins )
+      break;
+    //Not good enough, continue with the refined grid:
+    res.egrid.swap( egrid );
+    res.xs.swap( xs );
+    nbins *= 2;
+  }
+  return res;
+}
+
+double NCP::maxRelativeDeviation( const XSFct& xs, const XSFct& exact_xs, double emin, double emax,
+                                  std::size_t npoints, unsigned nthreads )
+{
+  //Golden ratio sequence, giving points spread evenly in log(E) but with no
+  //particular alignment with any grid:
+  const double logemin = std::log( emin );
+  const double logrange = std::log( emax ) - logemin;
+  NC::VectD values( npoints ), exact( npoints );
+  parallelFor( nthreads, npoints, [&]( std::size_t i )
+  {
+    double u = 0.5 + 0.6180339887498949 * ( i + 1 );
+    u -= std::floor( u );
+    const double e = NC::ncclamp( std::exp( logemin + u * logrange ), emin, emax );
+    values[i] = xs( e );
+    exact[i] = exact_xs( e );
+  } );
+  double xsmax = 0.0;
+  for ( auto x : exact )
+    xsmax = NC::ncmax( xsmax, x );
+  const double xs_floor = 1e-9 * xsmax;
+  double worst = 0.0;
+  for ( std::size_t i = 0; i < npoints; ++i )
+    worst = NC::ncmax( worst, relDev( values[i], exact[i], xs_floor ) );
+  return worst;
+}
+
+NCP::XSTable::XSTable( const XSFct& exact_xs, double emin, double emax, double accuracy,
+                       unsigned nthreads, std::size_t max_memory )
+  : m_logEmin( std::log( emin ) )
+{
+  if ( !( emin > 0.0 ) || !( emax > emin ) )
+    NCRYSTAL_THROW2(BadInput,"XSTable: invalid energy range ["<<emin<<","<<emax<<"]");
+  if ( !( accuracy > 0.0 ) )
+    NCRYSTAL_THROW2(BadInput,"XSTable: invalid accuracy "<<accuracy);
+
+  const double logrange = std::log( emax ) - m_logEmin;
+  const double ndecades = logrange / std::log( 10.0 );
+  std::size_t nbins = static_cast<std::size_t>( std::ceil( ndecades * initialPointsPerDecade ) );
+  std::size_t maxbins = static_cast<std::size_t>( std::ceil( ndecades * maxPointsPerDecade ) );
+  if ( max_memory ) {
+    const std::size_t perpoint = 2 * sizeof(double);
+    if ( max_memory < sizeof(XSTable) + ( nbins + 1 ) * perpoint )
+      NCRYSTAL_THROW2(BadInput,"XSTable: memory limit of "<<max_memory<<" bytes is too small");
+    maxbins = NC::ncmin( maxbins, ( max_memory - sizeof(XSTable) ) / perpoint - 1 );
+  }
+
+  auto grid = refineLogGrid( exact_xs, emin, emax, accuracy, nbins, maxbins, nthreads );
+  m_egrid = std::move( grid.egrid );
+  m_xs = std::move( grid.xs );
+  m_accuracy = grid.accuracy;
+  m_invDLogE = ( m_egrid.size() - 1 ) / logrange;
+  m_egrid.shrink_to_fit();
+  m_xs.shrink_to_fit();
+}
+
+void NCP::XSTable::lookupMany( const double * ekin, std::size_t n, double * out ) const
+{
+  const double * egrid = m_egrid.data();
+  const double * xs = m_xs.data();
+  const double e0 = emin();
+  const double e1 = emax();
+  const double xmax = static_cast<double>( m_egrid.size() - 2 );
+  for ( std::size_t k = 0; k < n; ++k ) {
+    const double e = NC::ncclamp( ekin[k], e0, e1 );
+    const double x = ( std::log( e ) - m_logEmin ) * m_invDLogE;
+    const std::size_t i = static_cast<std::size_t>( NC::ncclamp( x, 0.0, xmax ) );
+    const double t = ( e - egrid[i] ) / ( egrid[i+1] - egrid[i] );
+    out[k] = xs[i] + t * ( xs[i+1] - xs[i] );
+  }
+}
+
+double NCP::XSTable::selfCheck( const XSFct& exact_xs, std::size_t npoints ) const
+{
+  return maxRelativeDeviation( [this]( double e ) { return lookup( e ); },
+                               exact_xs, emin(), emax(), npoints );
+}
+
+std::size_t NCP::XSTable::memoryUsage() const
+{
+  return sizeof(*this) + sizeof(double) * ( m_egrid.capacity() + m_xs.capacity() );
+}
@@ -0,0 +1,97 @@
+#ifndef NCPlugin_XSTable_hh
+#define NCPlugin_XSTable_hh
+
+#include "NCrystal/NCPluginBoilerplate.hh"//Common stuff (includes NCrystal
+                                          //public API headers, sets up
+                                          //namespaces and aliases)
+#include <cmath>
+#include <functional>
+
+namespace NCPluginNamespace {
+
+  using XSFct = std::function<double(double)>;
+
+  //Log-uniform energy grid in [emin,emax], starting with nbins bins and with
+  //the number of bins doubled until linear interpolation of the cross sections
+  //reproduces exact_xs at all bin midpoints (in log(E)) to within the relative
+  //accuracy, or until the next refinement would exceed maxbins. The midpoints
+  //checked become the new grid points, so exact_xs is called once per point of
+  //the final grid (plus once per midpoint of the last check), concurrently
+  //from nthreads threads. With accuracy 0, the initial grid is returned without
+  //any check (and with accuracy 0):
+  struct RefinedGrid {
+    NC::VectD egrid, xs;
+    double accuracy;//largest deviation found in the last check
+  };
+  RefinedGrid refineLogGrid( const XSFct& exact_xs, double emin, double emax,
+                             double accuracy, std::size_t nbins, std::size_t maxbins,
+                             unsigned nthreads = 1 );
+
+  //Largest relative deviation between interpolated and exact cross sections,
+  //evaluated at npoints energies spread out evenly in log(E) over [emin,emax],
+  //but not aligned with any grid (concurrently from nthreads threads):
+  double maxRelativeDeviation( const XSFct& xs, const XSFct& exact_xs, double emin, double emax,
+                               std::size_t npoints, unsigned nthreads = 1 );
+
+  //Cross sections tabulated on a log-uniform energy grid in [emin,emax], for
+  //lookups in constant time (the grid bin is found by index arithmetic, and
+  //the cross section interpolated linearly within it).
+  //
+  //The grid density is chosen at construction by refineLogGrid, starting from
+  //a coarse grid and refining it until the requested relative accuracy is
+  //reached (or until maxPointsPerDecade is reached, or the next refinement
+  //would make memoryUsage() exceed max_memory, if non-zero).
+
+  class XSTable final : public NC::MoveOnly {
+  public:
+
+    static constexpr double maxPointsPerDecade = 10240.0;
+
+    //The exact_xs function is evaluated concurrently from nthreads threads, and
+    //must be thread-safe if nthreads>1 (the result does not depend on the
+    //number of threads):
+    XSTable( const XSFct& exact_xs, double emin, double emax, double accuracy,
+             unsigned nthreads = 1, std::size_t max_memory = 0 );
+
+    double emin() const { return m_egrid.front(); }
+    double emax() const { return m_egrid.back(); }
+    bool inRange( double ekin ) const { return ekin >= emin() && ekin <= emax(); }
+
+    //Lookup of ekin in [emin,emax]:
+    double lookup( double ekin ) const
+    {
+      const std::size_t i = bin( ekin );
+      const double t = ( ekin - m_egrid[i] ) / ( m_egrid[i+1] - m_egrid[i] );
+      return m_xs[i] + t * ( m_xs[i+1] - m_xs[i] );
+    }
+
+    //Lookup of n energies, with those outside [emin,emax] treated as the
+    //nearest edge (vectorisable loop):
+    void lookupMany( const double * ekin, std::size_t n, double * out_xs ) const;
+
+    //Largest relative deviation between the table and exact_xs (see
+    //maxRelativeDeviation), at points which unlike those used during
+    //construction are not aligned with the bins:
+    double selfCheck( const XSFct& exact_xs, std::size_t npoints = 10000 ) const;
+
+    std::size_t size() const { return m_egrid.size(); }
+    double accuracy() const { return m_accuracy; }//achieved at construction
+    std::size_t memoryUsage() const;
+
+  private:
+    NC::VectD m_egrid;
+    NC::VectD m_xs;
+    double m_logEmin;
+    double m_invDLogE;
+    double m_accuracy;
+
+    std::size_t bin( double ekin ) const
+    {
+      const double x = ( std::log( ekin ) - m_logEmin ) * m_invDLogE;
+      return static_cast<std::size_t>( NC::ncclamp( x, 0.0, static_cast<double>( m_egrid.size() - 2 ) ) );
+    }
+  };
+
+}
+
+#endif
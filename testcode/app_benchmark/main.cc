@@ -0,0 +1,241 @@
+#include "NCKernelFile.hh"
+#include "NCKernelParser.hh"
+#include "NCPhysicsModel.hh"
+#include <sys/resource.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Benchmark of the plugin, reporting for each input file and kernel mode:
+//
+//   * parse time of the @CUSTOM_BZSCOPE section
+//   * model build time (including parsing, unless NCPLUGIN_BZSCOPE_CACHEDIR
+//     provides a cached kernel) and memory footprint of the tables
+//   * cross section evaluations and sampled scattering events per second, at
+//     a range of neutron energies
+//   * combined throughput for 1,2,4,... threads sharing the same model
+//   * peak resident set size of the process after each step
+//
+// Results are written as JSON to stdout or to the file given with -o, for easy
+// comparisons between plugin versions.
+//
+// Usage: ncplugin_benchmark [-o out.json] [-t maxthreads] [file1.ncmat ...]
+//
+// Without file arguments, the data files shipped with the plugin are used.
+
+namespace {
+
+  using Clock = std::chrono::steady_clock;
+
+  double secondsSince( Clock::time_point t0 )
+  {
+    return std::chrono::duration<double>( Clock::now() - t0 ).count();
+  }
+
+  double peakRSSMB()
+  {
+    struct rusage usage;
+    if ( getrusage( RUSAGE_SELF, &usage ) != 0 )
+      return -1.0;
+    return usage.ru_maxrss / 1024.0;//kilobytes on Linux
+  }
+
+  //Calls fct repeatedly until at least mintime seconds have passed, and
+  //returns the number of calls per second:
+  double callsPerSecond( const std::function<void()>& fct, double mintime = 0.2 )
+  {
+    unsigned long ncalls = 0;
+    unsigned long nbatch = 100;
+    auto t0 = Clock::now();
+    double elapsed;
+    while ( true ) {
+      for ( unsigned long i = 0; i < nbatch; ++i )
+        fct();
+      ncalls += nbatch;
+      elapsed = secondsSince( t0 );
+      if ( elapsed >= mintime )
+        break;
+      nbatch *= 2;
+    }
+    return ncalls / elapsed;
+  }
+
+  //Events (one cross section evaluation and one sampled scattering) per
+  //second, for nthreads threads each doing nevents events:
+  double threadedThroughput( const NCP::PhysicsModel& pm, unsigned nthreads,
+                             unsigned long nevents )
+  {
+    auto rngproducer = NC::getDefaultRNGProducer();
+    std::vector<decltype(rngproducer->produce())> rngs;
+    for ( unsigned i = 0; i < nthreads; ++i )
+      rngs.push_back( rngproducer->produce() );
+    auto t0 = Clock::now();
+    std::vector<std::thread> threads;
+    for ( unsigned ithr = 0; ithr < nthreads; ++ithr ) {
+      threads.emplace_back( [&pm,&rngs,ithr,nevents]()
+      {
+        NC::CachePtr cache;
+        const double energies[] = { 0.001, 0.01, 0.0253, 0.05, 0.1, 0.5 };
+        for ( unsigned long i = 0; i < nevents; ++i ) {
+          const double ekin = energies[ ( i / 16 ) % 6 ];
+          pm.calcCrossSection( cache, ekin );
+          pm.sampleScatteringEvent( cache, *rngs[ithr], ekin );
+        }
+      } );
+    }
+    for ( auto& t : threads )
+      t.join();
+    return nthreads * nevents / secondsSince( t0 );
+  }
+
+  //Minimal JSON output helper:
+  class JSONWriter {
+  public:
+    JSONWriter( std::FILE * f ) : m_f(f) {}
+    void beginObject( const char * key = nullptr ) { sep(); name(key); std::fputs( "{", m_f ); m_first = true; }
+    void endObject() { std::fputs( "}", m_f ); m_first = false; }
+    void beginArray( const char * key = nullptr ) { sep(); name(key); std::fputs( "[", m_f ); m_first = true; }
+    void endArray() { std::fputs( "]", m_f ); m_first = false; }
+    void value( const char * key, double v ) { sep(); name(key); std::fprintf( m_f, "%.6g", v ); }
+    void value( const char * key, const std::string& v ) { sep(); name(key); quoted( v.c_str() ); }
+  private:
+    std::FILE * m_f;
+    bool m_first = true;
+    void sep() { if ( !m_first ) std::fputs( ",", m_f ); m_first = false; }
+    void name( const char * key ) { if ( key ) { quoted( key ); std::fputs( ":", m_f ); } }
+    void quoted( const char * s )
+    {
+      std::fputc( '"', m_f );
+      for ( ; *s; ++s ) {
+        const unsigned char c = static_cast<unsigned char>( *s );
+        if ( c == '"' || c == '\\' )
+          std::fprintf( m_f, "\\%c", c );
+        else if ( c < 0x20 )
+          std::fprintf( m_f, "\\u%04x", c );
+        else
+          std::fputc( c, m_f );
+      }
+      std::fputc( '"', m_f );
+    }
+  };
+
+}
+
+int main( int argc, char** argv )
+{
+  NC::libClashDetect();
+
+  std::vector<std::string> files;
+  const char * outfile = nullptr;
+  unsigned maxthreads = NC::ncmax( 1u, std::thread::hardware_concurrency() );
+  for ( int i = 1; i < argc; ++i ) {
+    if ( std::strcmp( argv[i], "-o" ) == 0 && i + 1 < argc ) {
+      outfile = argv[++i];
+    } else if ( std::strcmp( argv[i], "-t" ) == 0 && i + 1 < argc ) {
+      maxthreads = static_cast<unsigned>( NC::ncmax( 1, std::atoi( argv[++i] ) ) );
+    } else {
+      files.emplace_back( argv[i] );
+    }
+  }
+  if ( files.empty() )
+    files = NCP::pluginDataFiles();
+  if ( files.empty() ) {
+    std::fprintf( stderr, "No input files given, and no data files found in the"
+                  " data directory of the plugin\n" );
+    return 1;
+  }
+
+  std::FILE * f = outfile ? std::fopen( outfile, "w" ) : stdout;
+  if ( !f ) {
+    std::fprintf( stderr, "Could not open %s for writing\n", outfile );
+    return 1;
+  }
+
+  const double energies[] = { 1e-4, 0.001, 0.01, 0.0253, 0.1, 0.5, 1.0 };
+  auto rng = NC::getDefaultRNGProducer()->produce();
+
+  JSONWriter json( f );
+  json.beginObject();
+  json.value( "plugin", std::string( NCP::pluginName() ) );
+  json.value( "hardware_threads", std::thread::hardware_concurrency() );
+  json.beginArray( "results" );
+  for ( const auto& fn : files ) {
+    auto info = NC::createInfo( fn );
+    const auto& raw = info->getCustomSection( NCP::pluginNameUpperCase() );
+    auto t0 = Clock::now();
+    auto knl = NCP::parseCustomSection( raw );
+    const double parse_ms = 1e3 * secondsSince( t0 );
+
+    for ( auto mode : { NCP::PhysicsModel::Options::KernelMode::Dense,
+                        NCP::PhysicsModel::Options::KernelMode::Sparse } ) {
+      auto opts = NCP::PhysicsModel::Options::fromEnvironment();
+      opts.kernelMode = mode;
+      const bool sparse = ( mode == NCP::PhysicsModel::Options::KernelMode::Sparse );
+      std::fprintf( stderr, "Benchmarking %s (%s mode)\n", fn.c_str(), sparse ? "sparse" : "dense" );
+
+      t0 = Clock::now();
+      NCP::PhysicsModel pm( *info, opts );
+      const double build_ms = 1e3 * secondsSince( t0 );
+
+      json.beginObject();
+      json.value( "file", fn );
+      json.value( "mode", std::string( sparse ? "sparse" : "dense" ) );
+      json.value( "kernel_values", knl.sab.size() );
+      json.value( "parse_ms", parse_ms );
+      json.value( "build_ms", build_ms );
+      json.value( "build_threads", opts.nThreads );
+      json.value( "fast_sampling", opts.fastSampling ? 1.0 : 0.0 );
+      json.value( "grid_density", opts.gridDensity );
+      json.value( "memory_budget_mb", opts.memoryBudgetMB );
+      json.value( "single_precision", opts.singlePrecision ? 1.0 : 0.0 );
+      json.value( "table_memory_mb", pm.memoryUsage() * 1e-6 );
+      json.value( "peak_rss_mb_after_build", peakRSSMB() );
+
+      json.beginArray( "per_energy" );
+      NC::CachePtr cache;
+      for ( double ekin : energies ) {
+        double sink = 0.0;
+        const double xs_per_s = callsPerSecond( [&](){ sink += pm.calcCrossSection( cache, ekin ); } );
+        const double samples_per_s = callsPerSecond( [&]()
+                                                     { sink += pm.sampleScatteringEvent( cache, *rng, ekin ).mu; } );
+        json.beginObject();
+        json.value( "ekin_ev", ekin );
+        json.value( "xs_barn", pm.calcCrossSection( cache, ekin ) );
+        json.value( "xs_per_s", xs_per_s );
+        json.value( "samples_per_s", samples_per_s );
+        json.value( "checksum", sink );//prevents the calls from being optimised away
+        json.endObject();
+      }
+      json.endArray();
+
+      json.beginArray( "thread_scaling" );
+      double throughput_1thread = 0.0;
+      for ( unsigned nthreads = 1; ; nthreads = NC::ncmin( 2 * nthreads, maxthreads ) ) {
+        const double throughput = threadedThroughput( pm, nthreads, 20000 );
+        if ( nthreads == 1 )
+          throughput_1thread = throughput;
+        json.beginObject();
+        json.value( "threads", nthreads );
+        json.value( "events_per_s", throughput );
+        json.value( "efficiency", throughput / ( nthreads * throughput_1thread ) );
+        json.endObject();
+        if ( nthreads == maxthreads )
+          break;
+      }
+      json.endArray();
+      json.value( "peak_rss_mb", peakRSSMB() );
+      json.endObject();
+    }
+  }
+  json.endArray();
+  json.endObject();
+  std::fputs( "\n", f );
+  if ( outfile )
+    std::fclose( f );
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include "NCPhysicsModel.hh"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Multi-threaded stress test of NCP::PhysicsModel. A single model instance is
+// shared by all threads, each of which uses its own random stream and
+// NC::CachePtr, and the throughput (cross section evaluations plus sampled
+// scattering events per second) is measured for an increasing number of
+// threads. The results of each thread are also checked for sanity.
+//
+// Usage: ncplugin_mtstress [dense|sparse] [file.ncmat] [maxthreads]
+//
+// Defaults are dense mode, the BeO file shipped with the plugin, and
+// max(32,hardware_concurrency) threads.
+
+namespace {
+
+  struct ThreadResult {
+    unsigned long nevents = 0;
+    unsigned long nbad = 0;
+  };
+
+  void runThread( const NCP::PhysicsModel& pm, NC::RNG& rng,
+                  unsigned long nevents, ThreadResult& result )
+  {
+    NC::CachePtr cache;
+    const double energies[] = { 0.001, 0.01, 0.0253, 0.05, 0.1, 0.5 };
+    const std::size_t nenergies = sizeof(energies) / sizeof(energies[0]);
+    for ( unsigned long i = 0; i < nevents; ++i ) {
+      //Several events at each energy, as in a typical transport application
+      //where a neutron undergoes a series of interactions:
+      const double ekin = energies[ ( i / 16 ) % nenergies ];
+      const double xs = pm.calcCrossSection( cache, ekin );
+      auto evt = pm.sampleScatteringEvent( cache, rng, ekin );
+      if ( !( xs > 0.0 ) || !( evt.ekin_final > 0.0 ) || !( evt.mu >= -1.0 && evt.mu <= 1.0 ) )
+        ++result.nbad;
+    }
+    result.nevents = nevents;
+  }
+
+}
+
+int main( int argc, char** argv )
+{
+  NC::libClashDetect();
+
+  NCP::PhysicsModel::Options opts;
+  std::string mode = ( argc > 1 ? argv[1] : "dense" );
+  if ( mode == "sparse" ) {
+    opts.kernelMode = NCP::PhysicsModel::Options::KernelMode::Sparse;
+  } else if ( mode != "dense" ) {
+    std::printf( "Invalid mode: %s\n", mode.c_str() );
+    return 1;
+  }
+  const std::string fn = ( argc > 2 ? argv[2] : "plugins::BzScope/bzscope_beo_c1_300K.ncmat" );
+  unsigned maxthreads = std::max<unsigned>( 32, std::thread::hardware_concurrency() );
+  if ( argc > 3 )
+    maxthreads = std::max( 1, std::atoi( argv[3] ) );
+
+  auto info = NC::createInfo( fn );
+  auto pm = NCP::PhysicsModel::createFromInfo( *info, opts );
+
+  const unsigned long nevents_per_thread = 20000;
+  auto rngproducer = NC::getDefaultRNGProducer();
+
+  std::printf( "Model: %s (%s mode), %lu events per thread, %u hardware threads\n",
+               fn.c_str(), mode.c_str(), nevents_per_thread,
+               std::thread::hardware_concurrency() );
+  double throughput_1thread = 0.0;
+  unsigned nthreads = 1;
+  while ( true ) {
+    std::vector<ThreadResult> results( nthreads );
+    std::vector<decltype(rngproducer->produce())> rngs;
+    for ( unsigned i = 0; i < nthreads; ++i )
+      rngs.push_back( rngproducer->produce() );
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for ( unsigned i = 0; i < nthreads; ++i )
+      threads.emplace_back( runThread, std::cref( pm ), std::ref( *rngs[i] ),
+                            nevents_per_thread, std::ref( results[i] ) );
+    for ( auto& t : threads )
+      t.join();
+    auto t1 = std::chrono::steady_clock::now();
+
+    unsigned long ntot(0), nbad(0);
+    for ( const auto& r : results ) {
+      ntot += r.nevents;
+      nbad += r.nbad;
+    }
+    const double seconds = std::chrono::duration<double>( t1 - t0 ).count();
+    const double throughput = ntot / seconds;
+    if ( nthreads == 1 )
+      throughput_1thread = throughput;
+    std::printf( "threads: %3u, events/s: %10.4g, speedup: x%6.2f,"
+                 " efficiency: %5.1f%%, bad events: %lu\n",
+                 nthreads, throughput, throughput / throughput_1thread,
+                 100.0 * throughput / ( throughput_1thread * nthreads ), nbad );
+    if ( nbad )
+      return 1;
+    if ( nthreads == maxthreads )
+      break;
+    nthreads = std::min( 2 * nthreads, maxthreads );
+  }
+  return 0;
+}
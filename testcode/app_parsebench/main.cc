@@ -0,0 +1,102 @@
+#include "NCKernelFile.hh"
+#include "NCKernelParser.hh"
+#include "NCrystal/internal/utils/NCString.hh"
+#include <chrono>
+#include <cstdio>
+
+// Microbenchmark of the @CUSTOM_BZSCOPE section parser. Compares the current
+// parser (NCP::parseCustomSection) against the original word-by-word parsing
+// loop (reproduced below), and checks that both give identical results.
+//
+// Usage: ncplugin_parsebench [file1.ncmat file2.ncmat ...]
+//
+// Without arguments, the data files shipped with the plugin are used.
+
+namespace {
+
+  //Parsing loop used by the plugin up to and including v0.0.1:
+  NC::ScatKnlData legacyParse( const NC::Info::CustomSectionData& raw )
+  {
+    NC::ScatKnlData phononSab;
+    NC::VectD *curField(nullptr);
+    double num(0.);
+    for ( const auto& line : raw ) {
+      for ( const auto& word : line ) {
+        if ( NC::safe_str2dbl( word, num ) ) {
+          curField->push_back(num);
+        } else if ( word == "alphagrid" ) {
+          curField = &phononSab.alphaGrid;
+        } else if ( word == "betagrid" ) {
+          curField = &phononSab.betaGrid;
+        } else if ( word == "sab_scaled" || word == "sab" ) {
+          curField = &phononSab.sab;
+        } else if ( word == "temperature" ) {
+          double t(0);
+          NC::safe_str2dbl( line[1], t );
+          phononSab.temperature.set(t);
+          break;
+        } else {
+          auto pos = word.find('r');
+          std::string digit = word.substr(0, pos);
+          NC::safe_str2dbl( digit, num );
+          std::string times = word.substr(pos+1, word.size()-1);
+          int rep(0);
+          NC::safe_str2int( times, rep );
+          for ( int i = 0; i < rep; ++i )
+            curField->push_back(num);
+        }
+      }
+    }
+    return phononSab;
+  }
+
+  template<class TFct>
+  double timeIt( unsigned nrepeat, TFct fct )
+  {
+    auto t0 = std::chrono::steady_clock::now();
+    for ( unsigned i = 0; i < nrepeat; ++i )
+      fct();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double,std::milli>( t1 - t0 ).count() / nrepeat;
+  }
+
+}
+
+int main( int argc, char** argv )
+{
+  NC::libClashDetect();
+
+  std::vector<std::string> files;
+  for ( int i = 1; i < argc; ++i )
+    files.emplace_back( argv[i] );
+  if ( files.empty() )
+    files = NCP::pluginDataFiles();
+  if ( files.empty() ) {
+    std::fprintf( stderr, "No input files given, and no data files found in the"
+                  " data directory of the plugin\n" );
+    return 1;
+  }
+
+  const unsigned nrepeat = 10;
+  for ( const auto& fn : files ) {
+    auto info = NC::createInfo( fn );
+    const auto& raw = info->getCustomSection( NCP::pluginNameUpperCase() );
+    std::size_t nwords = 0;
+    for ( const auto& line : raw )
+      nwords += line.size();
+
+    NC::ScatKnlData res_legacy, res_new;
+    const double t_legacy = timeIt( nrepeat, [&res_legacy,&raw](){ res_legacy = legacyParse( raw ); } );
+    const double t_new = timeIt( nrepeat, [&res_new,&raw](){ res_new = NCP::parseCustomSection( raw ); } );
+    const bool identical = ( res_legacy.alphaGrid == res_new.alphaGrid
+                             && res_legacy.betaGrid == res_new.betaGrid
+                             && res_legacy.sab == res_new.sab );
+    std::printf( "%s: %zu words, %zu kernel values, before: %.2f ms, after: %.2f ms"
+                 " (speedup x%.1f), identical results: %s\n",
+                 fn.c_str(), nwords, res_new.sab.size(), t_legacy, t_new,
+                 t_legacy / t_new, identical ? "yes" : "NO" );
+    if ( !identical )
+      return 1;
+  }
+  return 0;
+}
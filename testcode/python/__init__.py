@@ -9,32 +9,84 @@ random.seed(123456)#reproducible random streams
 
 class PhysicsModel:
 
-    """Python version of the PhysicsModel class defined in the plugin."""
+    """Python version of the PhysicsModel class defined in the plugin. The model
+    is loaded once, and cross sections and scattering events are then computed
+    for numpy arrays of neutron energies in a single call. With nthreads>1, the
+    work is split over that many threads (nthreads=0 meaning one per hardware
+    thread), with results which do not depend on the number of threads."""
 
-    def __init__(self,sigma,lambda_cutoff):
-        """Initialise model. Refer to NCPhysicsModel.hh for the meaning of the parameters."""
-        self.__modelparams=(sigma,lambda_cutoff)
+    def __init__(self,cfgstr=None,*,data=None,cfgparams=''):
+        """Load model either from a cfg-string, like
+        "plugins::BzScope/bzscope_beo_c1_300K.ncmat;temp=300K", or from NCMAT
+        data in a string (passing data=... and optionally cfgparams like
+        ";temp=300K")."""
+        import ctypes
+        registerPlugin()
+        self.__handle = None
+        handle = ctypes.c_void_p()
+        if (cfgstr is None) == (data is None):
+            raise ValueError('Specify exactly one of cfgstr and data')
+        if data is not None:
+            _hooks['createmodelfromdata'](data.encode(),cfgparams.encode(),ctypes.byref(handle))
+        else:
+            _hooks['createmodel'](cfgstr.encode(),ctypes.byref(handle))
+        self.__handle = handle
 
-    def calcCrossSection(self,ekin):
+    def __del__(self):
+        if self.__handle is not None:
+            _hooks['deletemodel'](self.__handle)
+
+    def calcCrossSection(self,ekin,*,nthreads=1,out=None):
         """Calculates cross sections. The ekin parameter can be a float or a numpy
-        array, and the return value will be similar."""
+        array, and the return value will be similar. Results can be written
+        to an existing float64 array passed as out (avoiding allocations)."""
         scalar = not hasattr(ekin,'__len__')
-        ekin = np.atleast_1d(ekin)
-        xs = np.empty(ekin.size)
-        _hooks['getmanyxsvalues'](*self.__modelparams,ekin.size,ekin,xs)
+        ekin = np.ascontiguousarray(np.atleast_1d(ekin),dtype=np.float64)#no copy if already suitable
+        xs = np.empty(ekin.size) if out is None else out
+        if xs.size != ekin.size:
+            raise ValueError('out array has wrong size')
+        _hooks['getmanyxsvalues_mt'](self.__handle,nthreads,ekin.size,ekin,xs)
         return xs[0] if scalar else xs
 
-    def sampleScatMu(self,ekin,nvalues = 1):
+    def sampleScatter(self,ekin,nvalues=None,*,nthreads=1,out_ekin=None,out_mu=None,
+                      seed=None,first_event_id=0):
+        """Samples scattering events, returning (ekin_final,mu) where
+        mu=cos(theta_scat). The ekin parameter can be a numpy array (one event
+        for each energy), or a float (nvalues events at that energy). Results
+        can be written to existing float64 arrays passed as out_ekin and
+        out_mu. If a seed is given, event i gets its own random stream derived
+        from the seed and the event ID first_event_id+i, so results are
+        reproducible bit by bit (whatever nthreads, and however the events are
+        split over calls)."""
+        if hasattr(ekin,'__len__'):
+            ekin = np.ascontiguousarray(ekin,dtype=np.float64)
+        else:
+            ekin = np.full(1 if nvalues is None else nvalues, float(ekin))
+        ekin_final = np.empty(ekin.size) if out_ekin is None else out_ekin
+        mu = np.empty(ekin.size) if out_mu is None else out_mu
+        if ekin_final.size != ekin.size or mu.size != ekin.size:
+            raise ValueError('output arrays have wrong size')
+        if seed is not None:
+            _hooks['samplemanyscat_reproducible_mt'](self.__handle,nthreads,seed,first_event_id,
+                                                     ekin.size,ekin,ekin_final,mu)
+        else:
+            _hooks['samplemanyscat_mt'](self.__handle,nthreads,ekin.size,ekin,ekin_final,mu)
+        return ekin_final, mu
+
+    def sampleScatMu(self,ekin,nvalues = 1,*,nthreads=1):
         """Samples scattering mu=cos(theta_scat). The ekin parameter must be a float. If
         nvalues>1, returns a numpy array of results."""
-        mu = np.empty(nvalues)
-        _hooks['samplemanyscatmu'](*self.__modelparams,ekin,nvalues,mu)
+        _, mu = self.sampleScatter(ekin,nvalues,nthreads=nthreads)
         return mu if nvalues>1 else mu[0]
 
+_registered = [False]
 def registerPlugin():
-    """Activate the plugin by registering with NCrystal."""
+    """Activate the plugin by registering with NCrystal (does nothing if already done)."""
+    if _registered[0]:
+        return
     import NCrystal#Make sure NCrystal is loaded first
     _hooks['ncplugin_register']()
+    _registered[0] = True
 
 def pluginName():
     return _name
@@ -38,16 +38,56 @@ def _setuptestlibhooks():
     #Use numpy ctypes integration, to transparently accept numpy arrays as double* arguments.
     from numpy.ctypeslib import ndpointer
     npdoubleptr = ndpointer(ctypes.c_double, flags="C_CONTIGUOUS")
+    npdoubleptr_out = ndpointer(ctypes.c_double, flags="C_CONTIGUOUS,WRITEABLE")
 
-    f = lib.nctest_samplemanyscatmu
+    voidptr = ctypes.c_void_p
+    uint64 = ctypes.c_uint64
+
+    f = lib.nctest_lasterror
+    f.restype = ctypes.c_char_p
+    f.argtypes = []
+    hooks['lasterror'] = f
+
+    def _checked(f):
+        #Functions return non-zero (with the message in nctest_lasterror) on errors:
+        f.restype = ctypes.c_int
+        def wrapped(*args):
+            if f(*args) != 0:
+                raise RuntimeError(hooks['lasterror']().decode())
+        return wrapped
+
+    f = lib.nctest_createmodel
+    f.argtypes = [ ctypes.c_char_p, ctypes.POINTER(voidptr) ]
+    hooks['createmodel'] = _checked(f)
+
+    f = lib.nctest_createmodelfromdata
+    f.argtypes = [ ctypes.c_char_p, ctypes.c_char_p, ctypes.POINTER(voidptr) ]
+    hooks['createmodelfromdata'] = _checked(f)
+
+    f = lib.nctest_deletemodel
     f.restype = None # void
-    f.argtypes = [ ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_uint, npdoubleptr ]
-    hooks['samplemanyscatmu'] = f
+    f.argtypes = [ voidptr ]
+    hooks['deletemodel'] = f
 
     f = lib.nctest_getmanyxsvalues
-    f.restype = None # void
-    f.argtypes = [ ctypes.c_double, ctypes.c_double, ctypes.c_uint, npdoubleptr, npdoubleptr ]
-    hooks['getmanyxsvalues'] = f
+    f.argtypes = [ voidptr, uint64, npdoubleptr, npdoubleptr_out ]
+    hooks['getmanyxsvalues'] = _checked(f)
+
+    f = lib.nctest_getmanyxsvalues_mt
+    f.argtypes = [ voidptr, ctypes.c_uint, uint64, npdoubleptr, npdoubleptr_out ]
+    hooks['getmanyxsvalues_mt'] = _checked(f)
+
+    f = lib.nctest_samplemanyscat
+    f.argtypes = [ voidptr, uint64, npdoubleptr, npdoubleptr_out, npdoubleptr_out ]
+    hooks['samplemanyscat'] = _checked(f)
+
+    f = lib.nctest_samplemanyscat_mt
+    f.argtypes = [ voidptr, ctypes.c_uint, uint64, npdoubleptr, npdoubleptr_out, npdoubleptr_out ]
+    hooks['samplemanyscat_mt'] = _checked(f)
+
+    f = lib.nctest_samplemanyscat_reproducible_mt
+    f.argtypes = [ voidptr, ctypes.c_uint, uint64, uint64, uint64, npdoubleptr, npdoubleptr_out, npdoubleptr_out ]
+    hooks['samplemanyscat_reproducible_mt'] = _checked(f)
 
     hooks['ncplugin_register'] = lib.ncplugin_register
 
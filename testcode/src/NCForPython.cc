@@ -1,25 +1,172 @@
 #include "NCExtraTestUtils.hh"
+#include "NCParallel.hh"
+#include <atomic>
+#include <cstdint>
 
 // Expose crude (and horribly fragile) C functions which can be called from
 // Python via the ctypes module. Updates to function names and signatures in
-// this file should be carefully synchronised with code in the ../python/lib.py
-// file.
+// this file should be carefully synchronised with code in the
+// ../python/cbindings.py file.
+//
+// A PhysicsModel is loaded once (from a cfg-string or from NCMAT data in a
+// string) and referred to by an opaque handle. The batch functions then fill
+// caller-provided arrays in place. The arrays are split into fixed chunks, each
+// with its own NC::CachePtr and random stream (produced in chunk order before
+// any work starts), so results do not depend on the number of threads used.
+// The _reproducible sampling functions instead derive the random numbers of
+// each neutron from a seed and its index in the arrays (plus an offset), so
+// their results do not depend on the chunking or on any earlier calls either.
+// Functions return 0 on success, and otherwise 1 with the error message
+// available from nctest_lasterror(). Note that ctypes releases the GIL while
+// calling these functions.
+
+namespace {
+
+  constexpr std::size_t chunkSize = 16384;
+
+  thread_local std::string lastError;
+
+  struct ModelHandle {
+    NC::InfoPtr info;
+    NCP::PhysicsModel model;
+  };
+
+  template<class TFct>
+  int guarded( TFct&& fct )
+  {
+    try {
+      fct();
+    } catch ( std::exception& e ) {
+      lastError = e.what();
+      return 1;
+    }
+    return 0;
+  }
+
+  void * createModel( NC::InfoPtr info )
+  {
+    auto model = NCP::PhysicsModel::createFromInfo( *info );
+    return new ModelHandle{ std::move(info), std::move(model) };
+  }
+
+  std::size_t nchunks( std::uint64_t n )
+  {
+    return static_cast<std::size_t>( ( n + chunkSize - 1 ) / chunkSize );
+  }
+
+}
 
 extern "C" {
 
-  void nctest_getmanyxsvalues( double sigma, double lambda_cutoff, unsigned array_size, const double* ekin_array, double* output_xs_array )
+  const char * nctest_lasterror()
+  {
+    return lastError.c_str();
+  }
+
+  //Load model from a cfg-string like "plugins::BzScope/bzscope_beo_c1_300K.ncmat;temp=300K":
+  int nctest_createmodel( const char * cfgstr, void ** out_handle )
+  {
+    return guarded( [&]() { *out_handle = createModel( NC::createInfo( cfgstr ) ); } );
+  }
+
+  //Load model from NCMAT data in a string, with additional cfg-parameters (like ";temp=300K"):
+  int nctest_createmodelfromdata( const char * ncmat_data, const char * cfgparams, void ** out_handle )
+  {
+    return guarded( [&]()
+    {
+      static std::atomic<unsigned> counter{ 0 };
+      const std::string name = "ncplugin_pydata_" + std::to_string( counter++ ) + ".ncmat";
+      NC::registerInMemoryFileData( name, std::string( ncmat_data ) );
+      *out_handle = createModel( NC::createInfo( name + cfgparams ) );
+    } );
+  }
+
+  void nctest_deletemodel( void * handle )
+  {
+    delete static_cast<ModelHandle*>( handle );
+  }
+
+  int nctest_getmanyxsvalues_mt( void * handle, unsigned nthreads, std::uint64_t array_size,
+                                 const double* ekin_array, double* output_xs_array )
+  {
+    return guarded( [&]()
+    {
+      const auto& pm = static_cast<const ModelHandle*>( handle )->model;
+      NCP::parallelFor( NCP::resolveThreadCount( nthreads ), nchunks( array_size ), [&]( std::size_t ichunk )
+      {
+        const std::size_t i0 = ichunk * chunkSize;
+        NC::CachePtr cache;
+        pm.calcCrossSections( cache, ekin_array + i0, NC::ncmin<std::size_t>( chunkSize, array_size - i0 ),
+                              output_xs_array + i0 );
+      } );
+    } );
+  }
+
+  int nctest_getmanyxsvalues( void * handle, std::uint64_t array_size,
+                              const double* ekin_array, double* output_xs_array )
+  {
+    return nctest_getmanyxsvalues_mt( handle, 1, array_size, ekin_array, output_xs_array );
+  }
+
+  int nctest_samplemanyscat_mt( void * handle, unsigned nthreads, std::uint64_t array_size,
+                                const double* ekin_array, double* output_ekin_final, double* output_mu )
+  {
+    return guarded( [&]()
+    {
+      const auto& pm = static_cast<const ModelHandle*>( handle )->model;
+      auto rngproducer = NC::getDefaultRNGProducer();
+      std::vector<decltype(rngproducer->produce())> rngs;
+      for ( std::size_t i = 0; i < nchunks( array_size ); ++i )
+        rngs.push_back( rngproducer->produce() );
+      NCP::parallelFor( NCP::resolveThreadCount( nthreads ), rngs.size(), [&]( std::size_t ichunk )
+      {
+        const std::size_t i0 = ichunk * chunkSize;
+        const std::size_t i1 = NC::ncmin<std::size_t>( i0 + chunkSize, array_size );
+        NC::CachePtr cache;
+        NCP::PhysicsModel::ScatEvent events[256];
+        for ( std::size_t j0 = i0; j0 < i1; j0 += 256 ) {
+          const std::size_t n = NC::ncmin<std::size_t>( 256, i1 - j0 );
+          pm.sampleScatteringEvents( cache, *rngs[ichunk], ekin_array + j0, n, events );
+          for ( std::size_t j = 0; j < n; ++j ) {
+            output_ekin_final[j0+j] = events[j].ekin_final;
+            output_mu[j0+j] = events[j].mu;
+          }
+        }
+      } );
+    } );
+  }
+
+  //Event i (i.e. the neutron at ekin_array[i]) gets the event ID first_event_id+i:
+  int nctest_samplemanyscat_reproducible_mt( void * handle, unsigned nthreads, std::uint64_t seed,
+                                             std::uint64_t first_event_id, std::uint64_t array_size,
+                                             const double* ekin_array, double* output_ekin_final,
+                                             double* output_mu )
   {
-    // NCP::PhysicsModel pm(sigma,lambda_cutoff);
-    // for (unsigned i = 0; i < array_size; ++i)
-    //   output_xs_array[i] = pm.calcCrossSection(ekin_array[i]);
+    return guarded( [&]()
+    {
+      const auto& pm = static_cast<const ModelHandle*>( handle )->model;
+      NCP::parallelFor( NCP::resolveThreadCount( nthreads ), nchunks( array_size ), [&]( std::size_t ichunk )
+      {
+        const std::size_t i0 = ichunk * chunkSize;
+        const std::size_t i1 = NC::ncmin<std::size_t>( i0 + chunkSize, array_size );
+        NC::CachePtr cache;
+        NCP::PhysicsModel::ScatEvent events[256];
+        for ( std::size_t j0 = i0; j0 < i1; j0 += 256 ) {
+          const std::size_t n = NC::ncmin<std::size_t>( 256, i1 - j0 );
+          pm.sampleScatteringEvents( cache, seed, first_event_id + j0, ekin_array + j0, n, events );
+          for ( std::size_t j = 0; j < n; ++j ) {
+            output_ekin_final[j0+j] = events[j].ekin_final;
+            output_mu[j0+j] = events[j].mu;
+          }
+        }
+      } );
+    } );
   }
 
-  void nctest_samplemanyscatmu( double sigma, double lambda_cutoff, double ekin, unsigned nvalues, double* output_mu )
+  int nctest_samplemanyscat( void * handle, std::uint64_t array_size, const double* ekin_array,
+                             double* output_ekin_final, double* output_mu )
   {
-    // NCP::PhysicsModel pm(sigma,lambda_cutoff);
-    // auto rng = NC::getRNG();
-    // for (unsigned i = 0; i < nvalues; ++i)
-    //   output_mu[i] = pm.sampleScatteringEvent(rng,ekin).mu;
+    return nctest_samplemanyscat_mt( handle, 1, array_size, ekin_array, output_ekin_final, output_mu );
   }
 
 }